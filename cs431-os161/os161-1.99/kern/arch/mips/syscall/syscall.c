@@ -35,8 +35,150 @@
 #include <thread.h>
 #include <current.h>
 #include <syscall.h>
+#include <endian.h>
+#include <copyinout.h>
+#include <kern/sysbatch.h>
 
 
+/*
+ * Run system call CALLNO. A holds the register arguments a0-a3;
+ * anything further is fetched from user address STACKARGS. This is
+ * shared by the trap path below and by sys_sysbatch. The result goes
+ * in *RETVAL, or for calls returning 64 bits in *RETVAL64 with *RET64
+ * set.
+ */
+static
+int
+syscall_dispatch(int callno, const uint32_t *a, const_userptr_t stackargs,
+		 int32_t *retval, off_t *retval64, bool *ret64)
+{
+	int err;
+#ifdef UW
+	off_t pos;
+	int whence;
+#endif
+
+	switch (callno) {
+	    case SYS_reboot:
+		err = sys_reboot(a[0]);
+		break;
+
+	    case SYS___time:
+		err = sys___time((userptr_t)a[0],
+				 (userptr_t)a[1]);
+		break;
+#ifdef UW
+	case SYS_write:
+	  err = sys_write((int)a[0],
+			  (userptr_t)a[1],
+			  (int)a[2],
+			  (int *)retval);
+	  break;
+	case SYS_read:
+	  err = sys_read((int)a[0],
+			 (userptr_t)a[1],
+			 (int)a[2],
+			 (int *)retval);
+	  break;
+	case SYS_close:
+	  err = sys_close((int)a[0]);
+	  break;
+	case SYS_open:
+	  err = sys_open((userptr_t)a[0],
+			 (int)a[1],
+			 (mode_t)a[2],
+			 (int *)retval);
+	  break;
+	case SYS_readv:
+	  err = sys_readv((int)a[0],
+			  (userptr_t)a[1],
+			  (int)a[2],
+			  (int *)retval);
+	  break;
+	case SYS_writev:
+	  err = sys_writev((int)a[0],
+			   (userptr_t)a[1],
+			   (int)a[2],
+			   (int *)retval);
+	  break;
+	case SYS_pread:
+	case SYS_pwrite:
+	  /* the 64-bit offset doesn't fit in a2/a3 after nbytes */
+	  err = copyin(stackargs, &pos, sizeof(pos));
+	  if (err) {
+	    break;
+	  }
+	  if (callno == SYS_pread) {
+	    err = sys_pread((int)a[0],
+			    (userptr_t)a[1],
+			    (int)a[2],
+			    pos,
+			    (int *)retval);
+	  }
+	  else {
+	    err = sys_pwrite((int)a[0],
+			     (userptr_t)a[1],
+			     (int)a[2],
+			     pos,
+			     (int *)retval);
+	  }
+	  break;
+	case SYS_lseek:
+	  /* offset is in the aligned pair a2/a3, whence on the stack */
+	  join32to64(a[2], a[3], (uint64_t *)&pos);
+	  err = copyin(stackargs, &whence, sizeof(whence));
+	  if (err) {
+	    break;
+	  }
+	  err = sys_lseek((int)a[0], pos, whence, retval64);
+	  *ret64 = true;
+	  break;
+	case SYS_sendfile:
+	  err = sys_sendfile((int)a[0],
+			     (int)a[1],
+			     (userptr_t)a[2],
+			     (size_t)a[3],
+			     (int *)retval);
+	  break;
+	case SYS_pipe:
+	  err = sys_pipe((userptr_t)a[0]);
+	  break;
+	case SYS__exit:
+	  sys__exit((int)a[0]);
+	  /* sys__exit does not return, execution should not get here */
+	  panic("unexpected return from sys__exit");
+	  break;
+	case SYS_getpid:
+	  err = sys_getpid((pid_t *)retval);
+	  break;
+	case SYS_waitpid:
+	  err = sys_waitpid((pid_t)a[0],
+			    (userptr_t)a[1],
+			    (int)a[2],
+			    (pid_t *)retval);
+	  break;
+	case SYS_execv:
+	  err = sys_execv((userptr_t)a[0],
+			  (userptr_t)a[1]);
+	  break;
+	case SYS_sysbatch:
+	  err = sys_sysbatch((userptr_t)a[0],
+			     (int)a[1],
+			     (int *)retval);
+	  break;
+#endif // UW
+
+	    /* Add stuff here */
+ 
+	default:
+	  kprintf("Unknown syscall %d\n", callno);
+	  err = ENOSYS;
+	  break;
+	}
+
+	return err;
+}
+
 /*
  * System call dispatcher.
  *
@@ -79,7 +221,10 @@ void
 syscall(struct trapframe *tf)
 {
 	int callno;
+	uint32_t args[4];
 	int32_t retval;
+	off_t retval64;
+	bool ret64;
 	int err;
 
 	KASSERT(curthread != NULL);
@@ -87,6 +232,10 @@ syscall(struct trapframe *tf)
 	KASSERT(curthread->t_iplhigh_count == 0);
 
 	callno = tf->tf_v0;
+	args[0] = tf->tf_a0;
+	args[1] = tf->tf_a1;
+	args[2] = tf->tf_a2;
+	args[3] = tf->tf_a3;
 
 	/*
 	 * Initialize retval to 0. Many of the system calls don't
@@ -98,47 +247,10 @@ syscall(struct trapframe *tf)
 	 */
 
 	retval = 0;
+	ret64 = false;
 
-	switch (callno) {
-	    case SYS_reboot:
-		err = sys_reboot(tf->tf_a0);
-		break;
-
-	    case SYS___time:
-		err = sys___time((userptr_t)tf->tf_a0,
-				 (userptr_t)tf->tf_a1);
-		break;
-#ifdef UW
-	case SYS_write:
-	  err = sys_write((int)tf->tf_a0,
-			  (userptr_t)tf->tf_a1,
-			  (int)tf->tf_a2,
-			  (int *)(&retval));
-	  break;
-	case SYS__exit:
-	  sys__exit((int)tf->tf_a0);
-	  /* sys__exit does not return, execution should not get here */
-	  panic("unexpected return from sys__exit");
-	  break;
-	case SYS_getpid:
-	  err = sys_getpid((pid_t *)&retval);
-	  break;
-	case SYS_waitpid:
-	  err = sys_waitpid((pid_t)tf->tf_a0,
-			    (userptr_t)tf->tf_a1,
-			    (int)tf->tf_a2,
-			    (pid_t *)&retval);
-	  break;
-#endif // UW
-
-	    /* Add stuff here */
- 
-	default:
-	  kprintf("Unknown syscall %d\n", callno);
-	  err = ENOSYS;
-	  break;
-	}
-
+	err = syscall_dispatch(callno, args, (const_userptr_t)(tf->tf_sp + 16),
+			       &retval, &retval64, &ret64);
 
 	if (err) {
 		/*
@@ -152,6 +264,10 @@ syscall(struct trapframe *tf)
 	else {
 		/* Success. */
 		tf->tf_v0 = retval;
+		if (ret64) {
+			/* 64-bit results go in v0 (high) and v1 (low) */
+			split64to32(retval64, &tf->tf_v0, &tf->tf_v1);
+		}
 		tf->tf_a3 = 0;      /* signal no error */
 	}
 	
@@ -168,6 +284,88 @@ syscall(struct trapframe *tf)
 	KASSERT(curthread->t_iplhigh_count == 0);
 }
 
+#ifdef UW
+/*
+ * Batched system calls: run the N entries of the user array UENTS in
+ * order, stopping after the first one that fails, and hand back how
+ * many were run. Entries are brought in and written back a chunk at a
+ * time, so a long batch costs one trap plus one copyin and one copyout
+ * per chunk. See <kern/sysbatch.h> for the entry layout.
+ */
+#define SYSBATCH_CHUNK 8
+
+int
+sys_sysbatch(userptr_t uents, int n, int *retval)
+{
+	struct sysbatch ents[SYSBATCH_CHUNK];
+	struct sysbatch *uchunk, *sb;
+	int32_t ret32;
+	off_t ret64val;
+	bool ret64;
+	int done, count, i, err;
+	bool stop;
+
+	if (n < 0 || n > SYSBATCH_MAX) {
+		return EINVAL;
+	}
+
+	done = 0;
+	stop = false;
+	err = 0;
+	while (done < n && !stop) {
+		uchunk = (struct sysbatch *)uents + done;
+		count = n - done;
+		if (count > SYSBATCH_CHUNK) {
+			count = SYSBATCH_CHUNK;
+		}
+		err = copyin((const_userptr_t)uchunk, ents,
+			     count * sizeof(struct sysbatch));
+		if (err) {
+			break;
+		}
+
+		for (i=0; i<count && !stop; i++) {
+			sb = &ents[i];
+			switch (sb->sb_callno) {
+			    case SYS__exit:
+			    case SYS_execv:
+			    case SYS_sysbatch:
+				/* these don't come back, or would nest */
+				sb->sb_err = EINVAL;
+				break;
+			    default:
+				ret32 = 0;
+				ret64 = false;
+				sb->sb_err = syscall_dispatch(sb->sb_callno,
+				    sb->sb_args,
+				    (const_userptr_t)&uchunk[i].sb_args[4],
+				    &ret32, &ret64val, &ret64);
+				sb->sb_retval = ret64 ? ret64val : ret32;
+				break;
+			}
+			if (sb->sb_err) {
+				stop = true;
+			}
+		}
+
+		/* these ran whether or not the results get back */
+		done += i;
+		err = copyout(ents, (userptr_t)uchunk,
+			      i * sizeof(struct sysbatch));
+		if (err) {
+			break;
+		}
+	}
+
+	/* report a fault only if nothing was run */
+	if (err && done == 0) {
+		return err;
+	}
+	*retval = done;
+	return 0;
+}
+#endif /* UW */
+
 /*
  * Enter user mode for a newly forked process.
  *
@@ -46,8 +46,10 @@
  * and (2) if the system crashes before we find a console, no output
  * at all may appear.
  *
- * Note that we have no input buffering; characters typed too rapidly
- * will be lost.
+ * Output is buffered: putch and writes to con: queue characters in a
+ * ring and return, and the write-done interrupt sends the next one.
+ * A writer only waits if the ring is full. Input is buffered only
+ * lightly; characters typed too rapidly will be lost.
  */
 
 #include <types.h>
@@ -57,6 +59,7 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
 #include <generic/console.h>
 #include <vfs.h>
 #include <device.h>
@@ -113,12 +116,32 @@ flush_delay_buf(void)
 
 /*
  * Print a character, using polling instead of interrupts to wait for
- * I/O completion.
+ * I/O completion. Anything still in the output ring goes first, so
+ * that output comes out in order (and a panic message doesn't go out
+ * ahead of what led up to it).
  */
 static
 void
 putch_polled(struct con_softc *cs, int ch)
 {
+	bool drained = false;
+
+	/* don't deadlock if we were interrupted (or died) in the middle */
+	if (!spinlock_do_i_hold(&cs->cs_txlock)) {
+		spinlock_acquire(&cs->cs_txlock);
+		while (cs->cs_txtail != cs->cs_txhead) {
+			cs->cs_sendpolled(cs->cs_devdata,
+					  cs->cs_txbuf[cs->cs_txtail]);
+			cs->cs_txtail = (cs->cs_txtail + 1) %
+				CONSOLE_OUTPUT_BUFFER_SIZE;
+			drained = true;
+		}
+		if (drained) {
+			wchan_wakeall(cs->cs_txwchan);
+		}
+		spinlock_release(&cs->cs_txlock);
+	}
+
 	cs->cs_sendpolled(cs->cs_devdata, ch);
 }
 
@@ -142,6 +165,43 @@ putch_complete_polled(struct con_softc *cs)
 
 //////////////////////////////////////////////////
 
+/*
+ * Queue LEN characters for output, using interrupts to send them. If
+ * the device is idle the first one is sent right away. Waits only if
+ * the ring fills up.
+ */
+static
+void
+putbuf_intr(struct con_softc *cs, const char *buf, size_t len)
+{
+	unsigned nexthead;
+	size_t i = 0;
+
+	spinlock_acquire(&cs->cs_txlock);
+	while (i < len) {
+		if (!cs->cs_txbusy) {
+			KASSERT(cs->cs_txhead == cs->cs_txtail);
+			cs->cs_txbusy = true;
+			cs->cs_send(cs->cs_devdata, buf[i++]);
+			continue;
+		}
+
+		nexthead = (cs->cs_txhead + 1) % CONSOLE_OUTPUT_BUFFER_SIZE;
+		if (nexthead == cs->cs_txtail) {
+			/* full; con_start wakes us once it's half empty */
+			wchan_lock(cs->cs_txwchan);
+			spinlock_release(&cs->cs_txlock);
+			wchan_sleep(cs->cs_txwchan);
+			spinlock_acquire(&cs->cs_txlock);
+			continue;
+		}
+
+		cs->cs_txbuf[cs->cs_txhead] = buf[i++];
+		cs->cs_txhead = nexthead;
+	}
+	spinlock_release(&cs->cs_txlock);
+}
+
 /*
  * Print a character, using interrupts to wait for I/O completion.
  */
@@ -149,8 +209,9 @@ static
 void
 putch_intr(struct con_softc *cs, int ch)
 {
-	P(cs->cs_wsem);
-	cs->cs_send(cs->cs_devdata, ch);
+	char c = ch;
+
+	putbuf_intr(cs, &c, 1);
 }
 
 /*
@@ -198,13 +259,38 @@ con_input(void *vcs, int ch)
 
 /*
  * Called from underlying device when a write-done interrupt occurs.
+ * Send the next queued character, if there is one.
  */
 void
 con_start(void *vcs)
 {
 	struct con_softc *cs = vcs;
+	unsigned ch, count;
+
+	spinlock_acquire(&cs->cs_txlock);
+
+	if (cs->cs_txtail == cs->cs_txhead) {
+		cs->cs_txbusy = false;
+		spinlock_release(&cs->cs_txlock);
+		return;
+	}
+
+	ch = cs->cs_txbuf[cs->cs_txtail];
+	cs->cs_txtail = (cs->cs_txtail + 1) % CONSOLE_OUTPUT_BUFFER_SIZE;
+	cs->cs_send(cs->cs_devdata, ch);
+
+	/*
+	 * Writers only wait when the ring is full, so it must pass
+	 * through half full before emptying. Waking them there rather
+	 * than for every slot lets them queue a good batch at once.
+	 */
+	count = (cs->cs_txhead + CONSOLE_OUTPUT_BUFFER_SIZE - cs->cs_txtail)
+		% CONSOLE_OUTPUT_BUFFER_SIZE;
+	if (count == CONSOLE_OUTPUT_BUFFER_SIZE / 2) {
+		wchan_wakeall(cs->cs_txwchan);
+	}
 
-	V(cs->cs_wsem);
+	spinlock_release(&cs->cs_txlock);
 }
 
 //////////////////////////////////////////////////
@@ -298,16 +384,22 @@ con_close(struct device *dev)
 	return 0;
 }
 
+/*
+ * User output is copied in this much at a time.
+ */
+#define CON_WCHUNK 256
+
 static
 int
 con_io(struct device *dev, struct uio *uio)
 {
+	struct con_softc *cs = dev->d_data;
+	char buf[CON_WCHUNK];
+	size_t len, i, start;
 	int result;
 	char ch;
 	struct lock *lk;
 
-	(void)dev;  // unused
-
 	if (uio->uio_rw==UIO_READ) {
 		lk = con_userlock_read;
 	}
@@ -334,15 +426,24 @@ con_io(struct device *dev, struct uio *uio)
 			}
 		}
 		else {
-			result = uiomove(&ch, 1, uio);
+			len = uio->uio_resid;
+			if (len > sizeof(buf)) {
+				len = sizeof(buf);
+			}
+			result = uiomove(buf, len, uio);
 			if (result) {
 				lock_release(lk);
 				return result;
 			}
-			if (ch=='\n') {
-				putch('\r');
+			/* queue it in runs, putting a CR before each LF */
+			for (i=start=0; i<len; i++) {
+				if (buf[i]=='\n') {
+					putbuf_intr(cs, buf+start, i-start);
+					putbuf_intr(cs, "\r", 1);
+					start = i;
+				}
 			}
-			putch(ch);
+			putbuf_intr(cs, buf+start, len-start);
 		}
 	}
 	lock_release(lk);
@@ -376,6 +477,7 @@ attach_console_to_vfs(struct con_softc *cs)
 	dev->d_close = con_close;
 	dev->d_io = con_io;
 	dev->d_ioctl = con_ioctl;
+	dev->d_submit = NULL;
 	dev->d_blocks = 0;
 	dev->d_blocksize = 1;
 	dev->d_data = cs;
@@ -398,7 +500,8 @@ attach_console_to_vfs(struct con_softc *cs)
 int
 config_con(struct con_softc *cs, int unit)
 {
-	struct semaphore *rsem, *wsem;
+	struct semaphore *rsem;
+	struct wchan *wwc;
 	struct lock *rlk, *wlk;
 
 	/*
@@ -418,29 +521,33 @@ config_con(struct con_softc *cs, int unit)
 	if (rsem == NULL) {
 		return ENOMEM;
 	}
-	wsem = sem_create("console write", 1);
-	if (wsem == NULL) {
+	wwc = wchan_create("console write");
+	if (wwc == NULL) {
 		sem_destroy(rsem);
 		return ENOMEM;
 	}
 	rlk = lock_create("console-lock-read");
 	if (rlk == NULL) {
 		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(wwc);
 		return ENOMEM;
 	}
 	wlk = lock_create("console-lock-write");
 	if (wlk == NULL) {
 		lock_destroy(rlk);
 		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(wwc);
 		return ENOMEM;
 	}
 
 	cs->cs_rsem = rsem; 
-	cs->cs_wsem = wsem; 
 	cs->cs_gotchars_head = 0;
 	cs->cs_gotchars_tail = 0;
+	spinlock_init(&cs->cs_txlock);
+	cs->cs_txwchan = wwc;
+	cs->cs_txhead = 0;
+	cs->cs_txtail = 0;
+	cs->cs_txbusy = false;
 
 	the_console = cs;
 	con_userlock_read = rlk;
@@ -30,14 +30,21 @@
 #ifndef _GENERIC_CONSOLE_H_
 #define _GENERIC_CONSOLE_H_
 
+#include <spinlock.h>
+
 /*
  * Device data for the hardware-independent system console.
  *
  * devdata, send, and sendpolled are provided by the underlying
  * device, and are to be initialized by the attach routine.
+ *
+ * Output waits in cs_txbuf and is fed to the device a character at a
+ * time from its write-done interrupt. If cs_txbusy is clear the device
+ * is idle and cs_txbuf is empty.
  */
 
 #define CONSOLE_INPUT_BUFFER_SIZE 32
+#define CONSOLE_OUTPUT_BUFFER_SIZE 1024
 
 struct con_softc {
 	/* initialized by attach routine */
@@ -49,10 +56,16 @@ struct con_softc {
 
 	/* initialized by config routine */
 	struct semaphore *cs_rsem;
-	struct semaphore *cs_wsem;
 	unsigned char cs_gotchars[CONSOLE_INPUT_BUFFER_SIZE];
 	unsigned cs_gotchars_head;	/* next slot to put a char in */
 	unsigned cs_gotchars_tail;	/* next slot to take a char out */
+
+	struct spinlock cs_txlock;	/* protects the cs_tx fields */
+	struct wchan *cs_txwchan;	/* to wait for room in cs_txbuf */
+	unsigned char cs_txbuf[CONSOLE_OUTPUT_BUFFER_SIZE];
+	unsigned cs_txhead;		/* next slot to put a char in */
+	unsigned cs_txtail;		/* next slot to take a char out */
+	bool cs_txbusy;			/* device is sending a char */
 };
 
 /*
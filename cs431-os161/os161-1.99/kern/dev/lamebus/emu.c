@@ -389,6 +389,343 @@ emu_trunc(struct emu_softc *sc, uint32_t handle, off_t len)
 //
 ////////////////////////////////////////////////////////////
 
+////////////////////////////////////////////////////////////
+//
+// Caching
+//
+// File data read through emufs is kept in a small page cache, so that
+// reading the same file again (running the same program over and over,
+// say) doesn't have to go back to the host each time. A run of pages
+// missing from the cache is read in with one device operation.
+//
+// Cached pages belong to a vnode, and go when it does. So that they
+// last from one open of a file to the next, the last few names looked
+// up are remembered, along with the vnodes they found.
+//
+// Any write or truncate throws out the whole page cache, as the same
+// host file can be open through more than one handle. Changes made on
+// the host behind our back aren't noticed.
+//
+// The cache lock is never held across device operations or copies to
+// and from user space; pages in use meanwhile are marked busy. Since
+// the device can only do one thing at a time, data going to and from
+// it is also staged in cache pages, so that the device lock is only
+// held while the device is actually busy. In particular a page fault
+// in a user buffer never holds up anyone else's I/O.
+//
+
+/* Most pages read in at once */
+#define EMUFS_MAXFILL	(EMU_MAXIO / EMUFS_PAGESIZE)
+
+/*
+ * Set up the caches of a new emufs.
+ */
+static
+int
+emufs_cache_init(struct emufs_fs *ef)
+{
+	unsigned i;
+
+	ef->ef_cachelock = lock_create("emufs-cache");
+	if (ef->ef_cachelock == NULL) {
+		return ENOMEM;
+	}
+	ef->ef_cachecv = cv_create("emufs-cache");
+	if (ef->ef_cachecv == NULL) {
+		lock_destroy(ef->ef_cachelock);
+		return ENOMEM;
+	}
+	for (i=0; i<EMUFS_NPAGES; i++) {
+		ef->ef_pages[i].ep_ev = NULL;
+		ef->ef_pages[i].ep_busy = 0;
+		ef->ef_pages[i].ep_filling = false;
+		ef->ef_pages[i].ep_data = kmalloc(EMUFS_PAGESIZE);
+		if (ef->ef_pages[i].ep_data == NULL) {
+			while (i-- > 0) {
+				kfree(ef->ef_pages[i].ep_data);
+			}
+			cv_destroy(ef->ef_cachecv);
+			lock_destroy(ef->ef_cachelock);
+			return ENOMEM;
+		}
+	}
+	ef->ef_pageclock = 0;
+
+	for (i=0; i<EMUFS_NNAMES; i++) {
+		ef->ef_names[i].en_dir = NULL;
+	}
+	ef->ef_nameclock = 0;
+
+	return 0;
+}
+
+/*
+ * Drop the cached pages of EV, or of every file if EV is NULL. Busy
+ * pages stay with whoever is using them, but can't be found again.
+ */
+static
+void
+emufs_purgepages(struct emufs_fs *ef, struct emufs_vnode *ev)
+{
+	unsigned i;
+
+	lock_acquire(ef->ef_cachelock);
+	for (i=0; i<EMUFS_NPAGES; i++) {
+		if (ev == NULL || ef->ef_pages[i].ep_ev == ev) {
+			ef->ef_pages[i].ep_ev = NULL;
+		}
+	}
+	lock_release(ef->ef_cachelock);
+}
+
+static
+struct emufs_page *
+emufs_findpage(struct emufs_fs *ef, struct emufs_vnode *ev, uint32_t pageno)
+{
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(ef->ef_cachelock));
+
+	for (i=0; i<EMUFS_NPAGES; i++) {
+		if (ef->ef_pages[i].ep_ev == ev &&
+		    ef->ef_pages[i].ep_pageno == pageno) {
+			return &ef->ef_pages[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take a page for new use: an empty one if there is one, otherwise
+ * the least recently used that isn't busy. If every page is busy,
+ * wait for one, or with NOWAIT return NULL. The page comes back empty
+ * and busy.
+ */
+static
+struct emufs_page *
+emufs_getpage(struct emufs_fs *ef, bool nowait)
+{
+	struct emufs_page *pg;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(ef->ef_cachelock));
+
+	while (1) {
+		pg = NULL;
+		for (i=0; i<EMUFS_NPAGES; i++) {
+			if (ef->ef_pages[i].ep_busy > 0) {
+				continue;
+			}
+			if (ef->ef_pages[i].ep_ev == NULL) {
+				pg = &ef->ef_pages[i];
+				break;
+			}
+			if (pg == NULL ||
+			    ef->ef_pages[i].ep_stamp < pg->ep_stamp) {
+				pg = &ef->ef_pages[i];
+			}
+		}
+		if (pg != NULL || nowait) {
+			break;
+		}
+		cv_wait(ef->ef_cachecv, ef->ef_cachelock);
+	}
+
+	if (pg != NULL) {
+		pg->ep_ev = NULL;
+		pg->ep_busy = 1;
+		pg->ep_filling = false;
+	}
+	return pg;
+}
+
+/*
+ * Done using a page.
+ */
+static
+void
+emufs_putpage(struct emufs_fs *ef, struct emufs_page *pg)
+{
+	KASSERT(lock_do_i_hold(ef->ef_cachelock));
+	KASSERT(pg->ep_busy > 0);
+
+	pg->ep_busy--;
+	if (pg->ep_busy == 0) {
+		cv_broadcast(ef->ef_cachecv, ef->ef_cachelock);
+	}
+}
+
+/*
+ * Read page PAGENO of EV into the cache, along with as many of the
+ * following pages as are also missing, up to WANT pages in all. The
+ * pages are read with one device operation, straight into the cache,
+ * without the cache lock held.
+ *
+ * On success *RET is the first page, still busy for the caller to
+ * copy out of, or NULL if someone else got to it first and the caller
+ * should look again.
+ */
+static
+int
+emufs_fillpages(struct emufs_fs *ef, struct emufs_vnode *ev, uint32_t pageno,
+		size_t want, struct emufs_page **ret)
+{
+	struct emufs_page *pages[EMUFS_MAXFILL];
+	struct iovec iov[EMUFS_MAXFILL];
+	struct uio ku;
+	unsigned n, i;
+	size_t got;
+	int result;
+
+	KASSERT(lock_do_i_hold(ef->ef_cachelock));
+
+	if (want > EMUFS_MAXFILL) {
+		want = EMUFS_MAXFILL;
+	}
+
+	pages[0] = emufs_getpage(ef, false);
+	if (emufs_findpage(ef, ev, pageno) != NULL) {
+		/* read in by someone else while we waited */
+		emufs_putpage(ef, pages[0]);
+		*ret = NULL;
+		return 0;
+	}
+
+	for (n=0; n<want; n++) {
+		if (n > 0) {
+			if (emufs_findpage(ef, ev, pageno + n) != NULL) {
+				break;
+			}
+			pages[n] = emufs_getpage(ef, true);
+			if (pages[n] == NULL) {
+				break;
+			}
+		}
+		pages[n]->ep_ev = ev;
+		pages[n]->ep_pageno = pageno + n;
+		pages[n]->ep_stamp = ++ef->ef_pageclock;
+		pages[n]->ep_filling = true;
+		iov[n].iov_kbase = pages[n]->ep_data;
+		iov[n].iov_len = EMUFS_PAGESIZE;
+	}
+
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = n;
+	ku.uio_offset = (off_t)pageno * EMUFS_PAGESIZE;
+	ku.uio_resid = n * EMUFS_PAGESIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = UIO_READ;
+	ku.uio_space = NULL;
+
+	lock_release(ef->ef_cachelock);
+	result = emu_read(ev->ev_emu, ev->ev_handle, n * EMUFS_PAGESIZE, &ku);
+	lock_acquire(ef->ef_cachelock);
+
+	got = n * EMUFS_PAGESIZE - ku.uio_resid;
+	for (i=0; i<n; i++) {
+		pages[i]->ep_filling = false;
+		pages[i]->ep_len = got < EMUFS_PAGESIZE ? got : EMUFS_PAGESIZE;
+		got -= pages[i]->ep_len;
+		if (result || (i > 0 && pages[i]->ep_len == 0)) {
+			/* failed, or past EOF (page 0 is enough to say so) */
+			pages[i]->ep_ev = NULL;
+		}
+		if (result || i > 0) {
+			emufs_putpage(ef, pages[i]);
+		}
+	}
+	/* wake anyone waiting for these to be filled */
+	cv_broadcast(ef->ef_cachecv, ef->ef_cachelock);
+
+	if (result) {
+		return result;
+	}
+	*ret = pages[0];
+	return 0;
+}
+
+/*
+ * Look for a remembered lookup of NAME in DIR. Returns the vnode with
+ * a new reference, or NULL.
+ */
+static
+struct emufs_vnode *
+emufs_findname(struct emufs_fs *ef, struct emufs_vnode *dir, const char *name)
+{
+	struct emufs_name *en;
+	unsigned i;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	for (i=0; i<EMUFS_NNAMES; i++) {
+		en = &ef->ef_names[i];
+		if (en->en_dir == dir && !strcmp(en->en_name, name)) {
+			en->en_stamp = ++ef->ef_nameclock;
+			VOP_INCREF(&en->en_ev->ev_v);
+			return en->en_ev;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Remember that looking up NAME in DIR found EV, forgetting the least
+ * recently used lookup to make room. Failing to allocate just means
+ * it isn't remembered.
+ */
+static
+void
+emufs_addname(struct emufs_fs *ef, struct emufs_vnode *dir, const char *name,
+	      struct emufs_vnode *ev)
+{
+	struct emufs_name *en = NULL;
+	struct emufs_vnode *olddir, *oldev;
+	char *oldname, *copy;
+	unsigned i;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	for (i=0; i<EMUFS_NNAMES; i++) {
+		if (ef->ef_names[i].en_dir == NULL) {
+			en = &ef->ef_names[i];
+			break;
+		}
+		if (ef->ef_names[i].en_dir == dir &&
+		    !strcmp(ef->ef_names[i].en_name, name)) {
+			/* someone else got here first */
+			return;
+		}
+		if (en == NULL || ef->ef_names[i].en_stamp < en->en_stamp) {
+			en = &ef->ef_names[i];
+		}
+	}
+
+	copy = kstrdup(name);
+	if (copy == NULL) {
+		return;
+	}
+
+	olddir = en->en_dir;
+	oldev = en->en_ev;
+	oldname = en->en_name;
+
+	VOP_INCREF(&dir->ev_v);
+	VOP_INCREF(&ev->ev_v);
+	en->en_dir = dir;
+	en->en_name = copy;
+	en->en_ev = ev;
+	en->en_stamp = ++ef->ef_nameclock;
+
+	if (olddir != NULL) {
+		kfree(oldname);
+		VOP_DECREF(&oldev->ev_v);
+		VOP_DECREF(&olddir->ev_v);
+	}
+}
+
+//
+////////////////////////////////////////////////////////////
+
 ////////////////////////////////////////////////////////////
 //
 // vnode functions 
@@ -515,6 +852,8 @@ emufs_reclaim(struct vnode *v)
 	lock_release(ef->ef_emu->e_lock);
 	vfs_biglock_release();
 
+	emufs_purgepages(ef, ev);
+
 	kfree(ev);
 	return 0;
 }
@@ -527,32 +866,64 @@ int
 emufs_read(struct vnode *v, struct uio *uio)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	uint32_t amt;
-	size_t oldresid;
-	int result;
+	struct emufs_fs *ef = v->vn_fs->fs_data;
+	struct emufs_page *pg;
+	uint32_t pageno, pgoff, amt;
+	int result = 0;
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
+	lock_acquire(ef->ef_cachelock);
+
 	while (uio->uio_resid > 0) {
-		amt = uio->uio_resid;
-		if (amt > EMU_MAXIO) {
-			amt = EMU_MAXIO;
+		pageno = uio->uio_offset / EMUFS_PAGESIZE;
+		pgoff = uio->uio_offset % EMUFS_PAGESIZE;
+
+		pg = emufs_findpage(ef, ev, pageno);
+		if (pg != NULL && pg->ep_filling) {
+			cv_wait(ef->ef_cachecv, ef->ef_cachelock);
+			continue;
 		}
+		if (pg == NULL) {
+			result = emufs_fillpages(ef, ev, pageno,
+				DIVROUNDUP(pgoff + uio->uio_resid,
+					   EMUFS_PAGESIZE),
+				&pg);
+			if (result) {
+				break;
+			}
+			if (pg == NULL) {
+				continue;
+			}
+		}
+		else {
+			pg->ep_busy++;
+		}
+		pg->ep_stamp = ++ef->ef_pageclock;
 
-		oldresid = uio->uio_resid;
+		if (pgoff >= pg->ep_len) {
+			/* EOF */
+			emufs_putpage(ef, pg);
+			break;
+		}
 
-		result = emu_read(ev->ev_emu, ev->ev_handle, amt, uio);
-		if (result) {
-			return result;
+		amt = pg->ep_len - pgoff;
+		if (amt > uio->uio_resid) {
+			amt = uio->uio_resid;
 		}
-		
-		if (uio->uio_resid == oldresid) {
-			/* nothing read - EOF */
+
+		lock_release(ef->ef_cachelock);
+		result = uiomove(pg->ep_data + pgoff, amt, uio);
+		lock_acquire(ef->ef_cachelock);
+
+		emufs_putpage(ef, pg);
+		if (result) {
 			break;
 		}
 	}
 
-	return 0;
+	lock_release(ef->ef_cachelock);
+	return result;
 }
 
 /*
@@ -563,16 +934,38 @@ int
 emufs_getdirentry(struct vnode *v, struct uio *uio)
 {
 	struct emufs_vnode *ev = v->vn_data;
+	struct emufs_fs *ef = v->vn_fs->fs_data;
+	struct emufs_page *pg;
+	struct iovec iov;
+	struct uio ku;
 	uint32_t amt;
+	int result;
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
 	amt = uio->uio_resid;
-	if (amt > EMU_MAXIO) {
-		amt = EMU_MAXIO;
+	if (amt > EMUFS_PAGESIZE) {
+		amt = EMUFS_PAGESIZE;
 	}
 
-	return emu_readdir(ev->ev_emu, ev->ev_handle, amt, uio);
+	/* stage the name in a page, to copy out without the device lock */
+	lock_acquire(ef->ef_cachelock);
+	pg = emufs_getpage(ef, false);
+	lock_release(ef->ef_cachelock);
+
+	uio_kinit(&iov, &ku, pg->ep_data, amt, uio->uio_offset, UIO_READ);
+	result = emu_readdir(ev->ev_emu, ev->ev_handle, amt, &ku);
+	if (result == 0) {
+		result = uiomove(pg->ep_data, amt - ku.uio_resid, uio);
+		/* the offset is a cookie from the device, not a count */
+		uio->uio_offset = ku.uio_offset;
+	}
+
+	lock_acquire(ef->ef_cachelock);
+	emufs_putpage(ef, pg);
+	lock_release(ef->ef_cachelock);
+
+	return result;
 }
 
 /*
@@ -583,32 +976,73 @@ int
 emufs_write(struct vnode *v, struct uio *uio)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	uint32_t amt;
-	size_t oldresid;
-	int result;
+	struct emufs_fs *ef = v->vn_fs->fs_data;
+	struct emufs_page *pages[EMUFS_MAXFILL];
+	struct iovec iov[EMUFS_MAXFILL];
+	struct uio ku;
+	unsigned n, i;
+	uint32_t amt, len;
+	int result = 0;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
 	while (uio->uio_resid > 0) {
-		amt = uio->uio_resid;
-		if (amt > EMU_MAXIO) {
-			amt = EMU_MAXIO;
+		/*
+		 * Stage up to EMU_MAXIO bytes in cache pages, copying
+		 * them in from the caller without any lock held.
+		 */
+		lock_acquire(ef->ef_cachelock);
+		pages[0] = emufs_getpage(ef, false);
+		for (n=1; n<EMUFS_MAXFILL &&
+			     n * EMUFS_PAGESIZE < uio->uio_resid; n++) {
+			pages[n] = emufs_getpage(ef, true);
+			if (pages[n] == NULL) {
+				break;
+			}
+		}
+		lock_release(ef->ef_cachelock);
+
+		ku.uio_offset = uio->uio_offset;
+		amt = 0;
+		for (i=0; i<n; i++) {
+			len = uio->uio_resid;
+			if (len > EMUFS_PAGESIZE) {
+				len = EMUFS_PAGESIZE;
+			}
+			result = uiomove(pages[i]->ep_data, len, uio);
+			if (result) {
+				break;
+			}
+			iov[i].iov_kbase = pages[i]->ep_data;
+			iov[i].iov_len = len;
+			amt += len;
 		}
 
-		oldresid = uio->uio_resid;
+		if (result == 0) {
+			ku.uio_iov = iov;
+			ku.uio_iovcnt = n;
+			ku.uio_resid = amt;
+			ku.uio_segflg = UIO_SYSSPACE;
+			ku.uio_rw = UIO_WRITE;
+			ku.uio_space = NULL;
+			result = emu_write(ev->ev_emu, ev->ev_handle, amt, &ku);
+		}
 
-		result = emu_write(ev->ev_emu, ev->ev_handle, amt, uio);
-		if (result) {
-			return result;
+		lock_acquire(ef->ef_cachelock);
+		for (i=0; i<n; i++) {
+			emufs_putpage(ef, pages[i]);
 		}
+		lock_release(ef->ef_cachelock);
 
-		if (uio->uio_resid == oldresid) {
-			/* nothing written...? */
+		if (result) {
 			break;
 		}
 	}
 
-	return 0;
+	/* after the write, so no stale page can be read in again */
+	emufs_purgepages(ef, NULL);
+
+	return result;
 }
 
 /*
@@ -717,7 +1151,12 @@ int
 emufs_truncate(struct vnode *v, off_t len)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	return emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	struct emufs_fs *ef = v->vn_fs->fs_data;
+	int result;
+
+	result = emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	emufs_purgepages(ef, NULL);
+	return result;
 }
 
 /*
@@ -765,6 +1204,14 @@ emufs_lookup(struct vnode *dir, char *pathname, struct vnode **ret)
 	int result;
 	int isdir;
 
+	vfs_biglock_acquire();
+	newguy = emufs_findname(ef, ev, pathname);
+	vfs_biglock_release();
+	if (newguy != NULL) {
+		*ret = &newguy->ev_v;
+		return 0;
+	}
+
 	result = emu_open(ev->ev_emu, ev->ev_handle, pathname, false, false, 0,
 			  &handle, &isdir);
 	if (result) {
@@ -777,6 +1224,13 @@ emufs_lookup(struct vnode *dir, char *pathname, struct vnode **ret)
 		return result;
 	}
 
+	if (!isdir) {
+		/* only files have pages worth keeping */
+		vfs_biglock_acquire();
+		emufs_addname(ef, ev, pathname, newguy);
+		vfs_biglock_release();
+	}
+
 	*ret = &newguy->ev_v;
 	return 0;
 }
@@ -1305,6 +1759,13 @@ emufs_addtovfs(struct emu_softc *sc, const char *devname)
 		return ENOMEM;
 	}
 
+	result = emufs_cache_init(ef);
+	if (result) {
+		vnodearray_destroy(ef->ef_vnodes);
+		kfree(ef);
+		return result;
+	}
+
 	result = emufs_loadvnode(ef, EMU_ROOTHANDLE, 1, &ef->ef_root);
 	if (result) {
 		kfree(ef);
@@ -59,6 +59,9 @@
 /* Buffer (offset within slot)  */
 #define LHD_BUFFER      32768
 
+/* Sectors at a time lhd_io bounces through memory for user buffers */
+#define LHD_BOUNCE      4
+
 /*
  * Shortcut for reading a register.
  */
@@ -95,28 +98,97 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Start the next sector transfer, if there's anything to do and the
+ * device isn't busy. Called with lh_lock held.
+ *
+ * The card has a one-sector buffer, so a request of several sectors
+ * goes through as a series of transfers; each completion interrupt
+ * starts the next one straight away, and the next request after the
+ * last, without waiting for any thread to run. Which request is
+ * next is up to the scheduler (disksched.c); it hands out runs of
+ * adjoining requests, which are done one after the other.
  */
 static
 void
+lhd_start(struct lhd_softc *lh)
+{
+	struct devreq *req;
+	uint32_t statval = LHD_WORKING;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (lh->lh_cur == NULL) {
+		req = disksched_next(&lh->lh_sched);
+		if (req == NULL) {
+			return;
+		}
+		lh->lh_cur = req;
+		lh->lh_cursect = 0;
+	}
+	req = lh->lh_cur;
+
+	if (req->dr_write) {
+		/* Load the data into the on-card buffer. */
+		memcpy(lh->lh_buf,
+		       (char *)req->dr_buf + lh->lh_cursect * LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want, and start the operation. */
+	lhd_wreg(lh, LHD_REG_SECT, req->dr_block + lh->lh_cursect);
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * A sector transfer has finished with error code ERR. Collect the
+ * data if it was a read and move on. Returns the current request if
+ * that is now complete, NULL otherwise. Called with lh_lock held.
+ */
+static
+struct devreq *
 lhd_iodone(struct lhd_softc *lh, int err)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct devreq *req = lh->lh_cur;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (req == NULL) {
+		kprintf("lhd%d: Spurious completion\n", lh->lh_unit);
+		return NULL;
+	}
+
+	if (err == 0 && !req->dr_write) {
+		memcpy((char *)req->dr_buf + lh->lh_cursect * LHD_SECTSIZE,
+		       lh->lh_buf, LHD_SECTSIZE);
+	}
+
+	lh->lh_cursect++;
+	if (err == 0 && lh->lh_cursect < req->dr_nblocks) {
+		return NULL;
+	}
+
+	req->dr_result = err;
+	lh->lh_cur = req->dr_merged;
+	lh->lh_cursect = 0;
+	return req;
 }
 
 /*
  * Interrupt handler for lhd.
  * Read the status register; if an operation finished, clear the status
- * register and report completion.
+ * register, start the next one, and report completion if that was the
+ * end of a request.
  */
 void
 lhd_irq(void *vlh)
 {
 	struct lhd_softc *lh = vlh;
+	struct devreq *done = NULL;
 	uint32_t val;
-	
+
+	spinlock_acquire(&lh->lh_lock);
+
 	val = lhd_rdreg(lh, LHD_REG_STAT);
 
 	switch (val & LHD_STATEMASK) {
@@ -127,9 +199,42 @@ lhd_irq(void *vlh)
 	    case LHD_INVSECT:
 	    case LHD_MEDIA:
 		lhd_wreg(lh, LHD_REG_STAT, 0);
-		lhd_iodone(lh, lhd_code_to_errno(lh, val));
+		done = lhd_iodone(lh, lhd_code_to_errno(lh, val));
+		lhd_start(lh);
 		break;
 	}
+
+	spinlock_release(&lh->lh_lock);
+
+	if (done != NULL) {
+		done->dr_done(done);
+	}
+}
+
+/*
+ * Queue a request. It completes asynchronously; see <device.h>.
+ */
+static
+int
+lhd_submit(struct device *d, struct devreq *req)
+{
+	struct lhd_softc *lh = d->d_data;
+
+	/* Don't allow I/O past the end of the disk. */
+	if (req->dr_nblocks == 0 ||
+	    req->dr_block + req->dr_nblocks > lh->lh_dev.d_blocks ||
+	    req->dr_block + req->dr_nblocks < req->dr_block) {
+		return EINVAL;
+	}
+
+	req->dr_result = 0;
+
+	spinlock_acquire(&lh->lh_lock);
+	disksched_add(&lh->lh_sched, req);
+	lhd_start(lh);
+	spinlock_release(&lh->lh_lock);
+
+	return 0;
 }
 
 /*
@@ -193,8 +298,41 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Completion function for requests made by lhd_io.
+ */
+static
+void
+lhd_wakeup(struct devreq *req)
+{
+	V((struct semaphore *)req->dr_data);
+}
+
+/*
+ * Submit one request and wait for it to finish.
+ */
+static
+int
+lhd_wait(struct lhd_softc *lh, struct devreq *req, struct semaphore *sem)
+{
+	int result;
+
+	req->dr_done = lhd_wakeup;
+	req->dr_data = sem;
+	result = lhd_submit(&lh->lh_dev, req);
+	if (result) {
+		return result;
+	}
+	P(sem);
+	return req->dr_result;
+}
+
 /*
  * I/O function (for both reads and writes)
+ *
+ * A kernel buffer is transferred to or from directly in a single
+ * request. Anything else is bounced through a buffer of LHD_BOUNCE
+ * sectors at a time.
  */
 static
 int
@@ -206,9 +344,12 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
-	int result;
+	struct iovec *iov;
+	struct semaphore *sem;
+	struct devreq req;
+	char *bounce = NULL;
+	uint32_t n;
+	int result = 0;
 
 	/* Don't allow I/O that isn't sector-aligned. */
 	if (sectoff != 0 || lenoff != 0) {
@@ -220,59 +361,74 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (len == 0) {
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	sem = sem_create("lhd-io", 0);
+	if (sem == NULL) {
+		return ENOMEM;
+	}
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			if (result) {
-				V(lh->lh_clear);
-				return result;
-			}
+	req.dr_write = (uio->uio_rw == UIO_WRITE);
+
+	if (uio->uio_segflg == UIO_SYSSPACE && uio->uio_iovcnt == 1) {
+		iov = uio->uio_iov;
+		KASSERT(iov->iov_len == uio->uio_resid);
+
+		req.dr_block = sector;
+		req.dr_nblocks = len;
+		req.dr_buf = iov->iov_kbase;
+		result = lhd_wait(lh, &req, sem);
+		if (result == 0) {
+			iov->iov_kbase = (char *)iov->iov_kbase +
+				uio->uio_resid;
+			iov->iov_len = 0;
+			uio->uio_offset += uio->uio_resid;
+			uio->uio_resid = 0;
 		}
+		sem_destroy(sem);
+		return result;
+	}
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
+	bounce = kmalloc(LHD_BOUNCE * LHD_SECTSIZE);
+	if (bounce == NULL) {
+		sem_destroy(sem);
+		return ENOMEM;
+	}
 
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
+	while (len > 0) {
+		n = len < LHD_BOUNCE ? len : LHD_BOUNCE;
 
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+		if (req.dr_write) {
+			result = uiomove(bounce, n * LHD_SECTSIZE, uio);
+			if (result) {
+				break;
+			}
 		}
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
+		req.dr_block = sector;
+		req.dr_nblocks = n;
+		req.dr_buf = bounce;
+		result = lhd_wait(lh, &req, sem);
 		if (result) {
-			return result;
+			break;
+		}
+
+		if (!req.dr_write) {
+			result = uiomove(bounce, n * LHD_SECTSIZE, uio);
+			if (result) {
+				break;
+			}
 		}
+
+		sector += n;
+		len -= n;
 	}
 
-	return 0;
+	kfree(bounce);
+	sem_destroy(sem);
+	return result;
 }
 
 /*
@@ -289,23 +445,18 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
-		return ENOMEM;
-	}
+	/* Set up the request queue. */
+	spinlock_init(&lh->lh_lock);
+	disksched_init(&lh->lh_sched);
+	lh->lh_cur = NULL;
+	lh->lh_cursect = 0;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_open = lhd_open;
 	lh->lh_dev.d_close = lhd_close;
 	lh->lh_dev.d_io = lhd_io;
 	lh->lh_dev.d_ioctl = lhd_ioctl;
+	lh->lh_dev.d_submit = lhd_submit;
 	lh->lh_dev.d_blocks = bus_read_register(lh->lh_busdata, lh->lh_buspos,
 						LHD_REG_NSECT);
 	lh->lh_dev.d_blocksize = LHD_SECTSIZE;
@@ -30,7 +30,9 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
+#include <disksched.h>
 
 /*
  * Our sector size
@@ -51,9 +53,10 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects the queue */
+	struct disksched lh_sched;	/* Pending requests */
+	struct devreq *lh_cur;		/* Request on the device */
+	uint32_t lh_cursect;		/* Sector of it in progress */
 
 	struct device lh_dev;		/* VFS device structure */
 };
@@ -0,0 +1,1088 @@
+/*
+ * SFS buffer cache.
+ *
+ * Every block SFS touches, other than the superblock, goes through
+ * here on its way to sfs_rwblock(). Each mounted volume has a fixed
+ * pool of one-block buffers, found by block number through a small
+ * hash table. Without a journal there are as many as fit in
+ * SFS_BUFBYTES, but no more than SFS_NBUFS and no fewer than
+ * SFS_MINBUFS. A volume with a journal gets at least
+ * SFS_JMINBUFS(map), where map is the size of its free map in
+ * blocks (see below); sfs_jcreate only takes journals for which
+ * that comes to no more than SFS_JBUFBYTES. Buffers nobody holds sit
+ * on an LRU list and are recycled from its head; a buffer with
+ * b_refcount > 0 is never recycled. Buffers that hold nothing useful
+ * (never filled, failed to read, or invalidated) are kept off the
+ * hash chains and at the head of the LRU list so they are reused
+ * first.
+ *
+ * Writes are delayed. sfs_bdirty() puts a buffer on the volume's
+ * dirty list, which is kept in the order buffers became dirty, and
+ * there it stays until one of these writes it back:
+ *
+ *    - the syncer (sfs_bsyncer, run periodically from sfs_fs.c),
+ *      once it has been dirty for SFS_DIRTYAGE seconds, or sooner
+ *      if more than SFS_DIRTYHIGH buffers are dirty;
+ *    - sfs_bsync(), for sync and fsync;
+ *    - sfs_bget(), if the buffer comes up for recycling.
+ *
+ * Repeated small writes to the same block thus cost one disk write.
+ * The syncer and sfs_bsync() write back up to SFS_WBATCH buffers at
+ * a time; if the device takes asynchronous requests (d_submit) they
+ * are all handed to it at once and waited for together.
+ *
+ * On a volume with a journal (sfs_journal.c), buffers dirtied with
+ * sfs_bmetadirty() hold metadata, and those are only ever written
+ * back by a journal commit, which the syncer and sfs_bsync() do
+ * instead of writing buffers back themselves. sfs_bget() passes over
+ * dirty metadata when looking for a buffer to recycle. So that it
+ * always finds one, operations that change metadata start with
+ * sfs_jcheck(), which commits once dirty metadata fills more than
+ * half the pool, and the pool is made big enough that the other
+ * half can take one operation, a readahead batch and the free map.
+ *
+ * Like the rest of SFS, all of this runs under vfs_biglock, with one
+ * exception: sfs_bprefetch(), for readahead, claims buffers under
+ * it, but lets go of it while the reads are in flight. Such buffers
+ * are marked b_busy, and anyone else who looks one up waits in
+ * sfs_bget() until the read has finished.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <synch.h>
+#include <wchan.h>
+#include <uio.h>
+#include <device.h>
+#include <vfs.h>
+#include <sfs.h>
+
+/*
+ * Most buffers one operation dirties or holds at once. A rename in
+ * an indexed directory onto an existing name is about the worst:
+ * entry, chain and index blocks for both names, a new directory
+ * block with its indirect blocks, and the inode blocks of the
+ * directory and both files. (Building a directory index takes more,
+ * and is put off until there's room; see sfs_dir_link.)
+ */
+#define SFS_OPBUFS	24
+
+/*
+ * Most buffers per volume, least buffers per volume without a
+ * journal, and number of hash chains. SFS_BUFBYTES is how much
+ * memory a volume without a journal gets for buffers: the pool is cut
+ * down to fit it when blocks are big, though never below SFS_MINBUFS
+ * (so 8K blocks take 128K). Journaled volumes are sized separately,
+ * below.
+ */
+#define SFS_NBUFS	64
+#define SFS_MINBUFS	16
+#define SFS_BUFBYTES	(64*1024)
+#define SFS_BUFHASH	31
+
+/*
+ * Least buffers for a volume with a journal whose free map is MAP
+ * blocks: sfs_jcheck commits once dirty metadata fills half the
+ * pool, so the other half has to take an operation, a readahead
+ * batch and the whole free map. This costs memory: 112 buffers for
+ * the biggest map allowed, or 448K with 4K blocks, which dumbvm
+ * never gets back after an unmount. SFS_JBUFBYTES is the most it
+ * may come to; with SFS_JMAXMAPBLOCKS that limits journaled volumes
+ * to blocks of at most SFS_JMAXBLOCKSIZE.
+ */
+#define SFS_JMINBUFS(map)	(2 * (SFS_OPBUFS + SFS_RBATCH + (map)))
+#define SFS_JBUFBYTES	(512*1024)
+
+/*
+ * Write-back policy: seconds a buffer may stay dirty, and the number
+ * of dirty buffers above which the syncer writes back the oldest
+ * ones regardless of age until no more than SFS_DIRTYLOW remain.
+ */
+#define SFS_DIRTYAGE	5
+#define SFS_DIRTYHIGH(bc)	((bc)->bc_nbufs / 2)
+#define SFS_DIRTYLOW(bc)	((bc)->bc_nbufs / 4)
+
+/* Most buffers written back in one batch, and read ahead in one. */
+#define SFS_WBATCH	16
+#define SFS_RBATCH	8
+
+struct sfs_bufcache {
+	struct sfs_buf *bc_hash[SFS_BUFHASH];	/* chains of valid buffers */
+	struct sfs_buf *bc_lruhead;		/* next to be recycled */
+	struct sfs_buf *bc_lrutail;		/* most recently released */
+	struct sfs_buf *bc_dirtyhead;		/* dirty longest */
+	struct sfs_buf *bc_dirtytail;		/* dirtied most recently */
+	unsigned bc_nbufs;			/* buffers allocated */
+	unsigned bc_ndirty;			/* buffers on the dirty list */
+	struct devreq bc_reqs[SFS_WBATCH];	/* batched write-back */
+	struct sfs_buf *bc_reqbufs[SFS_WBATCH];
+	struct semaphore *bc_iosem;		/* batch completions */
+	struct devreq bc_rreqs[SFS_RBATCH];	/* batched readahead */
+	struct sfs_buf *bc_rbufs[SFS_RBATCH];
+	struct semaphore *bc_rsem;		/* readahead completions */
+	struct wchan *bc_busywchan;		/* waiting for b_busy to clear */
+};
+
+#define SFS_BUFHASHFN(block)	((block) % SFS_BUFHASH)
+
+////////////////////////////////////////////////////////////
+// Hash chains and LRU list
+
+static
+struct sfs_buf *
+sfs_bfind(struct sfs_bufcache *bc, uint32_t block)
+{
+	struct sfs_buf *b;
+
+	for (b = bc->bc_hash[SFS_BUFHASHFN(block)]; b != NULL;
+	     b = b->b_hashnext) {
+		if (b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+sfs_bhash(struct sfs_bufcache *bc, struct sfs_buf *b)
+{
+	unsigned h = SFS_BUFHASHFN(b->b_block);
+
+	KASSERT(!b->b_hashed);
+	b->b_hashnext = bc->bc_hash[h];
+	bc->bc_hash[h] = b;
+	b->b_hashed = true;
+}
+
+static
+void
+sfs_bunhash(struct sfs_bufcache *bc, struct sfs_buf *b)
+{
+	struct sfs_buf **pp;
+
+	KASSERT(b->b_hashed);
+	for (pp = &bc->bc_hash[SFS_BUFHASHFN(b->b_block)]; *pp != b;
+	     pp = &(*pp)->b_hashnext) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = b->b_hashnext;
+	b->b_hashnext = NULL;
+	b->b_hashed = false;
+}
+
+static
+void
+sfs_lruremove(struct sfs_bufcache *bc, struct sfs_buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		bc->bc_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		bc->bc_lrutail = b->b_lruprev;
+	}
+	b->b_lruprev = b->b_lrunext = NULL;
+}
+
+static
+void
+sfs_lruaddtail(struct sfs_bufcache *bc, struct sfs_buf *b)
+{
+	b->b_lruprev = bc->bc_lrutail;
+	b->b_lrunext = NULL;
+	if (bc->bc_lrutail != NULL) {
+		bc->bc_lrutail->b_lrunext = b;
+	}
+	else {
+		bc->bc_lruhead = b;
+	}
+	bc->bc_lrutail = b;
+}
+
+static
+void
+sfs_lruaddhead(struct sfs_bufcache *bc, struct sfs_buf *b)
+{
+	b->b_lruprev = NULL;
+	b->b_lrunext = bc->bc_lruhead;
+	if (bc->bc_lruhead != NULL) {
+		bc->bc_lruhead->b_lruprev = b;
+	}
+	else {
+		bc->bc_lrutail = b;
+	}
+	bc->bc_lruhead = b;
+}
+
+static
+void
+sfs_dirtyremove(struct sfs_bufcache *bc, struct sfs_buf *b)
+{
+	if (b->b_dirtyprev != NULL) {
+		b->b_dirtyprev->b_dirtynext = b->b_dirtynext;
+	}
+	else {
+		bc->bc_dirtyhead = b->b_dirtynext;
+	}
+	if (b->b_dirtynext != NULL) {
+		b->b_dirtynext->b_dirtyprev = b->b_dirtyprev;
+	}
+	else {
+		bc->bc_dirtytail = b->b_dirtyprev;
+	}
+	b->b_dirtyprev = b->b_dirtynext = NULL;
+	KASSERT(bc->bc_ndirty > 0);
+	bc->bc_ndirty--;
+}
+
+static
+void
+sfs_dirtyaddtail(struct sfs_bufcache *bc, struct sfs_buf *b)
+{
+	b->b_dirtyprev = bc->bc_dirtytail;
+	b->b_dirtynext = NULL;
+	if (bc->bc_dirtytail != NULL) {
+		bc->bc_dirtytail->b_dirtynext = b;
+	}
+	else {
+		bc->bc_dirtyhead = b;
+	}
+	bc->bc_dirtytail = b;
+	bc->bc_ndirty++;
+}
+
+////////////////////////////////////////////////////////////
+// Disk I/O
+
+/*
+ * Completion of a batched write; may be called from an interrupt.
+ */
+static
+void
+sfs_bwritedone(struct devreq *req)
+{
+	V((struct semaphore *)req->dr_data);
+}
+
+/*
+ * Write the contents of the N buffers in BUFS to the blocks in
+ * BLOCKS, which need not be where they belong, and wait for all of
+ * it. If the device can queue requests they go to it SFS_WBATCH at
+ * a time; any that fail, and everything on a device that can't, are
+ * written one at a time with sfs_wblock() so the usual retries
+ * apply. Whether the buffers are dirty is left alone.
+ */
+int
+sfs_bwrite(struct sfs_fs *sfs, struct sfs_buf **bufs,
+	   const uint32_t *blocks, unsigned n)
+{
+	struct sfs_bufcache *bc = sfs->sfs_bufs;
+	struct device *dev = sfs->sfs_device;
+	struct devreq *req;
+	uint32_t per;
+	unsigned base, batch, i, nsent;
+	int result;
+
+	for (base = 0; base < n; base += batch) {
+		batch = n - base < SFS_WBATCH ? n - base : SFS_WBATCH;
+
+		nsent = 0;
+		if (dev->d_submit != NULL) {
+			per = sfs->sfs_blocksize / dev->d_blocksize;
+			for (i=0; i<batch; i++) {
+				req = &bc->bc_reqs[i];
+				req->dr_block = blocks[base+i] * per;
+				req->dr_nblocks = per;
+				req->dr_buf = bufs[base+i]->b_data;
+				req->dr_write = true;
+				req->dr_done = sfs_bwritedone;
+				req->dr_data = bc->bc_iosem;
+				result = dev->d_submit(dev, req);
+				if (result) {
+					/* not queued; done by hand below */
+					req->dr_result = result;
+				}
+				else {
+					nsent++;
+				}
+			}
+			for (i=0; i<nsent; i++) {
+				P(bc->bc_iosem);
+			}
+		}
+
+		for (i=0; i<batch; i++) {
+			if (dev->d_submit != NULL &&
+			    bc->bc_reqs[i].dr_result == 0) {
+				continue;
+			}
+			result = sfs_wblock(sfs, bufs[base+i]->b_data,
+					    blocks[base+i]);
+			if (result) {
+				return result;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Note that a dirty buffer has been written back.
+ */
+void
+sfs_bwritten(struct sfs_fs *sfs, struct sfs_buf *b)
+{
+	KASSERT(b->b_dirty);
+	sfs_dirtyremove(sfs->sfs_bufs, b);
+	b->b_dirty = false;
+}
+
+/*
+ * Write a dirty buffer back to its block.
+ */
+static
+int
+sfs_bflush(struct sfs_fs *sfs, struct sfs_buf *b)
+{
+	int result;
+
+	KASSERT(b->b_valid);
+	KASSERT(b->b_dirty);
+
+	result = sfs_wblock(sfs, b->b_data, b->b_block);
+	if (result) {
+		return result;
+	}
+	sfs_bwritten(sfs, b);
+	return 0;
+}
+
+/*
+ * Write back up to MAX (at most SFS_WBATCH) of the oldest dirty
+ * buffers, only those holding file data if DATAONLY is set, and say
+ * how many in *DONE.
+ */
+static
+int
+sfs_bflushbatch(struct sfs_fs *sfs, unsigned max, bool dataonly,
+		unsigned *done)
+{
+	struct sfs_bufcache *bc = sfs->sfs_bufs;
+	uint32_t blocks[SFS_WBATCH];
+	struct sfs_buf *b;
+	unsigned i, n;
+	int result;
+
+	KASSERT(max <= SFS_WBATCH);
+
+	n = 0;
+	for (b = bc->bc_dirtyhead; b != NULL && n < max; b = b->b_dirtynext) {
+		if (dataonly && b->b_meta) {
+			continue;
+		}
+		bc->bc_reqbufs[n] = b;
+		blocks[n] = b->b_block;
+		n++;
+	}
+
+	result = sfs_bwrite(sfs, bc->bc_reqbufs, blocks, n);
+	if (result) {
+		return result;
+	}
+	for (i=0; i<n; i++) {
+		sfs_bwritten(sfs, bc->bc_reqbufs[i]);
+	}
+	*done = n;
+	return 0;
+}
+
+/*
+ * Take over free buffer B for BLOCK, and hold it.
+ */
+static
+void
+sfs_bclaim(struct sfs_bufcache *bc, struct sfs_buf *b, uint32_t block)
+{
+	KASSERT(b->b_refcount == 0);
+	KASSERT(!b->b_dirty);
+
+	sfs_lruremove(bc, b);
+	if (b->b_hashed) {
+		sfs_bunhash(bc, b);
+	}
+	b->b_block = block;
+	b->b_valid = false;
+	b->b_meta = false;
+	b->b_refcount = 1;
+	sfs_bhash(bc, b);
+}
+
+/*
+ * Wait for a read started by sfs_bprefetch() into B to finish. The
+ * completion doesn't need the biglock, so it's fine to hold it here.
+ */
+static
+void
+sfs_bwaitbusy(struct sfs_bufcache *bc, struct sfs_buf *b)
+{
+	wchan_lock(bc->bc_busywchan);
+	while (b->b_busy) {
+		wchan_sleep(bc->bc_busywchan);
+		wchan_lock(bc->bc_busywchan);
+	}
+	wchan_unlock(bc->bc_busywchan);
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+/*
+ * Get the buffer for BLOCK, without reading it. If the block isn't
+ * cached, the least recently used free buffer is taken over (writing
+ * it back first if need be) and handed back with b_valid false.
+ */
+int
+sfs_bget(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret)
+{
+	struct sfs_bufcache *bc = sfs->sfs_bufs;
+	struct sfs_buf *b;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(block != SFS_SB_LOCATION);
+	KASSERT(block < sfs->sfs_super.sp_nblocks);
+
+	b = sfs_bfind(bc, block);
+	if (b != NULL) {
+		if (b->b_refcount == 0) {
+			sfs_lruremove(bc, b);
+		}
+		b->b_refcount++;
+		if (b->b_prefetch) {
+			sfs_bwaitbusy(bc, b);
+		}
+		*ret = b;
+		return 0;
+	}
+
+	b = bc->bc_lruhead;
+	if (sfs->sfs_journal != NULL) {
+		/* Metadata only goes out through the journal. */
+		while (b != NULL && b->b_dirty && b->b_meta) {
+			b = b->b_lrunext;
+		}
+	}
+	if (b == NULL) {
+		/* sfs_jcheck() and the size of the pool should prevent this */
+		panic("sfs: %s: all %u buffers in use\n",
+		      sfs->sfs_super.sp_volname, bc->bc_nbufs);
+	}
+	KASSERT(b->b_refcount == 0);
+
+	if (b->b_dirty) {
+		result = sfs_bflush(sfs, b);
+		if (result) {
+			return result;
+		}
+	}
+
+	sfs_bclaim(bc, b, block);
+
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Get the buffer for BLOCK with the block's contents in it.
+ */
+int
+sfs_bread(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret)
+{
+	struct sfs_buf *b;
+	int result;
+
+	result = sfs_bget(sfs, block, &b);
+	if (result) {
+		return result;
+	}
+
+	if (!b->b_valid) {
+		result = sfs_rblock(sfs, b->b_data, block);
+		if (result) {
+			sfs_brelse(sfs, b);
+			return result;
+		}
+		b->b_valid = true;
+	}
+
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Completion of a readahead read; may be called from an interrupt.
+ */
+static
+void
+sfs_bprefetchdone(struct devreq *req)
+{
+	struct sfs_bufcache *bc = req->dr_data;
+	struct sfs_buf *b = bc->bc_rbufs[req - bc->bc_rreqs];
+
+	wchan_lock(bc->bc_busywchan);
+	if (req->dr_result == 0) {
+		b->b_valid = true;
+	}
+	b->b_busy = false;
+	wchan_unlock(bc->bc_busywchan);
+	wchan_wakeall(bc->bc_busywchan);
+	V(bc->bc_rsem);
+}
+
+/*
+ * Bring the N blocks in BLOCKS into the cache, if they aren't there
+ * already, for readahead. Called without the biglock. If the device
+ * can queue requests, free buffers are claimed for up to SFS_RBATCH
+ * blocks at a time, the reads for all of them are handed to it at
+ * once, and the biglock is only taken again to let go of the
+ * buffers once they are all in. Only clean buffers are taken; if
+ * there are none the rest is skipped, since it's only advice, and
+ * so are errors. Only one thread (the readahead thread) may be in
+ * here at a time for a volume.
+ */
+void
+sfs_bprefetch(struct sfs_fs *sfs, const uint32_t *blocks, unsigned n)
+{
+	struct sfs_bufcache *bc = sfs->sfs_bufs;
+	struct device *dev = sfs->sfs_device;
+	struct devreq *req;
+	struct sfs_buf *b;
+	uint32_t per;
+	unsigned base, batch, i, nclaimed;
+	bool full = false;
+	int result;
+
+	if (dev->d_submit == NULL) {
+		/* No queueing; one block at a time, like a real read. */
+		for (i=0; i<n; i++) {
+			vfs_biglock_acquire();
+			result = sfs_bread(sfs, blocks[i], &b);
+			if (result == 0) {
+				sfs_brelse(sfs, b);
+			}
+			vfs_biglock_release();
+			if (result) {
+				return;
+			}
+		}
+		return;
+	}
+
+	per = sfs->sfs_blocksize / dev->d_blocksize;
+	for (base = 0; base < n; base += batch) {
+		batch = n - base < SFS_RBATCH ? n - base : SFS_RBATCH;
+
+		vfs_biglock_acquire();
+		nclaimed = 0;
+		for (i=0; i<batch; i++) {
+			if (sfs_bfind(bc, blocks[base+i]) != NULL) {
+				/* cached already, or on its way */
+				continue;
+			}
+			b = bc->bc_lruhead;
+			if (b == NULL || b->b_dirty) {
+				/* only clean ones; don't write back for this */
+				full = true;
+				break;
+			}
+			sfs_bclaim(bc, b, blocks[base+i]);
+			b->b_prefetch = true;
+			b->b_busy = true;
+			bc->bc_rbufs[nclaimed++] = b;
+		}
+		vfs_biglock_release();
+
+		for (i=0; i<nclaimed; i++) {
+			req = &bc->bc_rreqs[i];
+			req->dr_block = bc->bc_rbufs[i]->b_block * per;
+			req->dr_nblocks = per;
+			req->dr_buf = bc->bc_rbufs[i]->b_data;
+			req->dr_write = false;
+			req->dr_done = sfs_bprefetchdone;
+			req->dr_data = bc;
+			result = dev->d_submit(dev, req);
+			if (result) {
+				req->dr_result = result;
+				sfs_bprefetchdone(req);
+			}
+		}
+		for (i=0; i<nclaimed; i++) {
+			P(bc->bc_rsem);
+		}
+
+		vfs_biglock_acquire();
+		for (i=0; i<nclaimed; i++) {
+			b = bc->bc_rbufs[i];
+			b->b_prefetch = false;
+			if (!b->b_hashed) {
+				/* the block was freed meanwhile */
+				b->b_valid = false;
+			}
+			sfs_brelse(sfs, b);
+		}
+		vfs_biglock_release();
+
+		if (full) {
+			break;
+		}
+	}
+}
+
+/*
+ * Note that the contents of B have been set or changed, and must be
+ * written back eventually. For a buffer from sfs_bget(), this is also
+ * what makes its contents count.
+ */
+void
+sfs_bdirty(struct sfs_fs *sfs, struct sfs_buf *b)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	KASSERT(b->b_refcount > 0);
+	b->b_valid = true;
+	if (!b->b_dirty) {
+		gettime(&secs, &nsecs);
+		b->b_dirty = true;
+		b->b_dirtytime = secs;
+		sfs_dirtyaddtail(sfs->sfs_bufs, b);
+	}
+}
+
+/*
+ * Same, for a buffer holding metadata, which on a volume with a
+ * journal must be written back through it.
+ */
+void
+sfs_bmetadirty(struct sfs_fs *sfs, struct sfs_buf *b)
+{
+	b->b_meta = true;
+	sfs_bdirty(sfs, b);
+}
+
+/*
+ * Let go of a buffer from sfs_bget() or sfs_bread().
+ */
+void
+sfs_brelse(struct sfs_fs *sfs, struct sfs_buf *b)
+{
+	struct sfs_bufcache *bc = sfs->sfs_bufs;
+
+	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(b->b_refcount > 0);
+
+	b->b_refcount--;
+	if (b->b_refcount > 0) {
+		return;
+	}
+
+	if (b->b_valid) {
+		sfs_lruaddtail(bc, b);
+	}
+	else {
+		/* nothing worth keeping */
+		KASSERT(!b->b_dirty);
+		if (b->b_hashed) {
+			sfs_bunhash(bc, b);
+		}
+		sfs_lruaddhead(bc, b);
+	}
+}
+
+/*
+ * Throw away the contents of buffer B.
+ */
+static
+void
+sfs_bdiscard(struct sfs_bufcache *bc, struct sfs_buf *b)
+{
+	if (b->b_prefetch) {
+		/* still held for readahead; see that it's dropped after */
+		sfs_bunhash(bc, b);
+		return;
+	}
+	KASSERT(b->b_refcount == 0);
+
+	sfs_lruremove(bc, b);
+	sfs_bunhash(bc, b);
+	if (b->b_dirty) {
+		sfs_dirtyremove(bc, b);
+		b->b_dirty = false;
+	}
+	b->b_valid = false;
+	b->b_meta = false;
+	sfs_lruaddhead(bc, b);
+}
+
+/*
+ * Forget any cached copies of the COUNT blocks from BLOCK on, which
+ * are being freed; writes of any that were dirty are dropped. A long
+ * run is dealt with by going through the hash chains once rather
+ * than looking up every block in it.
+ */
+void
+sfs_binval(struct sfs_fs *sfs, uint32_t block, uint32_t count)
+{
+	struct sfs_bufcache *bc = sfs->sfs_bufs;
+	struct sfs_buf *b, *next;
+	uint32_t i;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (count < SFS_BUFHASH) {
+		for (i=0; i<count; i++) {
+			b = sfs_bfind(bc, block + i);
+			if (b != NULL) {
+				sfs_bdiscard(bc, b);
+			}
+		}
+		return;
+	}
+
+	for (i=0; i<SFS_BUFHASH; i++) {
+		for (b = bc->bc_hash[i]; b != NULL; b = next) {
+			next = b->b_hashnext;
+			if (b->b_block >= block &&
+			    b->b_block - block < count) {
+				sfs_bdiscard(bc, b);
+			}
+		}
+	}
+}
+
+/*
+ * Write back every dirty buffer of the volume.
+ */
+int
+sfs_bsync(struct sfs_fs *sfs)
+{
+	struct sfs_bufcache *bc = sfs->sfs_bufs;
+	unsigned done;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (sfs->sfs_journal != NULL) {
+		return sfs_jcommit(sfs);
+	}
+
+	while (bc->bc_ndirty > 0) {
+		result = sfs_bflushbatch(sfs, SFS_WBATCH, false, &done);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write back every dirty buffer that holds file data, for a journal
+ * commit.
+ */
+int
+sfs_bsyncdata(struct sfs_fs *sfs)
+{
+	unsigned done;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	do {
+		result = sfs_bflushbatch(sfs, SFS_WBATCH, true, &done);
+		if (result) {
+			return result;
+		}
+	} while (done > 0);
+	return 0;
+}
+
+/*
+ * Put every dirty metadata buffer, oldest first, in BUFS (which has
+ * room for MAX), each with a reference the caller must release, and
+ * return how many there are.
+ */
+unsigned
+sfs_bgetmeta(struct sfs_fs *sfs, struct sfs_buf **bufs, unsigned max)
+{
+	struct sfs_bufcache *bc = sfs->sfs_bufs;
+	struct sfs_buf *b;
+	unsigned n;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	n = 0;
+	for (b = bc->bc_dirtyhead; b != NULL; b = b->b_dirtynext) {
+		if (!b->b_meta) {
+			continue;
+		}
+		KASSERT(n < max);
+		if (b->b_refcount == 0) {
+			sfs_lruremove(bc, b);
+		}
+		b->b_refcount++;
+		bufs[n++] = b;
+	}
+	return n;
+}
+
+/*
+ * Say whether dirty metadata fills more than half the pool, which on
+ * a volume with a journal means it's time to commit.
+ */
+bool
+sfs_bmetahigh(struct sfs_fs *sfs)
+{
+	struct sfs_bufcache *bc = sfs->sfs_bufs;
+	struct sfs_buf *b;
+	unsigned n;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	n = 0;
+	for (b = bc->bc_dirtyhead; b != NULL; b = b->b_dirtynext) {
+		if (b->b_meta) {
+			n++;
+		}
+	}
+	return n > SFS_DIRTYHIGH(bc);
+}
+
+/*
+ * Say whether an operation in progress can dirty N more buffers of
+ * metadata than an operation normally does without the pool running
+ * out: that is, whether N buffers are free on top of the half of the
+ * pool kept for an operation (see above). Without a journal dirty
+ * buffers can always be written back, so there's always room.
+ */
+bool
+sfs_broom(struct sfs_fs *sfs, unsigned n)
+{
+	struct sfs_bufcache *bc = sfs->sfs_bufs;
+	struct sfs_buf *b;
+	unsigned nfree;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (sfs->sfs_journal == NULL) {
+		return true;
+	}
+
+	nfree = 0;
+	for (b = bc->bc_lruhead; b != NULL; b = b->b_lrunext) {
+		if (!(b->b_dirty && b->b_meta)) {
+			nfree++;
+		}
+	}
+	return nfree >= n + (bc->bc_nbufs - SFS_DIRTYHIGH(bc));
+}
+
+/*
+ * One pass of the syncer: write back buffers that have been dirty
+ * for SFS_DIRTYAGE seconds or more, and if too many are dirty, the
+ * oldest of the rest as well.
+ */
+int
+sfs_bsyncer(struct sfs_fs *sfs)
+{
+	struct sfs_bufcache *bc = sfs->sfs_bufs;
+	struct sfs_buf *b;
+	time_t now;
+	uint32_t nsecs;
+	unsigned n, nold, batch, done;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	gettime(&now, &nsecs);
+
+	/* With a journal, it's all or nothing. */
+	if (sfs->sfs_journal != NULL) {
+		b = bc->bc_dirtyhead;
+		if (b != NULL && (now - b->b_dirtytime >= SFS_DIRTYAGE ||
+				  bc->bc_ndirty > SFS_DIRTYHIGH(bc))) {
+			return sfs_jcommit(sfs);
+		}
+		return 0;
+	}
+
+	/*
+	 * The dirty list is oldest first, so what's to be written is
+	 * a prefix of it: everything old enough, or down to
+	 * SFS_DIRTYLOW if that's more.
+	 */
+	nold = 0;
+	for (b = bc->bc_dirtyhead; b != NULL; b = b->b_dirtynext) {
+		if (now - b->b_dirtytime < SFS_DIRTYAGE) {
+			/* the rest are younger still */
+			break;
+		}
+		nold++;
+	}
+	n = 0;
+	if (bc->bc_ndirty > SFS_DIRTYHIGH(bc)) {
+		n = bc->bc_ndirty - SFS_DIRTYLOW(bc);
+	}
+	if (n < nold) {
+		n = nold;
+	}
+
+	while (n > 0) {
+		batch = n < SFS_WBATCH ? n : SFS_WBATCH;
+		result = sfs_bflushbatch(sfs, batch, false, &done);
+		if (result) {
+			return result;
+		}
+		KASSERT(done == batch);
+		n -= batch;
+	}
+	return 0;
+}
+
+/*
+ * Set up the buffer pool for a volume being mounted.
+ */
+int
+sfs_bcache_create(struct sfs_fs *sfs)
+{
+	struct sfs_bufcache *bc;
+	struct sfs_buf *b;
+	unsigned i, nbufs, mapblocks;
+
+	/* A journal commit has to be able to take every buffer. */
+	KASSERT(SFS_NBUFS <= SFS_JMAXBLOCKS);
+	KASSERT(SFS_JMINBUFS(SFS_JMAXMAPBLOCKS) <= SFS_JMAXBLOCKS);
+	KASSERT(SFS_JMINBUFS(SFS_JMAXMAPBLOCKS) * SFS_JMAXBLOCKSIZE <=
+		SFS_JBUFBYTES);
+
+	nbufs = SFS_BUFBYTES / sfs->sfs_blocksize;
+	if (nbufs > SFS_NBUFS) {
+		nbufs = SFS_NBUFS;
+	}
+	if (nbufs < SFS_MINBUFS) {
+		nbufs = SFS_MINBUFS;
+	}
+
+	/*
+	 * With a journal, sfs_jcheck needs the pool to be bigger (see
+	 * above). If the map or the blocks are too big, sfs_jcreate
+	 * will refuse the journal and the mount anyway.
+	 */
+	if (sfs->sfs_super.sp_jblocks != 0 &&
+	    sfs->sfs_blocksize <= SFS_JMAXBLOCKSIZE) {
+		mapblocks = SFS_BITBLOCKS(sfs->sfs_super.sp_nblocks,
+					  sfs->sfs_blocksize);
+		if (mapblocks > SFS_JMAXMAPBLOCKS) {
+			mapblocks = SFS_JMAXMAPBLOCKS;
+		}
+		if (nbufs < SFS_JMINBUFS(mapblocks)) {
+			nbufs = SFS_JMINBUFS(mapblocks);
+		}
+	}
+
+	bc = kmalloc(sizeof(*bc));
+	if (bc == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<SFS_BUFHASH; i++) {
+		bc->bc_hash[i] = NULL;
+	}
+	bc->bc_lruhead = bc->bc_lrutail = NULL;
+	bc->bc_dirtyhead = bc->bc_dirtytail = NULL;
+	bc->bc_nbufs = 0;
+	bc->bc_ndirty = 0;
+	bc->bc_iosem = sem_create("sfs write-back", 0);
+	if (bc->bc_iosem == NULL) {
+		kfree(bc);
+		return ENOMEM;
+	}
+	bc->bc_rsem = sem_create("sfs readahead", 0);
+	if (bc->bc_rsem == NULL) {
+		sem_destroy(bc->bc_iosem);
+		kfree(bc);
+		return ENOMEM;
+	}
+	bc->bc_busywchan = wchan_create("sfs readahead");
+	if (bc->bc_busywchan == NULL) {
+		sem_destroy(bc->bc_rsem);
+		sem_destroy(bc->bc_iosem);
+		kfree(bc);
+		return ENOMEM;
+	}
+	sfs->sfs_bufs = bc;
+
+	for (i=0; i<nbufs; i++) {
+		b = kmalloc(sizeof(*b));
+		if (b == NULL) {
+			sfs_bcache_destroy(sfs);
+			return ENOMEM;
+		}
+		b->b_data = kmalloc(sfs->sfs_blocksize);
+		if (b->b_data == NULL) {
+			kfree(b);
+			sfs_bcache_destroy(sfs);
+			return ENOMEM;
+		}
+		b->b_hashnext = NULL;
+		b->b_dirtyprev = b->b_dirtynext = NULL;
+		b->b_dirtytime = 0;
+		b->b_block = 0;
+		b->b_refcount = 0;
+		b->b_hashed = false;
+		b->b_valid = false;
+		b->b_dirty = false;
+		b->b_meta = false;
+		b->b_prefetch = false;
+		b->b_busy = false;
+		sfs_lruaddhead(bc, b);
+		bc->bc_nbufs++;
+	}
+	return 0;
+}
+
+/*
+ * Free the buffer pool of a volume being unmounted. Everything must
+ * have been released and written back already.
+ */
+void
+sfs_bcache_destroy(struct sfs_fs *sfs)
+{
+	struct sfs_bufcache *bc = sfs->sfs_bufs;
+	struct sfs_buf *b;
+
+	while ((b = bc->bc_lruhead) != NULL) {
+		KASSERT(b->b_refcount == 0);
+		KASSERT(!b->b_dirty);
+		sfs_lruremove(bc, b);
+		if (b->b_hashed) {
+			sfs_bunhash(bc, b);
+		}
+		kfree(b->b_data);
+		kfree(b);
+		bc->bc_nbufs--;
+	}
+	KASSERT(bc->bc_nbufs == 0);
+	KASSERT(bc->bc_ndirty == 0);
+	wchan_destroy(bc->bc_busywchan);
+	sem_destroy(bc->bc_rsem);
+	sem_destroy(bc->bc_iosem);
+	kfree(bc);
+	sfs->sfs_bufs = NULL;
+}
@@ -0,0 +1,470 @@
+/*
+ * SFS directory index. See kern/sfs.h for the on-disk layout.
+ *
+ * The index only speeds things up: the directory entries themselves
+ * are laid out the same whether or not there is one, and a directory
+ * without one is searched from end to end as before. Directories get
+ * an index when they grow past SFS_DIRHASH_MIN slots (sfs_dir_link),
+ * and if anything goes wrong while updating it the index is thrown
+ * away rather than left out of step with the entries.
+ *
+ * Chain blocks are kept full except for the first one in each chain,
+ * so adding and removing never touches more than two chain blocks,
+ * and a chain holds at most one partly-empty block.
+ *
+ * Everything here runs under the VFS big lock.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <vfs.h>
+#include <sfs.h>
+
+/*
+ * Hash a name. This is FNV-1a; sfsck has to agree with it.
+ */
+uint32_t
+sfs_dirindex_hash(const char *name)
+{
+	uint32_t hash = 2166136261U;
+
+	while (*name != 0) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/*
+ * Find the head of a chain in the index block: the one for HASH, or
+ * the free slot chain if FREECHAIN is set.
+ */
+static
+uint32_t *
+sfs_dirindex_head(struct sfs_dirindex *di, uint32_t hash, bool freechain)
+{
+	if (freechain) {
+		return &di->di_free;
+	}
+	return &di->di_bucket[hash % SFS_DIRHASH_NBUCKETS];
+}
+
+/*
+ * Add (HASH, SLOT) to the chain whose head is *HEADP, starting a new
+ * first block if the current one is full.
+ */
+static
+int
+sfs_dirindex_push(struct sfs_vnode *sv, uint32_t *headp,
+		  uint32_t hash, uint32_t slot)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_dirchain *dc;
+	struct sfs_buf *b;
+	uint32_t block;
+	int result;
+
+	if (*headp != 0) {
+		result = sfs_bread(sfs, *headp, &b);
+		if (result) {
+			return result;
+		}
+		dc = b->b_data;
+		if (dc->dc_count < SFS_DIRHASH_PERBLOCK) {
+			dc->dc_ents[dc->dc_count].dh_hash = hash;
+			dc->dc_ents[dc->dc_count].dh_slot = slot;
+			dc->dc_count++;
+			sfs_bmetadirty(sfs, b);
+			sfs_brelse(sfs, b);
+			return 0;
+		}
+		sfs_brelse(sfs, b);
+	}
+
+	result = sfs_balloc(sfs, sv->sv_i.sfi_dirindex + 1, &block);
+	if (result) {
+		return result;
+	}
+	result = sfs_bread(sfs, block, &b);
+	if (result) {
+		sfs_bfree(sfs, block);
+		return result;
+	}
+	dc = b->b_data;
+	dc->dc_next = *headp;
+	dc->dc_count = 1;
+	dc->dc_ents[0].dh_hash = hash;
+	dc->dc_ents[0].dh_slot = slot;
+	sfs_bmetadirty(sfs, b);
+	sfs_brelse(sfs, b);
+
+	*headp = block;
+	return 0;
+}
+
+/*
+ * Take the entry for SLOT off the chain whose head is *HEADP, or if
+ * SLOT is negative, whichever entry is cheapest to take; hand back
+ * the slot taken in *SLOTRET. The hole is filled from the first
+ * block, which is freed if that empties it.
+ */
+static
+int
+sfs_dirindex_pull(struct sfs_vnode *sv, uint32_t *headp, int slot,
+		  uint32_t *slotret)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_dirchain *head, *dc;
+	struct sfs_buf *hb, *b;
+	uint32_t headblock, block, i;
+	int result;
+
+	headblock = *headp;
+	if (headblock == 0) {
+		KASSERT(slot < 0);
+		return ENOENT;
+	}
+
+	result = sfs_bread(sfs, headblock, &hb);
+	if (result) {
+		return result;
+	}
+	head = hb->b_data;
+	if (head->dc_count == 0 || head->dc_count > SFS_DIRHASH_PERBLOCK) {
+		panic("sfs: dirindex of inode %u: bad chain block %u\n",
+		      sv->sv_ino, headblock);
+	}
+
+	b = hb;
+	dc = head;
+	i = head->dc_count - 1;
+	if (slot >= 0) {
+		while (1) {
+			for (i=0; i<dc->dc_count; i++) {
+				if (dc->dc_ents[i].dh_slot == (uint32_t)slot) {
+					break;
+				}
+			}
+			if (i < dc->dc_count) {
+				break;
+			}
+			block = dc->dc_next;
+			if (b != hb) {
+				sfs_brelse(sfs, b);
+			}
+			if (block == 0) {
+				panic("sfs: dirindex of inode %u: "
+				      "slot %d missing\n", sv->sv_ino, slot);
+			}
+			result = sfs_bread(sfs, block, &b);
+			if (result) {
+				sfs_brelse(sfs, hb);
+				return result;
+			}
+			dc = b->b_data;
+		}
+	}
+
+	if (slotret != NULL) {
+		*slotret = dc->dc_ents[i].dh_slot;
+	}
+	dc->dc_ents[i] = head->dc_ents[head->dc_count - 1];
+	head->dc_count--;
+
+	if (b != hb) {
+		sfs_bmetadirty(sfs, b);
+		sfs_brelse(sfs, b);
+	}
+	if (head->dc_count == 0) {
+		*headp = head->dc_next;
+		sfs_brelse(sfs, hb);
+		sfs_bfree(sfs, headblock);
+	}
+	else {
+		sfs_bmetadirty(sfs, hb);
+		sfs_brelse(sfs, hb);
+	}
+	return 0;
+}
+
+/*
+ * Look up NAME, as sfs_dir_findname does for unindexed directories.
+ */
+int
+sfs_dirindex_lookup(struct sfs_vnode *sv, const char *name,
+		    uint32_t *ino, int *slot)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_dirindex *di;
+	struct sfs_dirchain *dc;
+	struct sfs_buf *b;
+	struct sfs_dir sd;
+	uint32_t hash, block, i;
+	int result;
+
+	KASSERT(sv->sv_i.sfi_dirindex != 0);
+
+	hash = sfs_dirindex_hash(name);
+
+	result = sfs_bread(sfs, sv->sv_i.sfi_dirindex, &b);
+	if (result) {
+		return result;
+	}
+	di = b->b_data;
+	block = *sfs_dirindex_head(di, hash, false);
+	sfs_brelse(sfs, b);
+
+	while (block != 0) {
+		result = sfs_bread(sfs, block, &b);
+		if (result) {
+			return result;
+		}
+		dc = b->b_data;
+		for (i=0; i<dc->dc_count; i++) {
+			if (dc->dc_ents[i].dh_hash != hash) {
+				continue;
+			}
+			result = sfs_readdir(sv, &sd, dc->dc_ents[i].dh_slot);
+			if (result) {
+				sfs_brelse(sfs, b);
+				return result;
+			}
+			sd.sfd_name[sizeof(sd.sfd_name)-1] = 0;
+			if (sd.sfd_ino != SFS_NOINO &&
+			    !strcmp(sd.sfd_name, name)) {
+				if (ino != NULL) {
+					*ino = sd.sfd_ino;
+				}
+				if (slot != NULL) {
+					*slot = dc->dc_ents[i].dh_slot;
+				}
+				sfs_brelse(sfs, b);
+				return 0;
+			}
+		}
+		block = dc->dc_next;
+		sfs_brelse(sfs, b);
+	}
+	return ENOENT;
+}
+
+/*
+ * Add NAME, in slot SLOT, to the index; or if FREESLOT is set, list
+ * SLOT as free.
+ */
+static
+int
+sfs_dirindex_insert(struct sfs_vnode *sv, const char *name, int slot,
+		    bool freeslot)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *ib;
+	uint32_t hash;
+	int result;
+
+	hash = freeslot ? 0 : sfs_dirindex_hash(name);
+
+	result = sfs_bread(sfs, sv->sv_i.sfi_dirindex, &ib);
+	if (result) {
+		return result;
+	}
+	result = sfs_dirindex_push(sv,
+				   sfs_dirindex_head(ib->b_data, hash,
+						     freeslot),
+				   hash, slot);
+	if (result == 0) {
+		sfs_bmetadirty(sfs, ib);
+	}
+	sfs_brelse(sfs, ib);
+	return result;
+}
+
+/*
+ * Record that NAME has been written into slot SLOT.
+ */
+int
+sfs_dirindex_add(struct sfs_vnode *sv, const char *name, int slot)
+{
+	KASSERT(sv->sv_i.sfi_dirindex != 0);
+	return sfs_dirindex_insert(sv, name, slot, false);
+}
+
+/*
+ * Record that NAME has been erased from slot SLOT, which is now free.
+ */
+int
+sfs_dirindex_remove(struct sfs_vnode *sv, const char *name, int slot)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *ib;
+	uint32_t hash;
+	int result;
+
+	KASSERT(sv->sv_i.sfi_dirindex != 0);
+
+	hash = sfs_dirindex_hash(name);
+
+	result = sfs_bread(sfs, sv->sv_i.sfi_dirindex, &ib);
+	if (result) {
+		return result;
+	}
+	result = sfs_dirindex_pull(sv,
+				   sfs_dirindex_head(ib->b_data, hash, false),
+				   slot, NULL);
+	if (result == 0) {
+		result = sfs_dirindex_push(sv,
+					   sfs_dirindex_head(ib->b_data,
+							     0, true),
+					   0, slot);
+	}
+	sfs_bmetadirty(sfs, ib);
+	sfs_brelse(sfs, ib);
+	return result;
+}
+
+/*
+ * Take a free slot off the index for a new entry. Hands back -1 if
+ * there are none, in which case the entry goes on the end.
+ */
+int
+sfs_dirindex_getslot(struct sfs_vnode *sv, int *slot)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *ib;
+	uint32_t got;
+	int result;
+
+	KASSERT(sv->sv_i.sfi_dirindex != 0);
+
+	result = sfs_bread(sfs, sv->sv_i.sfi_dirindex, &ib);
+	if (result) {
+		return result;
+	}
+	result = sfs_dirindex_pull(sv, sfs_dirindex_head(ib->b_data, 0, true),
+				   -1, &got);
+	if (result == ENOENT) {
+		*slot = -1;
+		result = 0;
+	}
+	else if (result == 0) {
+		*slot = got;
+		sfs_bmetadirty(sfs, ib);
+	}
+	sfs_brelse(sfs, ib);
+	return result;
+}
+
+/*
+ * Give back a slot from sfs_dirindex_getslot that wasn't used after
+ * all.
+ */
+int
+sfs_dirindex_putslot(struct sfs_vnode *sv, int slot)
+{
+	KASSERT(sv->sv_i.sfi_dirindex != 0);
+	return sfs_dirindex_insert(sv, NULL, slot, true);
+}
+
+/*
+ * Free the blocks of one chain.
+ */
+static
+void
+sfs_dirindex_freechain(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_dirchain *dc;
+	struct sfs_buf *b;
+	uint32_t next;
+
+	while (block != 0) {
+		if (sfs_bread(sfs, block, &b)) {
+			/* Can't follow it; leave the rest for sfsck */
+			return;
+		}
+		dc = b->b_data;
+		next = dc->dc_next;
+		sfs_brelse(sfs, b);
+		sfs_bfree(sfs, block);
+		block = next;
+	}
+}
+
+/*
+ * Throw away a directory's index. This can't fail; at worst, blocks
+ * that can't be read are leaked for sfsck to find.
+ */
+void
+sfs_dirindex_destroy(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_dirindex *di;
+	struct sfs_buf *ib;
+	uint32_t indexblock;
+	unsigned i;
+
+	indexblock = sv->sv_i.sfi_dirindex;
+	if (indexblock == 0) {
+		return;
+	}
+	sv->sv_i.sfi_dirindex = 0;
+	sv->sv_dirty = true;
+
+	if (sfs_bread(sfs, indexblock, &ib) == 0) {
+		di = ib->b_data;
+		for (i=0; i<SFS_DIRHASH_NBUCKETS; i++) {
+			sfs_dirindex_freechain(sfs, di->di_bucket[i]);
+		}
+		sfs_dirindex_freechain(sfs, di->di_free);
+		sfs_brelse(sfs, ib);
+	}
+	sfs_bfree(sfs, indexblock);
+}
+
+/*
+ * Build an index for a directory that doesn't have one.
+ */
+int
+sfs_dirindex_build(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_dir sd;
+	uint32_t indexblock;
+	int i, nentries, result;
+
+	KASSERT(sv->sv_i.sfi_type == SFS_TYPE_DIR);
+	KASSERT(sv->sv_i.sfi_dirindex == 0);
+
+	result = sfs_balloc(sfs,
+			    SFS_INOBLOCK(sv->sv_ino, sfs->sfs_inoperblock) + 1,
+			    &indexblock);
+	if (result) {
+		return result;
+	}
+	sv->sv_i.sfi_dirindex = indexblock;
+	sv->sv_dirty = true;
+
+	nentries = sfs_dir_nentries(sv);
+	for (i=0; i<nentries; i++) {
+		result = sfs_readdir(sv, &sd, i);
+		if (result) {
+			break;
+		}
+		if (sd.sfd_ino == SFS_NOINO) {
+			result = sfs_dirindex_insert(sv, NULL, i, true);
+		}
+		else {
+			sd.sfd_name[sizeof(sd.sfd_name)-1] = 0;
+			result = sfs_dirindex_insert(sv, sd.sfd_name, i,
+						     false);
+		}
+		if (result) {
+			break;
+		}
+	}
+
+	if (result) {
+		sfs_dirindex_destroy(sv);
+	}
+	return result;
+}
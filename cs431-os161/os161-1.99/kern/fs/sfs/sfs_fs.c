@@ -36,30 +36,40 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <clock.h>
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
+#include <proc.h>
+#include <thread.h>
 #include <sfs.h>
 
+/* Seconds between runs of the syncer. */
+#define SFS_SYNCER_PERIOD 1
+
 /* Shortcuts for the size macros in kern/sfs.h */
-#define SFS_FS_BITMAPSIZE(sfs)  SFS_BITMAPSIZE((sfs)->sfs_super.sp_nblocks)
-#define SFS_FS_BITBLOCKS(sfs)   SFS_BITBLOCKS((sfs)->sfs_super.sp_nblocks)
+#define SFS_FS_BITMAPSIZE(sfs) \
+	SFS_BITMAPSIZE((sfs)->sfs_super.sp_nblocks, (sfs)->sfs_blocksize)
+#define SFS_FS_BITBLOCKS(sfs) \
+	SFS_BITBLOCKS((sfs)->sfs_super.sp_nblocks, (sfs)->sfs_blocksize)
 
 /*
  * Routine for doing I/O (reads or writes) on the free block bitmap.
- * We always do the whole bitmap at once; writing individual sectors
- * might or might not be a worthwhile optimization.
+ * Reading loads the whole bitmap; writing pushes only the blocks of
+ * it marked in sfs_dirtymap (see sfs_markmap), so a commit doesn't
+ * carry the whole map along for a few allocations.
  *
- * The free block bitmap consists of SFS_BITBLOCKS 512-byte sectors of
- * bits, one bit for each sector on the filesystem. The number of
- * blocks in the bitmap is thus rounded up to the nearest multiple of
- * 512*8 = 4096. (This rounded number is SFS_BITMAPSIZE.) This means
- * that the bitmap will (in general) contain space for some number of
- * invalid sectors that are actually beyond the end of the disk
- * device. This is ok. These sectors are supposed to be marked "in
- * use" by mksfs and never get marked "free".
+ * The free block bitmap consists of SFS_BITBLOCKS blocks of bits,
+ * one bit for each block on the filesystem. The number of blocks in
+ * the bitmap is thus rounded up to the nearest multiple of the
+ * number of bits in a block (4096 with 512-byte blocks). (This
+ * rounded number is SFS_BITMAPSIZE.) This means that the bitmap will
+ * (in general) contain space for some number of invalid blocks that
+ * are actually beyond the end of the disk device. This is ok. These
+ * blocks are supposed to be marked "in use" by mksfs and never get
+ * marked "free".
  *
  * The sectors used by the superblock and the bitmap itself are
  * likewise marked in use by mksfs.
@@ -71,6 +81,7 @@ sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 {
 	uint32_t j, mapsize;
 	char *bitdata;
+	struct sfs_buf *b;
 	int result;
 
 	/* Number of blocks in the bitmap. */
@@ -83,15 +94,32 @@ sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 	for (j=0; j<mapsize; j++) {
 
 		/* Get a pointer to its data */
-		void *ptr = bitdata + j*SFS_BLOCKSIZE;
+		void *ptr = bitdata + j*sfs->sfs_blocksize;
 
-		/* and read or write it. The bitmap starts at sector 2. */ 
+		/*
+		 * and read or write it through the buffer cache. The
+		 * bitmap starts at sector 2.
+		 */
 		if (rw == UIO_READ) {
-			result = sfs_rblock(sfs, ptr, SFS_MAP_LOCATION+j);
+			result = sfs_bread(sfs, SFS_MAP_LOCATION+j, &b);
+			if (result) {
+				return result;
+			}
+			memcpy(ptr, b->b_data, sfs->sfs_blocksize);
 		}
 		else {
-			result = sfs_wblock(sfs, ptr, SFS_MAP_LOCATION+j);
+			if (!bitmap_isset(sfs->sfs_dirtymap, j)) {
+				continue;
+			}
+			result = sfs_bget(sfs, SFS_MAP_LOCATION+j, &b);
+			if (result) {
+				return result;
+			}
+			memcpy(b->b_data, ptr, sfs->sfs_blocksize);
+			sfs_bmetadirty(sfs, b);
+			bitmap_unmark(sfs->sfs_dirtymap, j);
 		}
+		sfs_brelse(sfs, b);
 
 		/* If we failed, stop. */
 		if (result) {
@@ -101,6 +129,138 @@ sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 	return 0;
 }
 
+/*
+ * Note that the free map bits for the COUNT blocks from BLOCK on
+ * have changed.
+ */
+void
+sfs_markmap(struct sfs_fs *sfs, uint32_t block, uint32_t count)
+{
+	uint32_t bits = SFS_BLOCKBITS(sfs->sfs_blocksize);
+	uint32_t j;
+
+	KASSERT(count > 0);
+	for (j = block / bits; j <= (block + count - 1) / bits; j++) {
+		if (!bitmap_isset(sfs->sfs_dirtymap, j)) {
+			bitmap_mark(sfs->sfs_dirtymap, j);
+		}
+	}
+	sfs->sfs_freemapdirty = true;
+}
+
+/*
+ * Copy the dirty state SFS keeps outside the buffer cache -- loaded
+ * inodes and the free block map -- into it, so it goes out to disk
+ * with everything else. The superblock is left alone; it never goes
+ * through the cache.
+ */
+int
+sfs_pushmeta(struct sfs_fs *sfs)
+{
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	result = sfs_isync(sfs);
+	if (result) {
+		return result;
+	}
+
+	if (sfs->sfs_freemapdirty) {
+		result = sfs_mapio(sfs, UIO_WRITE);
+		if (result) {
+			return result;
+		}
+		sfs->sfs_freemapdirty = false;
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Syncer
+//
+// One kernel thread writes back delayed writes for all mounted
+// volumes, once a second. The list of volumes is protected by
+// vfs_biglock, which the syncer holds while it works, so a volume
+// that has been taken off the list can't be in use by it.
+
+static struct sfs_fs *sfs_volumes;
+static bool sfs_syncer_started;
+
+static
+void
+sfs_syncer(void *data1, unsigned long data2)
+{
+	struct sfs_fs *sfs;
+	int result;
+
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		clocksleep(SFS_SYNCER_PERIOD);
+
+		vfs_biglock_acquire();
+		for (sfs = sfs_volumes; sfs != NULL; sfs = sfs->sfs_nextvol) {
+			result = sfs_pushmeta(sfs);
+			if (result == 0) {
+				result = sfs_bsyncer(sfs);
+			}
+			if (result) {
+				kprintf("sfs: %s: syncer: %s\n",
+					sfs->sfs_super.sp_volname,
+					strerror(result));
+			}
+		}
+		vfs_biglock_release();
+	}
+}
+
+static
+int
+sfs_addvolume(struct sfs_fs *sfs)
+{
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (!sfs_syncer_started) {
+		result = sfs_ra_start();
+		if (result) {
+			return result;
+		}
+		result = thread_fork("sfs syncer", kproc, sfs_syncer, NULL, 0);
+		if (result) {
+			return result;
+		}
+		sfs_syncer_started = true;
+	}
+
+	sfs->sfs_nextvol = sfs_volumes;
+	sfs_volumes = sfs;
+	return 0;
+}
+
+static
+void
+sfs_removevolume(struct sfs_fs *sfs)
+{
+	struct sfs_fs **pp;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	for (pp = &sfs_volumes; *pp != sfs; pp = &(*pp)->sfs_nextvol) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = sfs->sfs_nextvol;
+	sfs->sfs_nextvol = NULL;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Filesystem operations
+
 /*
  * Sync routine. This is what gets invoked if you do FS_SYNC on the
  * sfs filesystem structure.
@@ -111,7 +271,6 @@ int
 sfs_sync(struct fs *fs)
 {
 	struct sfs_fs *sfs; 
-	unsigned i, num;
 	int result;
 
 	vfs_biglock_acquire();
@@ -148,26 +307,19 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
-	}
-
-	/* If the free block map needs to be written, write it. */
-	if (sfs->sfs_freemapdirty) {
-		result = sfs_mapio(sfs, UIO_WRITE);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-		sfs->sfs_freemapdirty = false;
+	/*
+	 * Put the loaded inodes and the free block map into the
+	 * buffer cache...
+	 */
+	result = sfs_pushmeta(sfs);
+	if (result) {
+		vfs_biglock_release();
+		return result;
 	}
 
 	/* If the superblock needs to be written, write it. */
 	if (sfs->sfs_superdirty) {
-		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
+		result = sfs_whead(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 		if (result) {
 			vfs_biglock_release();
 			return result;
@@ -175,6 +327,13 @@ sfs_sync(struct fs *fs)
 		sfs->sfs_superdirty = false;
 	}
 
+	/* ...and write back everything dirty there. */
+	result = sfs_bsync(sfs);
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+
 	vfs_biglock_release();
 	return 0;
 }
@@ -208,13 +367,18 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	int result;
 
 	vfs_biglock_acquire();
 	
-	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
+	/*
+	 * Drop the vnodes kept only by the inode cache. If any others
+	 * are left, files are open and we can't unmount.
+	 */
+	result = sfs_ipurge(sfs);
+	if (result) {
 		vfs_biglock_release();
-		return EBUSY;
+		return result;
 	}
 
 	/* We should have just had sfs_sync called. */
@@ -222,8 +386,12 @@ sfs_unmount(struct fs *fs)
 	KASSERT(sfs->sfs_freemapdirty == false);
 
 	/* Once we start nuking stuff we can't fail. */
-	vnodearray_destroy(sfs->sfs_vnodes);
+	sfs_removevolume(sfs);
+	sfs_icache_destroy(sfs);
+	bitmap_destroy(sfs->sfs_dirtymap);
 	bitmap_destroy(sfs->sfs_freemap);
+	sfs_jdestroy(sfs);
+	sfs_bcache_destroy(sfs);
 	
 	/* The vfs layer takes care of the device for us */
 	(void)sfs->sfs_device;
@@ -236,6 +404,54 @@ sfs_unmount(struct fs *fs)
 	return 0;
 }
 
+/*
+ * Check the block and inode sizes recorded in the superblock, and
+ * work out the sizes that follow from them.
+ */
+static
+int
+sfs_setblocksize(struct sfs_fs *sfs)
+{
+	uint32_t bsize = SFS_SB_BLOCKSIZE(&sfs->sfs_super);
+	uint64_t per, maxblocks;
+
+	if (bsize < SFS_BLOCKSIZE || bsize > SFS_MAXBLOCKSIZE ||
+	    (bsize & (bsize - 1)) != 0) {
+		kprintf("sfs: %s: bad block size %u\n",
+			sfs->sfs_super.sp_volname, bsize);
+		return EINVAL;
+	}
+	sfs->sfs_blocksize = bsize;
+	sfs->sfs_dbperidb = SFS_DBPERIDB(bsize);
+
+	/* Limited by the indirect blocks, and by sfi_size being 32 bits */
+	per = sfs->sfs_dbperidb;
+	maxblocks = SFS_NDIRECT + per + per * per + per * per * per;
+	sfs->sfs_maxfilesize = maxblocks * bsize;
+	if (sfs->sfs_maxfilesize > 0xffffffff) {
+		sfs->sfs_maxfilesize = 0xffffffff;
+	}
+
+	/* Inodes are either alone in a block or SFS_INODESIZE bytes */
+	if (sfs->sfs_super.sp_inodesize != 0 &&
+	    sfs->sfs_super.sp_inodesize != SFS_INODESIZE) {
+		kprintf("sfs: %s: bad inode size %u\n",
+			sfs->sfs_super.sp_volname,
+			sfs->sfs_super.sp_inodesize);
+		return EINVAL;
+	}
+	sfs->sfs_inoperblock = SFS_SB_INOPERBLOCK(&sfs->sfs_super);
+
+	/* Inode numbers have to fit in 32 bits */
+	if ((uint64_t)sfs->sfs_super.sp_nblocks * sfs->sfs_inoperblock >
+	    0xffffffff) {
+		kprintf("sfs: %s: too many blocks for inode numbers\n",
+			sfs->sfs_super.sp_volname);
+		return EINVAL;
+	}
+	return 0;
+}
+
 /*
  * Mount routine.
  *
@@ -266,18 +482,17 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	 * Make sure our on-disk structures aren't messed up
 	 */
 	KASSERT(sizeof(struct sfs_super)==SFS_BLOCKSIZE);
-	KASSERT(sizeof(struct sfs_inode)==SFS_BLOCKSIZE);
+	KASSERT(sizeof(struct sfs_inode)==SFS_INODESIZE);
 	KASSERT(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
 
 	/*
-	 * We can't mount on devices with the wrong sector size.
-	 *
-	 * (Note: for all intents and purposes here, "sector" and
-	 * "block" are interchangeable terms. Technically a filesystem
-	 * block may be composed of several hardware sectors, but we
-	 * don't do that in sfs.)
+	 * We can't mount on devices whose sectors don't divide our
+	 * smallest block size. (A filesystem block may be composed of
+	 * several hardware sectors, if the volume was made with
+	 * larger blocks than the sectors.)
 	 */
-	if (dev->d_blocksize != SFS_BLOCKSIZE) {
+	if (dev->d_blocksize > SFS_BLOCKSIZE ||
+	    SFS_BLOCKSIZE % dev->d_blocksize != 0) {
 		vfs_biglock_release();
 		return ENXIO;
 	}
@@ -289,21 +504,22 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return ENOMEM;
 	}
 
-	/* Allocate array */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	/* Set up the inode cache */
+	result = sfs_icache_create(sfs);
+	if (result) {
 		kfree(sfs);
 		vfs_biglock_release();
-		return ENOMEM;
+		return result;
 	}
 
-	/* Set the device so we can use sfs_rblock() */
+	/* Set the device so we can use sfs_rhead() */
 	sfs->sfs_device = dev;
+	sfs->sfs_blocksize = SFS_BLOCKSIZE;
 
 	/* Load superblock */
-	result = sfs_rblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
+	result = sfs_rhead(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 	if (result) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_icache_destroy(sfs);
 		kfree(sfs);
 		vfs_biglock_release();
 		return result;
@@ -316,32 +532,76 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n", 
 			sfs->sfs_super.sp_magic,
 			SFS_MAGIC);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_icache_destroy(sfs);
 		kfree(sfs);
 		vfs_biglock_release();
 		return EINVAL;
 	}
-	
-	if (sfs->sfs_super.sp_nblocks > dev->d_blocks) {
-		kprintf("sfs: warning - fs has %u blocks, device has %u\n",
-			sfs->sfs_super.sp_nblocks, dev->d_blocks);
-	}
 
 	/* Ensure null termination of the volume name */
 	sfs->sfs_super.sp_volname[sizeof(sfs->sfs_super.sp_volname)-1] = 0;
 
+	result = sfs_setblocksize(sfs);
+	if (result) {
+		sfs_icache_destroy(sfs);
+		kfree(sfs);
+		vfs_biglock_release();
+		return result;
+	}
+
+	if ((uint64_t)sfs->sfs_super.sp_nblocks * sfs->sfs_blocksize >
+	    (uint64_t)dev->d_blocks * dev->d_blocksize) {
+		kprintf("sfs: warning - fs has %u blocks of %u bytes, "
+			"device has %u of %u\n", sfs->sfs_super.sp_nblocks,
+			sfs->sfs_blocksize, dev->d_blocks, dev->d_blocksize);
+	}
+
+	/* Set up the buffer cache; everything from here on uses it */
+	result = sfs_bcache_create(sfs);
+	if (result) {
+		sfs_icache_destroy(sfs);
+		kfree(sfs);
+		vfs_biglock_release();
+		return result;
+	}
+
+	/* Open the journal, replaying it if needed, before reading metadata */
+	result = sfs_jcreate(sfs);
+	if (result) {
+		sfs_bcache_destroy(sfs);
+		sfs_icache_destroy(sfs);
+		kfree(sfs);
+		vfs_biglock_release();
+		return result;
+	}
+
 	/* Load free space bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
 	if (sfs->sfs_freemap == NULL) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_jdestroy(sfs);
+		sfs_bcache_destroy(sfs);
+		sfs_icache_destroy(sfs);
+		kfree(sfs);
+		vfs_biglock_release();
+		return ENOMEM;
+	}
+	sfs->sfs_dirtymap = bitmap_create(SFS_FS_BITBLOCKS(sfs));
+	if (sfs->sfs_dirtymap == NULL) {
+		bitmap_destroy(sfs->sfs_freemap);
+		sfs_jdestroy(sfs);
+		sfs_bcache_destroy(sfs);
+		sfs_icache_destroy(sfs);
 		kfree(sfs);
 		vfs_biglock_release();
 		return ENOMEM;
 	}
 	result = sfs_mapio(sfs, UIO_READ);
 	if (result) {
+		bitmap_destroy(sfs->sfs_dirtymap);
 		bitmap_destroy(sfs->sfs_freemap);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_jdestroy(sfs);
+		sfs_bcache_destroy(sfs);
+		sfs_icache_destroy(sfs);
 		kfree(sfs);
 		vfs_biglock_release();
 		return result;
@@ -357,6 +617,21 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* the other fields */
 	sfs->sfs_superdirty = false;
 	sfs->sfs_freemapdirty = false;
+	sfs->sfs_allochint = 0;
+	sfs->sfs_inohint = 0;
+
+	/* Let the syncer know about us */
+	result = sfs_addvolume(sfs);
+	if (result) {
+		bitmap_destroy(sfs->sfs_dirtymap);
+		bitmap_destroy(sfs->sfs_freemap);
+		sfs_jdestroy(sfs);
+		sfs_bcache_destroy(sfs);
+		sfs_icache_destroy(sfs);
+		kfree(sfs);
+		vfs_biglock_release();
+		return result;
+	}
 
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
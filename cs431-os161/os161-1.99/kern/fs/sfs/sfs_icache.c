@@ -0,0 +1,298 @@
+/*
+ * SFS inode cache.
+ *
+ * Every vnode SFS has in memory for a volume is on one of the
+ * chains of a small hash table keyed by inode number, so
+ * sfs_loadvnode finds an inode that's already loaded without looking
+ * at all the others.
+ *
+ * When the last reference to a vnode goes away, sfs_reclaim doesn't
+ * free it (unless the file is being deleted) but hands it to
+ * sfs_irelease, which keeps it around as idle: still hashed, holding
+ * the one reference that is left, and on an LRU list. Opening the
+ * file again then takes the vnode back without reading the inode
+ * from disk. Beyond SFS_IDLEMAX idle vnodes the least recently used
+ * are written back and freed.
+ *
+ * Like the rest of SFS this runs under vfs_biglock, which is also
+ * what makes picking up an idle vnode safe against reclaiming it.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <dcache.h>
+#include <sfs.h>
+
+/* Hash chains, and idle vnodes kept per volume. */
+#define SFS_IHASH	31
+#define SFS_IDLEMAX	16
+
+struct sfs_icache {
+	struct sfs_vnode *ic_hash[SFS_IHASH];	/* all loaded vnodes */
+	struct sfs_vnode *ic_lruhead;		/* idle longest */
+	struct sfs_vnode *ic_lrutail;		/* idle most recently */
+	unsigned ic_nloaded;			/* vnodes on the chains */
+	unsigned ic_nidle;			/* vnodes on the LRU list */
+};
+
+#define SFS_IHASHFN(ino)	((ino) % SFS_IHASH)
+
+////////////////////////////////////////////////////////////
+// LRU list
+
+static
+void
+sfs_ilruremove(struct sfs_icache *ic, struct sfs_vnode *sv)
+{
+	KASSERT(sv->sv_idle);
+	if (sv->sv_lruprev != NULL) {
+		sv->sv_lruprev->sv_lrunext = sv->sv_lrunext;
+	}
+	else {
+		ic->ic_lruhead = sv->sv_lrunext;
+	}
+	if (sv->sv_lrunext != NULL) {
+		sv->sv_lrunext->sv_lruprev = sv->sv_lruprev;
+	}
+	else {
+		ic->ic_lrutail = sv->sv_lruprev;
+	}
+	sv->sv_lruprev = sv->sv_lrunext = NULL;
+	sv->sv_idle = false;
+	KASSERT(ic->ic_nidle > 0);
+	ic->ic_nidle--;
+}
+
+static
+void
+sfs_ilruaddtail(struct sfs_icache *ic, struct sfs_vnode *sv)
+{
+	KASSERT(!sv->sv_idle);
+	sv->sv_lruprev = ic->ic_lrutail;
+	sv->sv_lrunext = NULL;
+	if (ic->ic_lrutail != NULL) {
+		ic->ic_lrutail->sv_lrunext = sv;
+	}
+	else {
+		ic->ic_lruhead = sv;
+	}
+	ic->ic_lrutail = sv;
+	sv->sv_idle = true;
+	ic->ic_nidle++;
+}
+
+/*
+ * Write back and free the least recently used idle vnode.
+ */
+static
+int
+sfs_ievict(struct sfs_fs *sfs)
+{
+	struct sfs_icache *ic = sfs->sfs_inodes;
+	struct sfs_vnode *sv = ic->ic_lruhead;
+	int result;
+
+	KASSERT(sv != NULL);
+	KASSERT(sv->sv_v.vn_refcount == 1);
+
+	result = sfs_sync_inode(sv);
+	if (result) {
+		return result;
+	}
+	sfs_ilruremove(ic, sv);
+	sfs_iremove(sfs, sv);
+	if (sv->sv_i.sfi_type == SFS_TYPE_DIR) {
+		/* the name cache knows it by address */
+		dcache_purgedir(&sv->sv_v);
+	}
+	VOP_CLEANUP(&sv->sv_v);
+	kfree(sv);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+/*
+ * Find inode INO if it's loaded, and hand it back with a reference.
+ * Returns NULL if it isn't.
+ */
+struct sfs_vnode *
+sfs_ifind(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_icache *ic = sfs->sfs_inodes;
+	struct sfs_vnode *sv;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	for (sv = ic->ic_hash[SFS_IHASHFN(ino)]; sv != NULL;
+	     sv = sv->sv_hashnext) {
+		if (sv->sv_ino == ino) {
+			break;
+		}
+	}
+	if (sv == NULL) {
+		return NULL;
+	}
+
+	if (sv->sv_idle) {
+		/* The reference it was kept with becomes the caller's */
+		sfs_ilruremove(ic, sv);
+	}
+	else {
+		VOP_INCREF(&sv->sv_v);
+	}
+	return sv;
+}
+
+/*
+ * Enter a newly loaded vnode.
+ */
+void
+sfs_iadd(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_icache *ic = sfs->sfs_inodes;
+	unsigned h = SFS_IHASHFN(sv->sv_ino);
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	sv->sv_hashnext = ic->ic_hash[h];
+	ic->ic_hash[h] = sv;
+	sv->sv_lruprev = sv->sv_lrunext = NULL;
+	sv->sv_idle = false;
+	ic->ic_nloaded++;
+}
+
+/*
+ * Take a vnode out of the cache, as it's about to be freed.
+ */
+void
+sfs_iremove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_icache *ic = sfs->sfs_inodes;
+	struct sfs_vnode **pp;
+
+	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(!sv->sv_idle);
+
+	for (pp = &ic->ic_hash[SFS_IHASHFN(sv->sv_ino)]; *pp != sv;
+	     pp = &(*pp)->sv_hashnext) {
+		if (*pp == NULL) {
+			panic("sfs: vnode %u not in inode cache\n",
+			      sv->sv_ino);
+		}
+	}
+	*pp = sv->sv_hashnext;
+	sv->sv_hashnext = NULL;
+	KASSERT(ic->ic_nloaded > 0);
+	ic->ic_nloaded--;
+}
+
+/*
+ * The last reference to SV is being dropped. Keep it as idle, and
+ * if there are too many of those, get rid of the oldest.
+ */
+int
+sfs_irelease(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_icache *ic = sfs->sfs_inodes;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(sv->sv_v.vn_refcount == 1);
+
+	sfs_ilruaddtail(ic, sv);
+	while (ic->ic_nidle > SFS_IDLEMAX) {
+		result = sfs_ievict(sfs);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Free all the idle vnodes, for unmount. Returns EBUSY if any others
+ * are still in use.
+ */
+int
+sfs_ipurge(struct sfs_fs *sfs)
+{
+	struct sfs_icache *ic = sfs->sfs_inodes;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	while (ic->ic_lruhead != NULL) {
+		result = sfs_ievict(sfs);
+		if (result) {
+			return result;
+		}
+	}
+	return ic->ic_nloaded > 0 ? EBUSY : 0;
+}
+
+/*
+ * Call sfs_sync_inode on everything loaded.
+ */
+int
+sfs_isync(struct sfs_fs *sfs)
+{
+	struct sfs_icache *ic = sfs->sfs_inodes;
+	struct sfs_vnode *sv;
+	unsigned i;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	for (i=0; i<SFS_IHASH; i++) {
+		for (sv = ic->ic_hash[i]; sv != NULL; sv = sv->sv_hashnext) {
+			result = sfs_sync_inode(sv);
+			if (result) {
+				return result;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Set up the inode cache for a volume being mounted.
+ */
+int
+sfs_icache_create(struct sfs_fs *sfs)
+{
+	struct sfs_icache *ic;
+	unsigned i;
+
+	ic = kmalloc(sizeof(*ic));
+	if (ic == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<SFS_IHASH; i++) {
+		ic->ic_hash[i] = NULL;
+	}
+	ic->ic_lruhead = ic->ic_lrutail = NULL;
+	ic->ic_nloaded = 0;
+	ic->ic_nidle = 0;
+	sfs->sfs_inodes = ic;
+	return 0;
+}
+
+/*
+ * Free the inode cache of a volume being unmounted. It must be empty
+ * (see sfs_ipurge).
+ */
+void
+sfs_icache_destroy(struct sfs_fs *sfs)
+{
+	struct sfs_icache *ic = sfs->sfs_inodes;
+
+	KASSERT(ic->ic_nloaded == 0);
+	KASSERT(ic->ic_nidle == 0);
+	kfree(ic);
+	sfs->sfs_inodes = NULL;
+}
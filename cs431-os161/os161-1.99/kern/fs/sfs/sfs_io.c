@@ -39,10 +39,10 @@
 //
 // Basic block-level I/O routines
 //
-// Note: sfs_rblock is used to read the superblock
+// Note: sfs_rhead is used to read the superblock
 // early in mount, before sfs is fully (or even mostly)
 // initialized, and so may not use anything from sfs
-// except sfs_device.
+// except sfs_device and sfs_blocksize.
 
 int
 sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
@@ -54,7 +54,7 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 
 	DEBUG(DB_SFS, "sfs: %s %llu\n", 
 	      uio->uio_rw == UIO_READ ? "read" : "write",
-	      uio->uio_offset / SFS_BLOCKSIZE);
+	      uio->uio_offset / sfs->sfs_blocksize);
 
  retry:
 	result = sfs->sfs_device->d_io(sfs->sfs_device, uio);
@@ -70,7 +70,7 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 		if (tries == 0) {
 			tries++;
 			kprintf("sfs: block %llu I/O error, retrying\n",
-				uio->uio_offset / SFS_BLOCKSIZE);
+				uio->uio_offset / sfs->sfs_blocksize);
 			goto retry;
 		}
 		else if (tries < 10) {
@@ -80,7 +80,7 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 		else {
 			kprintf("sfs: block %llu I/O error, giving up after "
 				"%d retries\n",
-				uio->uio_offset / SFS_BLOCKSIZE, tries);
+				uio->uio_offset / sfs->sfs_blocksize, tries);
 		}
 	}
 	return result;
@@ -92,7 +92,7 @@ sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block)
 	struct iovec iov;
 	struct uio ku;
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
+	SFSUIO(sfs, &iov, &ku, data, block, sfs->sfs_blocksize, UIO_READ);
 	return sfs_rwblock(sfs, &ku);
 }
 
@@ -102,6 +102,31 @@ sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block)
 	struct iovec iov;
 	struct uio ku;
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
+	SFSUIO(sfs, &iov, &ku, data, block, sfs->sfs_blocksize, UIO_WRITE);
+	return sfs_rwblock(sfs, &ku);
+}
+
+/*
+ * Read or write only the first SFS_BLOCKSIZE bytes of a block, for
+ * the superblock and journal header, which are that size whatever
+ * the volume's block size.
+ */
+int
+sfs_rhead(struct sfs_fs *sfs, void *data, uint32_t block)
+{
+	struct iovec iov;
+	struct uio ku;
+
+	SFSUIO(sfs, &iov, &ku, data, block, SFS_BLOCKSIZE, UIO_READ);
+	return sfs_rwblock(sfs, &ku);
+}
+
+int
+sfs_whead(struct sfs_fs *sfs, void *data, uint32_t block)
+{
+	struct iovec iov;
+	struct uio ku;
+
+	SFSUIO(sfs, &iov, &ku, data, block, SFS_BLOCKSIZE, UIO_WRITE);
 	return sfs_rwblock(sfs, &ku);
 }
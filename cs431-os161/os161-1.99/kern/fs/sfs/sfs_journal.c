@@ -0,0 +1,482 @@
+/*
+ * SFS metadata journal. See kern/sfs.h for the on-disk layout.
+ *
+ * A transaction is everything the buffer cache holds as dirty
+ * metadata (sfs_bmetadirty) when it is committed. Since every SFS
+ * operation runs start to finish under vfs_biglock, and commits only
+ * happen between operations -- from the syncer, sync and fsync, and
+ * from sfs_jcheck() at the start of an operation once dirty metadata
+ * fills half the buffer cache -- each transaction holds whole
+ * operations and a crash leaves the volume as of the last one
+ * committed. (A long write is done as a series of operations, so
+ * may be cut short.)
+ *
+ * A commit first writes back dirty file data, so committed metadata
+ * never points at blocks that don't hold what they should yet.
+ *
+ * Blocks freed during a transaction aren't put back in the free map
+ * until it has been committed at an operation boundary; until then
+ * the last committed metadata may still be using them, and they
+ * mustn't be handed out for new file data.
+ *
+ * Group commit: fsync on a volume with a journal goes through
+ * sfs_jsync, which instead of committing straight away steps aside
+ * once to let other threads finish what they're doing. Any that
+ * fsync meanwhile wait for the first one's commit, which covers
+ * their changes too, rather than each doing a commit of its own.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <synch.h>
+#include <vfs.h>
+#include <sfs.h>
+
+struct sfs_journal {
+	struct sfs_jheader j_header;		/* as on disk */
+	struct sfs_buf *j_bufs[SFS_JMAXBLOCKS];	/* transaction in progress */
+	uint32_t j_blocks[SFS_JMAXBLOCKS];	/* where they're written */
+	struct bitmap *j_freed;			/* freed, not yet released */
+	struct bitmap *j_freedmap;		/* freemap blocks they're in */
+	unsigned j_nfreed;
+	uint32_t j_tid;				/* transaction collecting */
+	uint32_t j_done;			/* last one committed */
+	bool j_gathering;			/* a sync is letting others in */
+	struct cv *j_cv;			/* syncs waiting for it */
+};
+
+/*
+ * Add a block image of BSIZE bytes to a running checksum.
+ */
+static
+uint32_t
+sfs_jsum(uint32_t sum, const void *data, uint32_t bsize)
+{
+	const uint32_t *words = data;
+	unsigned i;
+
+	for (i=0; i<bsize/sizeof(uint32_t); i++) {
+		sum = ((sum << 1) | (sum >> 31)) + words[i];
+	}
+	return sum;
+}
+
+/*
+ * Write the current transaction: file data, then the metadata images
+ * into the journal, then the header that commits them, then the
+ * metadata to where it belongs, then the header again to say that's
+ * done.
+ */
+static
+int
+sfs_jwrite(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jheader *jh = &j->j_header;
+	uint32_t jstart = sfs->sfs_super.sp_jstart;
+	uint32_t tid, sum;
+	unsigned i, n;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	result = sfs_bsyncdata(sfs);
+	if (result) {
+		return result;
+	}
+
+	tid = j->j_tid++;
+
+	n = sfs_bgetmeta(sfs, j->j_bufs, SFS_JMAXBLOCKS);
+	if (n == 0) {
+		j->j_done = tid;
+		return 0;
+	}
+
+	sum = 0;
+	for (i=0; i<n; i++) {
+		j->j_blocks[i] = jstart + 1 + i;
+		jh->jh_home[i] = j->j_bufs[i]->b_block;
+		sum = sfs_jsum(sum, j->j_bufs[i]->b_data, sfs->sfs_blocksize);
+	}
+	result = sfs_bwrite(sfs, j->j_bufs, j->j_blocks, n);
+	if (result) {
+		goto fail;
+	}
+
+	jh->jh_seq = tid;
+	jh->jh_count = n;
+	jh->jh_sum = sum;
+	result = sfs_whead(sfs, jh, jstart);
+	if (result) {
+		jh->jh_count = 0;
+		goto fail;
+	}
+
+	/*
+	 * The transaction is committed. If the rest fails, the next
+	 * one would overwrite the images while the header still
+	 * says to replay them, so there's no carrying on.
+	 */
+	for (i=0; i<n; i++) {
+		j->j_blocks[i] = j->j_bufs[i]->b_block;
+	}
+	result = sfs_bwrite(sfs, j->j_bufs, j->j_blocks, n);
+	if (result) {
+		panic("sfs: %s: journal checkpoint failed: %s\n",
+		      sfs->sfs_super.sp_volname, strerror(result));
+	}
+	for (i=0; i<n; i++) {
+		sfs_bwritten(sfs, j->j_bufs[i]);
+		sfs_brelse(sfs, j->j_bufs[i]);
+	}
+	j->j_done = tid;
+
+	/*
+	 * If this fails, the header still says to replay the images,
+	 * which is harmless until the next commit overwrites them,
+	 * and then the checksum no longer matches.
+	 */
+	jh->jh_count = 0;
+	return sfs_whead(sfs, jh, jstart);
+
+ fail:
+	for (i=0; i<n; i++) {
+		sfs_brelse(sfs, j->j_bufs[i]);
+	}
+	return result;
+}
+
+/*
+ * Put the blocks freed before the last commit back in the free map.
+ */
+static
+void
+sfs_jrelease(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	uint32_t bits = SFS_BLOCKBITS(sfs->sfs_blocksize);
+	uint32_t i, mapblocks;
+
+	bitmap_subtract(sfs->sfs_freemap, j->j_freed);
+	j->j_nfreed = 0;
+
+	mapblocks = SFS_BITBLOCKS(sfs->sfs_super.sp_nblocks,
+				  sfs->sfs_blocksize);
+	for (i=0; i<mapblocks; i++) {
+		if (bitmap_isset(j->j_freedmap, i)) {
+			bitmap_unmark(j->j_freedmap, i);
+			sfs_markmap(sfs, i * bits, bits);
+		}
+	}
+}
+
+/*
+ * Commit, between operations, with the inodes and free map already
+ * pushed into the buffer cache (sfs_pushmeta). Blocks freed by the
+ * transaction are released afterwards, which changes the free map,
+ * so that goes in a second, small transaction.
+ */
+int
+sfs_jcommit(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	int result;
+
+	result = sfs_jwrite(sfs);
+	if (result) {
+		return result;
+	}
+	if (j->j_nfreed > 0) {
+		sfs_jrelease(sfs);
+		result = sfs_pushmeta(sfs);
+		if (result) {
+			return result;
+		}
+		result = sfs_jwrite(sfs);
+	}
+	return result;
+}
+
+/*
+ * Called at the start of every operation that may change metadata,
+ * before it has changed anything. If dirty metadata, with the inodes
+ * and free map pushed into the buffer cache, fills more than half of
+ * it, commit now, so the operation has room to finish in. (The
+ * buffer cache is sized for this; see sfs_buf.c.)
+ */
+int
+sfs_jcheck(struct sfs_fs *sfs)
+{
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (sfs->sfs_journal == NULL) {
+		return 0;
+	}
+
+	result = sfs_pushmeta(sfs);
+	if (result) {
+		return result;
+	}
+	if (!sfs_bmetahigh(sfs)) {
+		return 0;
+	}
+	return sfs_jcommit(sfs);
+}
+
+/*
+ * COUNT blocks from BLOCK on are being freed; hold on to them until
+ * it's safe to reuse them.
+ */
+void
+sfs_jfree(struct sfs_fs *sfs, uint32_t block, uint32_t count)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	uint32_t bits = SFS_BLOCKBITS(sfs->sfs_blocksize);
+	uint32_t i;
+
+	bitmap_markrange(j->j_freed, block, count);
+	j->j_nfreed += count;
+	for (i = block / bits; i <= (block + count - 1) / bits; i++) {
+		if (!bitmap_isset(j->j_freedmap, i)) {
+			bitmap_mark(j->j_freedmap, i);
+		}
+	}
+}
+
+/*
+ * Make everything done so far durable. Without a journal this just
+ * writes back everything; with one, it's a group commit (see above).
+ */
+int
+sfs_jsync(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	uint32_t tid;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (j == NULL) {
+		result = sfs_pushmeta(sfs);
+		if (result) {
+			return result;
+		}
+		return sfs_bsync(sfs);
+	}
+
+	/* Whatever we did is in the transaction now collecting */
+	tid = j->j_tid;
+
+	while (j->j_done < tid) {
+		if (j->j_gathering) {
+			/* Someone is about to commit; go along with it */
+			if (vfs_biglock_wait(j->j_cv)) {
+				continue;
+			}
+		}
+		else {
+			j->j_gathering = true;
+			(void)vfs_biglock_yield();
+			j->j_gathering = false;
+			if (j->j_done >= tid) {
+				break;
+			}
+		}
+
+		result = sfs_pushmeta(sfs);
+		if (result == 0) {
+			result = sfs_jcommit(sfs);
+		}
+		vfs_biglock_broadcast(j->j_cv);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Finish a transaction that was interrupted after it was committed,
+ * by copying its images to where they go. Called at mount time,
+ * before anything is in the buffer cache.
+ */
+static
+int
+sfs_jreplay(struct sfs_fs *sfs)
+{
+	struct sfs_jheader *jh = &sfs->sfs_journal->j_header;
+	uint32_t jstart = sfs->sfs_super.sp_jstart;
+	const char *volname = sfs->sfs_super.sp_volname;
+	void *image;
+	uint32_t i, home, sum;
+	int result;
+
+	if (jh->jh_count == 0) {
+		return 0;
+	}
+
+	image = kmalloc(sfs->sfs_blocksize);
+	if (image == NULL) {
+		return ENOMEM;
+	}
+
+	sum = 0;
+	for (i=0; i<jh->jh_count && i<SFS_JMAXBLOCKS; i++) {
+		result = sfs_rblock(sfs, image, jstart + 1 + i);
+		if (result) {
+			kfree(image);
+			return result;
+		}
+		sum = sfs_jsum(sum, image, sfs->sfs_blocksize);
+
+		home = jh->jh_home[i];
+		if (home == SFS_SB_LOCATION ||
+		    home >= sfs->sfs_super.sp_nblocks ||
+		    (home >= jstart && home < jstart + SFS_JBLOCKS)) {
+			sum = ~jh->jh_sum;
+			break;
+		}
+	}
+
+	if (jh->jh_count > SFS_JMAXBLOCKS || sum != jh->jh_sum) {
+		kprintf("sfs: %s: journal transaction %u incomplete; "
+			"ignored\n", volname, jh->jh_seq);
+	}
+	else {
+		for (i=0; i<jh->jh_count; i++) {
+			result = sfs_rblock(sfs, image, jstart + 1 + i);
+			if (result == 0) {
+				result = sfs_wblock(sfs, image,
+						    jh->jh_home[i]);
+			}
+			if (result) {
+				kfree(image);
+				return result;
+			}
+		}
+		kprintf("sfs: %s: replayed journal transaction %u "
+			"(%u blocks)\n", volname, jh->jh_seq, jh->jh_count);
+	}
+	kfree(image);
+
+	jh->jh_count = 0;
+	return sfs_whead(sfs, jh, jstart);
+}
+
+/*
+ * Set up the journal of a volume being mounted, if it has one, and
+ * recover from a crash if need be.
+ */
+int
+sfs_jcreate(struct sfs_fs *sfs)
+{
+	struct sfs_super *sp = &sfs->sfs_super;
+	struct sfs_journal *j;
+	int result;
+
+	KASSERT(sizeof(struct sfs_jheader) == SFS_BLOCKSIZE);
+
+	sfs->sfs_journal = NULL;
+	if (sp->sp_jblocks == 0) {
+		return 0;
+	}
+	if (sp->sp_jblocks != SFS_JBLOCKS ||
+	    sp->sp_jstart < SFS_MAP_LOCATION +
+	    SFS_BITBLOCKS(sp->sp_nblocks, sfs->sfs_blocksize) ||
+	    sp->sp_jstart + sp->sp_jblocks > sp->sp_nblocks) {
+		kprintf("sfs: %s: bad journal location %u size %u\n",
+			sp->sp_volname, sp->sp_jstart, sp->sp_jblocks);
+		return EINVAL;
+	}
+	if (sfs->sfs_blocksize > SFS_JMAXBLOCKSIZE) {
+		/* The buffer cache it needs would take too much memory */
+		kprintf("sfs: %s: blocks too big for a journal "
+			"(%u bytes, most %u)\n", sp->sp_volname,
+			sfs->sfs_blocksize, SFS_JMAXBLOCKSIZE);
+		return EINVAL;
+	}
+	if (SFS_BITBLOCKS(sp->sp_nblocks, sfs->sfs_blocksize) >
+	    SFS_JMAXMAPBLOCKS) {
+		/* The buffer cache couldn't hold a transaction */
+		kprintf("sfs: %s: free map too big for a journal "
+			"(%u blocks, most %u)\n", sp->sp_volname,
+			SFS_BITBLOCKS(sp->sp_nblocks, sfs->sfs_blocksize),
+			SFS_JMAXMAPBLOCKS);
+		return EINVAL;
+	}
+
+	j = kmalloc(sizeof(*j));
+	if (j == NULL) {
+		return ENOMEM;
+	}
+	j->j_freed = bitmap_create(SFS_BITMAPSIZE(sp->sp_nblocks,
+						  sfs->sfs_blocksize));
+	if (j->j_freed == NULL) {
+		kfree(j);
+		return ENOMEM;
+	}
+	j->j_freedmap = bitmap_create(SFS_BITBLOCKS(sp->sp_nblocks,
+						    sfs->sfs_blocksize));
+	if (j->j_freedmap == NULL) {
+		bitmap_destroy(j->j_freed);
+		kfree(j);
+		return ENOMEM;
+	}
+	j->j_cv = cv_create("sfs journal");
+	if (j->j_cv == NULL) {
+		bitmap_destroy(j->j_freedmap);
+		bitmap_destroy(j->j_freed);
+		kfree(j);
+		return ENOMEM;
+	}
+	j->j_nfreed = 0;
+	j->j_gathering = false;
+	sfs->sfs_journal = j;
+
+	result = sfs_rhead(sfs, &j->j_header, sp->sp_jstart);
+	if (result) {
+		sfs_jdestroy(sfs);
+		return result;
+	}
+	if (j->j_header.jh_magic != SFS_JMAGIC) {
+		kprintf("sfs: %s: bad journal magic number 0x%x\n",
+			sp->sp_volname, j->j_header.jh_magic);
+		sfs_jdestroy(sfs);
+		return EINVAL;
+	}
+
+	result = sfs_jreplay(sfs);
+	if (result) {
+		sfs_jdestroy(sfs);
+		return result;
+	}
+
+	j->j_done = j->j_header.jh_seq;
+	j->j_tid = j->j_done + 1;
+	return 0;
+}
+
+/*
+ * Tear down the journal of a volume being unmounted, or whose mount
+ * failed. Everything must have been committed.
+ */
+void
+sfs_jdestroy(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	if (j == NULL) {
+		return;
+	}
+	KASSERT(j->j_nfreed == 0);
+	cv_destroy(j->j_cv);
+	bitmap_destroy(j->j_freedmap);
+	bitmap_destroy(j->j_freed);
+	kfree(j);
+	sfs->sfs_journal = NULL;
+}
@@ -0,0 +1,228 @@
+/*
+ * SFS sequential readahead.
+ *
+ * sfs_ra_note() is told about every read of a file. When a read
+ * picks up where the last one left off, the file is being read
+ * sequentially and the next blocks are queued for a kernel thread to
+ * bring into the buffer cache while the reader is busy with what it
+ * already has. The window of blocks read ahead starts at SFS_RAMIN,
+ * doubles with each further sequential read up to SFS_RAMAX, and
+ * collapses to nothing on a read anywhere else.
+ *
+ * State is kept per vnode rather than per open file, since that is
+ * all VOP_READ gets to see; a file read sequentially through two
+ * descriptors at once just loses its readahead.
+ *
+ * Readahead is only ever advice: if the queue is full the request is
+ * dropped, and errors are ignored (the real read will see them).
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <thread.h>
+#include <proc.h>
+#include <vfs.h>
+#include <sfs.h>
+
+/* Readahead window limits, in blocks. */
+#define SFS_RAMIN	4
+#define SFS_RAMAX	16
+
+/* Pending requests. */
+#define SFS_RAQUEUE	8
+
+struct sfs_rareq {
+	struct sfs_vnode *ra_sv;	/* file; holds a reference */
+	uint32_t ra_block;		/* first file block */
+	uint32_t ra_count;		/* number of blocks */
+};
+
+static struct lock *sfs_ralock;
+static struct cv *sfs_racv;
+static struct sfs_rareq sfs_raqueue[SFS_RAQUEUE];
+static unsigned sfs_rahead, sfs_ranum;
+
+/*
+ * Bring the blocks of one request into the cache. The biglock is
+ * only held to find where the blocks are; sfs_bprefetch() reads them
+ * in as one batch and doesn't hold it while waiting for the disk.
+ */
+static
+void
+sfs_ra_do(struct sfs_rareq *req)
+{
+	struct sfs_vnode *sv = req->ra_sv;
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t blocks[SFS_RAMAX];
+	uint32_t i, n, diskblock;
+	int result;
+
+	KASSERT(req->ra_count <= SFS_RAMAX);
+
+	n = 0;
+	vfs_biglock_acquire();
+	/* If inline, it was truncated since; nothing on disk to read */
+	if ((sv->sv_i.sfi_flags & SFS_IF_INLINE) == 0) {
+		for (i=0; i<req->ra_count; i++) {
+			result = sfs_bmap(sv, req->ra_block + i, 0,
+					  &diskblock);
+			if (result) {
+				break;
+			}
+			if (diskblock != 0) {
+				blocks[n++] = diskblock;
+			}
+		}
+	}
+	vfs_biglock_release();
+
+	sfs_bprefetch(sfs, blocks, n);
+
+	VOP_DECREF(&sv->sv_v);
+}
+
+static
+void
+sfs_ra_thread(void *data1, unsigned long data2)
+{
+	struct sfs_rareq req;
+
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		lock_acquire(sfs_ralock);
+		while (sfs_ranum == 0) {
+			cv_wait(sfs_racv, sfs_ralock);
+		}
+		req = sfs_raqueue[sfs_rahead];
+		sfs_rahead = (sfs_rahead + 1) % SFS_RAQUEUE;
+		sfs_ranum--;
+		lock_release(sfs_ralock);
+
+		sfs_ra_do(&req);
+	}
+}
+
+/*
+ * Queue COUNT blocks of SV starting at file block BLOCK.
+ */
+static
+void
+sfs_ra_queue(struct sfs_vnode *sv, uint32_t block, uint32_t count)
+{
+	struct sfs_rareq *req;
+
+	lock_acquire(sfs_ralock);
+	if (sfs_ranum == SFS_RAQUEUE) {
+		lock_release(sfs_ralock);
+		return;
+	}
+	req = &sfs_raqueue[(sfs_rahead + sfs_ranum) % SFS_RAQUEUE];
+	VOP_INCREF(&sv->sv_v);
+	req->ra_sv = sv;
+	req->ra_block = block;
+	req->ra_count = count;
+	sfs_ranum++;
+	cv_signal(sfs_racv, sfs_ralock);
+	lock_release(sfs_ralock);
+}
+
+/*
+ * A read of SV has just covered [STARTPOS, ENDPOS). Decide whether
+ * it looks sequential and, if so, queue readahead past it.
+ */
+void
+sfs_ra_note(struct sfs_vnode *sv, off_t startpos, off_t endpos)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t bsize = sfs->sfs_blocksize;
+	uint32_t first, last, start, end, eofblock;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (endpos <= startpos) {
+		/* nothing read; at EOF */
+		return;
+	}
+
+	first = startpos / bsize;
+	last = (endpos - 1) / bsize;
+
+	/*
+	 * Sequential if it starts at the block after the last read,
+	 * or partway into the block the last read ended in.
+	 */
+	if (first == sv->sv_ranext ||
+	    (first + 1 == sv->sv_ranext && startpos % bsize != 0)) {
+		if (sv->sv_rawindow == 0) {
+			sv->sv_rawindow = SFS_RAMIN;
+		}
+		else if (sv->sv_rawindow < SFS_RAMAX) {
+			sv->sv_rawindow *= 2;
+		}
+	}
+	else {
+		sv->sv_rawindow = 0;
+		sv->sv_rahigh = 0;
+	}
+	sv->sv_ranext = last + 1;
+
+	if (sv->sv_rawindow == 0 || sfs_ralock == NULL) {
+		return;
+	}
+
+	/* Don't redo what's already been asked for, or go past EOF. */
+	start = last + 1;
+	if (start < sv->sv_rahigh) {
+		start = sv->sv_rahigh;
+	}
+	end = last + 1 + sv->sv_rawindow;
+	eofblock = DIVROUNDUP(sv->sv_i.sfi_size, bsize);
+	if (end > eofblock) {
+		end = eofblock;
+	}
+	if (start >= end) {
+		return;
+	}
+
+	sfs_ra_queue(sv, start, end - start);
+	sv->sv_rahigh = end;
+}
+
+/*
+ * Start the readahead thread, if it isn't running yet. Called when a
+ * volume is mounted.
+ */
+int
+sfs_ra_start(void)
+{
+	int result;
+
+	if (sfs_ralock != NULL) {
+		return 0;
+	}
+
+	sfs_ralock = lock_create("sfs readahead");
+	if (sfs_ralock == NULL) {
+		return ENOMEM;
+	}
+	sfs_racv = cv_create("sfs readahead");
+	if (sfs_racv == NULL) {
+		lock_destroy(sfs_ralock);
+		sfs_ralock = NULL;
+		return ENOMEM;
+	}
+
+	result = thread_fork("sfs readahead", kproc, sfs_ra_thread, NULL, 0);
+	if (result) {
+		cv_destroy(sfs_racv);
+		lock_destroy(sfs_ralock);
+		sfs_racv = NULL;
+		sfs_ralock = NULL;
+		return result;
+	}
+	return 0;
+}
@@ -43,12 +43,16 @@
 #include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <dcache.h>
 #include <sfs.h>
 
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
 
+/* Further down */
+static int sfs_dotruncate(struct vnode *v, off_t len);
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
@@ -58,22 +62,65 @@ static
 int
 sfs_clearblock(struct sfs_fs *sfs, uint32_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
-	return sfs_wblock(sfs, zeros, block);
+	struct sfs_buf *b;
+	int result;
+
+	result = sfs_bget(sfs, block, &b);
+	if (result) {
+		return result;
+	}
+	bzero(b->b_data, sfs->sfs_blocksize);
+	sfs_bdirty(sfs, b);
+	sfs_brelse(sfs, b);
+	return 0;
 }
 
-/* Write an on-disk inode structure back out to disk. */
+/* Where inode INO is in B, the buffer for its block. */
 static
+struct sfs_inode *
+sfs_inoptr(struct sfs_fs *sfs, struct sfs_buf *b, uint32_t ino)
+{
+	uint32_t index = SFS_INOINDEX(ino, sfs->sfs_inoperblock);
+
+	return (struct sfs_inode *)((char *)b->b_data + index*SFS_INODESIZE);
+}
+
+/*
+ * Copy an in-memory inode into the buffer cache, from where it will
+ * be written back with everything else.
+ */
 int
 sfs_sync_inode(struct sfs_vnode *sv)
 {
 	if (sv->sv_dirty) {
 		struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-		int result = sfs_wblock(sfs, &sv->sv_i, sv->sv_ino);
-		if (result) {
-			return result;
+		uint32_t ipb = sfs->sfs_inoperblock;
+		struct sfs_buf *b;
+		int result;
+
+		if (ipb == 1) {
+			/*
+			 * The inode is alone in its block, so there's
+			 * no need to read it; the rest is zeros.
+			 */
+			result = sfs_bget(sfs, sv->sv_ino, &b);
+			if (result) {
+				return result;
+			}
+			bzero(b->b_data, sfs->sfs_blocksize);
+		}
+		else {
+			/* Other inodes share the block; keep them */
+			result = sfs_bread(sfs, SFS_INOBLOCK(sv->sv_ino, ipb),
+					   &b);
+			if (result) {
+				return result;
+			}
 		}
+		memcpy(sfs_inoptr(sfs, b, sv->sv_ino), &sv->sv_i,
+		       sizeof(sv->sv_i));
+		sfs_bmetadirty(sfs, b);
+		sfs_brelse(sfs, b);
 		sv->sv_dirty = false;
 	}
 	return 0;
@@ -84,19 +131,26 @@ sfs_sync_inode(struct sfs_vnode *sv)
 // Space allocation
 
 /*
- * Allocate a block.
+ * Allocate a block, the first free one at or after GOAL.
+ *
+ * Blocks of a file are asked for just past the previous block of the
+ * file (see sfs_bgoal), so a file written sequentially is laid out
+ * contiguously when there's room. New objects are asked for at
+ * sfs_allochint, which follows the last allocation around the disk,
+ * so they end up next to whatever was written just before and the
+ * freemap isn't rescanned from the start every time.
  */
-static
 int
-sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
+sfs_balloc(struct sfs_fs *sfs, uint32_t goal, uint32_t *diskblock)
 {
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	result = bitmap_alloc_near(sfs->sfs_freemap, goal, diskblock);
 	if (result) {
 		return result;
 	}
-	sfs->sfs_freemapdirty = true;
+	sfs_markmap(sfs, *diskblock, 1);
+	sfs->sfs_allochint = *diskblock + 1;
 
 	if (*diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: balloc: invalid block %u\n", *diskblock);
@@ -107,14 +161,50 @@ sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
 }
 
 /*
- * Free a block.
+ * Where to look for a block for block FILEBLOCK of a file: just past
+ * the block before it, or if that's not there, just past the inode.
  */
 static
+uint32_t
+sfs_bgoal(struct sfs_vnode *sv, uint32_t fileblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t prev;
+
+	if (fileblock > 0 &&
+	    sfs_bmap(sv, fileblock - 1, 0, &prev) == 0 && prev != 0) {
+		return prev + 1;
+	}
+	return SFS_INOBLOCK(sv->sv_ino, sfs->sfs_inoperblock) + 1;
+}
+
+/*
+ * Free COUNT consecutive blocks starting at DISKBLOCK. With a
+ * journal, they stay in use until the freeing has been committed
+ * (see sfs_journal.c). Either way the free map only goes to disk
+ * later, with the rest of the metadata.
+ */
+void
+sfs_bfreerun(struct sfs_fs *sfs, uint32_t diskblock, uint32_t count)
+{
+	/* Whatever is cached for the blocks is garbage now */
+	sfs_binval(sfs, diskblock, count);
+
+	if (sfs->sfs_journal != NULL) {
+		sfs_jfree(sfs, diskblock, count);
+		return;
+	}
+	bitmap_unmarkrange(sfs->sfs_freemap, diskblock, count);
+	sfs_markmap(sfs, diskblock, count);
+}
+
+/*
+ * Free a block.
+ */
 void
 sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock)
 {
-	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	sfs_bfreerun(sfs, diskblock, 1);
 }
 
 /*
@@ -135,33 +225,114 @@ sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
 //
 // Block mapping/inode maintenance
 
+/*
+ * Look up block OFFSET of the part of a file mapped through the tree
+ * of indirect blocks rooted at *IDBLOCKP, which is LEVELS deep (1 for
+ * the single indirect block, 3 for the triple); it is block FILEBLOCK
+ * of the file as a whole. If DOALLOC is set, missing indirect blocks
+ * and the data block are allocated on the way down; otherwise a hole
+ * anywhere along the way gives block 0.
+ */
+static
+int
+sfs_bmap_indirect(struct sfs_vnode *sv, uint32_t *idblockp, unsigned levels,
+		  uint32_t offset, uint32_t fileblock, int doalloc,
+		  uint32_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *idbuf;
+	uint32_t *iddata;
+	uint32_t idblock, block, span, idoff;
+	unsigned i;
+	int result;
+
+	/* Get the disk block number of the top indirect block. */
+	idblock = *idblockp;
+	if (idblock==0 && !doalloc) {
+		/* Pretend it was filled with all zeros. */
+		*diskblock = 0;
+		return 0;
+	}
+	else if (idblock==0) {
+		result = sfs_balloc(sfs, sfs_bgoal(sv, fileblock), &idblock);
+		if (result) {
+			return result;
+		}
+
+		/* Remember it; that dirties the inode */
+		*idblockp = idblock;
+		sv->sv_dirty = true;
+
+		/* sfs_balloc cleared it, in the buffer cache too */
+	}
+
+	/* Blocks covered by each entry of the top indirect block */
+	span = 1;
+	for (i=1; i<levels; i++) {
+		span *= sfs->sfs_dbperidb;
+	}
+
+	/* Walk down, one indirect block per level. */
+	for (; levels > 0; levels--) {
+		idoff = offset / span;
+		offset %= span;
+		span /= sfs->sfs_dbperidb;
+
+		/* Load the indirect block (from the buffer cache, usually) */
+		result = sfs_bread(sfs, idblock, &idbuf);
+		if (result) {
+			return result;
+		}
+		iddata = idbuf->b_data;
+
+		/* Get the next block out of it */
+		block = iddata[idoff];
+
+		/* If there's no block there, allocate one */
+		if (block==0 && doalloc) {
+			result = sfs_balloc(sfs, sfs_bgoal(sv, fileblock),
+					    &block);
+			if (result) {
+				sfs_brelse(sfs, idbuf);
+				return result;
+			}
+
+			/* Remember the block we allocated */
+			iddata[idoff] = block;
+
+			/* The indirect block is now dirty */
+			sfs_bmetadirty(sfs, idbuf);
+		}
+		sfs_brelse(sfs, idbuf);
+
+		if (block == 0) {
+			/* A hole */
+			break;
+		}
+		idblock = block;
+	}
+
+	*diskblock = block;
+	return 0;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
  * file. If DOALLOC is set, and no such block exists, one will be
  * allocated.
  */
-static
 int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	 uint32_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-	uint32_t block;
-	uint32_t idblock;
-	uint32_t idnum, idoff;
+	uint32_t block, off;
+	uint64_t per = sfs->sfs_dbperidb;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	/* An inline file has no blocks, and its pointers are data */
+	KASSERT((sv->sv_i.sfi_flags & SFS_IF_INLINE) == 0);
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -176,7 +347,8 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			result = sfs_balloc(sfs, sfs_bgoal(sv, fileblock),
+					    &block);
 			if (result) {
 				return result;
 			}
@@ -198,86 +370,29 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	}
 
 	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
-	 */
-
-	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
-
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
+	 * It's not a direct block; it must be under one of the
+	 * indirect blocks. Subtract off the blocks each one before it
+	 * covers until OFF is an offset into the right one.
 	 */
-	if (idnum > 0) {
-		return EFBIG;
+	off = fileblock - SFS_NDIRECT;
+	if (off < per) {
+		result = sfs_bmap_indirect(sv, &sv->sv_i.sfi_indirect, 1,
+					   off, fileblock, doalloc, &block);
 	}
-
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
-
-	if (idblock==0 && !doalloc) {
-		/*
-		 * There's no indirect block allocated. We weren't
-		 * asked to allocate anything, so pretend the indirect
-		 * block was filled with all zeros.
-		 */
-		*diskblock = 0;
-		return 0;
+	else if ((off -= per) < per * per) {
+		result = sfs_bmap_indirect(sv, &sv->sv_i.sfi_dindirect, 2,
+					   off, fileblock, doalloc, &block);
 	}
-	else if (idblock==0) {
-		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
-		 */
-		result = sfs_balloc(sfs, &idblock);
-		if (result) {
-			return result;
-		}
-
-		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
-
-		/* Mark the inode dirty */
-		sv->sv_dirty = true;
-
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
+	else if ((off -= per * per) < per * per * per) {
+		result = sfs_bmap_indirect(sv, &sv->sv_i.sfi_tindirect, 3,
+					   off, fileblock, doalloc, &block);
 	}
 	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
-		}
+		/* Too large for the inode to map. */
+		return EFBIG;
 	}
-
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
-
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
-		if (result) {
-			return result;
-		}
-
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
-
-		/* The indirect block is now dirty; write it back */
-		result = sfs_wblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
-		}
+	if (result) {
+		return result;
 	}
 
 	/* Hand back the result and return. */
@@ -293,6 +408,24 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 //
 // File-level I/O
 
+/*
+ * Mark a block of a file dirty after writing it. Directory contents
+ * are metadata and go through the journal; file contents don't.
+ */
+static
+void
+sfs_iodirty(struct sfs_vnode *sv, struct sfs_buf *b)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	if (sv->sv_i.sfi_type == SFS_TYPE_DIR) {
+		sfs_bmetadirty(sfs, b);
+	}
+	else {
+		sfs_bdirty(sfs, b);
+	}
+}
+
 /*
  * Do I/O to a block of a file that doesn't cover the whole block.  We
  * need to read in the original block first, even if we're writing, so
@@ -308,16 +441,8 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *iobuf;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -325,10 +450,10 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	/* Allocate missing blocks if and only if we're writing */
 	int doalloc = (uio->uio_rw==UIO_WRITE);
 
-	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
+	KASSERT(skipstart + len <= sfs->sfs_blocksize);
 
 	/* Compute the block offset of this block in the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	fileblock = uio->uio_offset / sfs->sfs_blocksize;
 
 	/* Get the disk block number */
 	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
@@ -339,26 +464,26 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Hand back zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
+		return uiomovezeros(len, uio);
 	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_rblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+
+	/*
+	 * Read the block.
+	 */
+	result = sfs_bread(sfs, diskblock, &iobuf);
+	if (result) {
+		return result;
 	}
 
 	/*
 	 * Now perform the requested operation into/out of the buffer.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = uiomove((char *)iobuf->b_data+skipstart, len, uio);
 	if (result) {
+		sfs_brelse(sfs, iobuf);
 		return result;
 	}
 
@@ -366,12 +491,10 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	 * If it was a write, write back the modified block.
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_wblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		sfs_iodirty(sv, iobuf);
 	}
 
+	sfs_brelse(sfs, iobuf);
 	return 0;
 }
 
@@ -383,17 +506,15 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *iobuf;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
 	int doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
+	bool wasvalid;
 
 	/* Get the block number within the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	fileblock = uio->uio_offset / sfs->sfs_blocksize;
 
 	/* Look up the disk block number */
 	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
@@ -409,34 +530,100 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 		 * allocated a block for us.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		return uiomovezeros(SFS_BLOCKSIZE, uio);
+		return uiomovezeros(sfs->sfs_blocksize, uio);
 	}
 
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
+	KASSERT(uio->uio_resid >= sfs->sfs_blocksize);
 
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-	
-	result = sfs_rwblock(sfs, uio);
+	if (uio->uio_rw == UIO_READ) {
+		result = sfs_bread(sfs, diskblock, &iobuf);
+		if (result) {
+			return result;
+		}
+		result = uiomove(iobuf->b_data, sfs->sfs_blocksize, uio);
+		sfs_brelse(sfs, iobuf);
+		return result;
+	}
 
 	/*
-	 * Now, restore the original uio_offset and uio_resid and update 
-	 * them by the amount of I/O done.
+	 * Writing the whole block, so there's no need to read it
+	 * first. If the copy from the caller faults part way through
+	 * a block that wasn't already cached, the buffer is just
+	 * dropped; otherwise what did get copied is kept, as with a
+	 * short write.
 	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	result = sfs_bget(sfs, diskblock, &iobuf);
+	if (result) {
+		return result;
+	}
+	wasvalid = iobuf->b_valid;
+	result = uiomove(iobuf->b_data, sfs->sfs_blocksize, uio);
+	if (result == 0 || wasvalid) {
+		sfs_iodirty(sv, iobuf);
+	}
+	sfs_brelse(sfs, iobuf);
+	return result;
+}
+
+/*
+ * Do I/O to a file whose contents are in its inode. The caller has
+ * made sure the I/O stays inside SFS_INLINESIZE.
+ */
+static
+int
+sfs_inlineio(struct sfs_vnode *sv, struct uio *uio)
+{
+	KASSERT(uio->uio_offset + uio->uio_resid <= SFS_INLINESIZE);
+
+	if (uio->uio_rw == UIO_WRITE) {
+		sv->sv_dirty = true;
+	}
+	return uiomove(SFS_INLINEDATA(&sv->sv_i) + uio->uio_offset,
+		       uio->uio_resid, uio);
+}
+
+/*
+ * Move the contents of an inline file out to a block of its own, so
+ * it can grow past SFS_INLINESIZE.
+ */
+static
+int
+sfs_uninline(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	char data[SFS_INLINESIZE];
+	struct sfs_buf *b;
+	uint32_t diskblock;
+	int result;
 
+	memcpy(data, SFS_INLINEDATA(&sv->sv_i), SFS_INLINESIZE);
+	bzero(SFS_INLINEDATA(&sv->sv_i), SFS_INLINESIZE);
+	sv->sv_i.sfi_flags &= ~SFS_IF_INLINE;
+	sv->sv_dirty = true;
+
+	if (sv->sv_i.sfi_size == 0) {
+		return 0;
+	}
+
+	result = sfs_bmap(sv, 0, 1, &diskblock);
+	if (result) {
+		goto fail;
+	}
+	result = sfs_bread(sfs, diskblock, &b);
+	if (result) {
+		sv->sv_i.sfi_direct[0] = 0;
+		sfs_bfree(sfs, diskblock);
+		goto fail;
+	}
+	memcpy(b->b_data, data, sv->sv_i.sfi_size);
+	sfs_bdirty(sfs, b);
+	sfs_brelse(sfs, b);
+	return 0;
+
+ fail:
+	/* Put things back the way they were */
+	memcpy(SFS_INLINEDATA(&sv->sv_i), data, SFS_INLINESIZE);
+	sv->sv_i.sfi_flags |= SFS_IF_INLINE;
 	return result;
 }
 
@@ -447,11 +634,21 @@ static
 int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t bsize = sfs->sfs_blocksize;
 	uint32_t blkoff;
 	uint32_t nblocks, i;
 	int result = 0;
 	uint32_t extraresid = 0;
 
+	/*
+	 * If writing, don't go past what the inode can map.
+	 */
+	if (uio->uio_rw == UIO_WRITE &&
+	    uio->uio_offset + uio->uio_resid > sfs->sfs_maxfilesize) {
+		return EFBIG;
+	}
+
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
 	 * remember how much extra there was in EXTRARESID so we can
@@ -473,16 +670,32 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		}
 	}
 
+	/*
+	 * Small files are kept in the inode until a write takes them
+	 * past what fits there.
+	 */
+	if (sv->sv_i.sfi_flags & SFS_IF_INLINE) {
+		if (uio->uio_rw == UIO_READ ||
+		    uio->uio_offset + uio->uio_resid <= SFS_INLINESIZE) {
+			result = sfs_inlineio(sv, uio);
+			goto out;
+		}
+		result = sfs_uninline(sv);
+		if (result) {
+			goto out;
+		}
+	}
+
 	/*
 	 * First, do any leading partial block.
 	 */
-	blkoff = uio->uio_offset % SFS_BLOCKSIZE;
+	blkoff = uio->uio_offset % bsize;
 	if (blkoff != 0) {
 		/* Number of bytes at beginning of block to skip */
 		uint32_t skip = blkoff;
 
 		/* Number of bytes to read/write after that point */
-		uint32_t len = SFS_BLOCKSIZE - blkoff;
+		uint32_t len = bsize - blkoff;
 
 		/* ...which might be less than the rest of the block */
 		if (len > uio->uio_resid) {
@@ -504,8 +717,8 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	/*
 	 * Now we should be block-aligned. Do the remaining whole blocks.
 	 */
-	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
-	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
+	KASSERT(uio->uio_offset % bsize == 0);
+	nblocks = uio->uio_resid / bsize;
 	for (i=0; i<nblocks; i++) {
 		result = sfs_blockio(sv, uio);
 		if (result) {
@@ -516,7 +729,7 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	/*
 	 * Now do any remaining partial block at the end.
 	 */
-	KASSERT(uio->uio_resid < SFS_BLOCKSIZE);
+	KASSERT(uio->uio_resid < bsize);
 
 	if (uio->uio_resid > 0) {
 		result = sfs_partialio(sv, uio, 0, uio->uio_resid);
@@ -549,7 +762,6 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
  * Read the directory entry out of slot SLOT of a directory vnode.
  * The "slot" is the index of the directory entry, starting at 0.
  */
-static
 int
 sfs_readdir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
 {
@@ -619,7 +831,6 @@ sfs_writedir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
  * This actually computes the number of existing slots, and does not
  * account for empty slots.
  */
-static
 int
 sfs_dir_nentries(struct sfs_vnode *sv)
 {
@@ -652,6 +863,11 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 	int nentries = sfs_dir_nentries(sv);
 	int i, result;
 
+	/* An index finds the name directly, but doesn't do empty slots */
+	if (sv->sv_i.sfi_dirindex != 0 && emptyslot == NULL) {
+		return sfs_dirindex_lookup(sv, name, ino, slot);
+	}
+
 	/* For each slot... */
 	for (i=0; i<nentries; i++) {
 
@@ -688,6 +904,52 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 	return found ? 0 : ENOENT;
 }
 
+/*
+ * Look up NAME in a directory, through the name cache (dcache.h).
+ * Like sfs_dir_findname, but only for callers that need nothing but
+ * the inode number.
+ */
+static
+int
+sfs_dir_lookup(struct sfs_vnode *sv, const char *name, uint32_t *ino)
+{
+	ino_t cached;
+	int result;
+
+	switch (dcache_lookup(&sv->sv_v, name, &cached)) {
+	    case DCACHE_HIT:
+		*ino = cached;
+		return 0;
+	    case DCACHE_NEGATIVE:
+		return ENOENT;
+	}
+
+	result = sfs_dir_findname(sv, name, ino, NULL, NULL);
+	if (result == 0) {
+		dcache_enter(&sv->sv_v, name, *ino);
+	}
+	else if (result == ENOENT) {
+		dcache_enterneg(&sv->sv_v, name);
+	}
+	return result;
+}
+
+/*
+ * Directories with at least this many slots get an index (see
+ * sfs_dirindex.c); below that, scanning them is just as quick.
+ */
+#define SFS_DIRHASH_MIN  32
+
+/*
+ * Most buffers building the index of a directory of N slots dirties:
+ * the index block, and a chain block per slot up to one per chain
+ * (and the free list), plus one for each chain block that fills.
+ */
+#define SFS_DIRINDEX_COST(n) \
+	(1 + ((n) < SFS_DIRHASH_NBUCKETS + 1 ? \
+	      (unsigned)(n) : SFS_DIRHASH_NBUCKETS + 1) + \
+	 (unsigned)(n) / SFS_DIRHASH_PERBLOCK)
+
 /*
  * Create a link in a directory to the specified inode by number, with
  * the specified name, and optionally hand back the slot.
@@ -696,12 +958,39 @@ static
 int
 sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 {
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 	int emptyslot = -1;
+	int nentries;
 	int result;
 	struct sfs_dir sd;
 
+	if (strlen(name)+1 > sizeof(sd.sfd_name)) {
+		return ENAMETOOLONG;
+	}
+
+	/*
+	 * Index a directory once it gets big. If that can't be done
+	 * right now, it's still usable without. Building the index
+	 * dirties a chain block per entry, up to one per chain, which
+	 * is more than an operation is allowed (see sfs_buf.c), so it
+	 * waits for a link made while the buffer cache has that much
+	 * to spare.
+	 */
+	if (sv->sv_i.sfi_dirindex == 0) {
+		nentries = sfs_dir_nentries(sv);
+		if (nentries >= SFS_DIRHASH_MIN &&
+		    sfs_broom(sfs, SFS_DIRINDEX_COST(nentries))) {
+			(void)sfs_dirindex_build(sv);
+		}
+	}
+
 	/* Look up the name. We want to make sure it *doesn't* exist. */
-	result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
+	if (sv->sv_i.sfi_dirindex != 0) {
+		result = sfs_dirindex_lookup(sv, name, NULL, NULL);
+	}
+	else {
+		result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
+	}
 	if (result!=0 && result!=ENOENT) {
 		return result;
 	}
@@ -709,8 +998,11 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 		return EEXIST;
 	}
 
-	if (strlen(name)+1 > sizeof(sd.sfd_name)) {
-		return ENAMETOOLONG;
+	if (sv->sv_i.sfi_dirindex != 0) {
+		result = sfs_dirindex_getslot(sv, &emptyslot);
+		if (result) {
+			return result;
+		}
 	}
 
 	/* If we didn't get an empty slot, add the entry at the end. */
@@ -723,94 +1015,275 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	sd.sfd_ino = ino;
 	strcpy(sd.sfd_name, name);
 
+	/* Write the entry. */
+	result = sfs_writedir(sv, &sd, emptyslot);
+	if (result) {
+		if (sv->sv_i.sfi_dirindex != 0 &&
+		    emptyslot < sfs_dir_nentries(sv) &&
+		    sfs_dirindex_putslot(sv, emptyslot)) {
+			sfs_dirindex_destroy(sv);
+		}
+		return result;
+	}
+
+	/* Index it; if that fails, do without the index. */
+	if (sv->sv_i.sfi_dirindex != 0 &&
+	    sfs_dirindex_add(sv, name, emptyslot)) {
+		sfs_dirindex_destroy(sv);
+	}
+
 	/* Hand back the slot, if so requested. */
 	if (slot) {
 		*slot = emptyslot;
 	}
-
-	/* Write the entry. */
-	return sfs_writedir(sv, &sd, emptyslot);
-	
+
+	return 0;
+}
+
+/*
+ * Unlink a name in a directory, by slot number.
+ */
+static
+int
+sfs_dir_unlink(struct sfs_vnode *sv, int slot)
+{
+	struct sfs_dir sd, old;
+	int result;
+
+	/* The index needs to know the name that was there */
+	if (sv->sv_i.sfi_dirindex != 0) {
+		result = sfs_readdir(sv, &old, slot);
+		if (result) {
+			return result;
+		}
+		old.sfd_name[sizeof(old.sfd_name)-1] = 0;
+	}
+
+	/* Initialize a suitable directory entry... */ 
+	bzero(&sd, sizeof(sd));
+	sd.sfd_ino = SFS_NOINO;
+
+	/* ... and write it */
+	result = sfs_writedir(sv, &sd, slot);
+	if (result) {
+		return result;
+	}
+
+	if (sv->sv_i.sfi_dirindex != 0 &&
+	    sfs_dirindex_remove(sv, old.sfd_name, slot)) {
+		sfs_dirindex_destroy(sv);
+	}
+	return 0;
+}
+
+/*
+ * Look for a name in a directory and hand back a vnode for the
+ * file, if there is one.
+ */
+static
+int
+sfs_lookonce(struct sfs_vnode *sv, const char *name, 
+		struct sfs_vnode **ret,
+		int *slot)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t ino;
+	int result;
+
+	if (slot == NULL) {
+		result = sfs_dir_lookup(sv, name, &ino);
+	}
+	else {
+		result = sfs_dir_findname(sv, name, &ino, slot, NULL);
+	}
+	if (result) {
+		return result;
+	}
+
+	result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, ret);
+	if (result) {
+		return result;
+	}
+
+	if ((*ret)->sv_i.sfi_linkcount == 0) {
+		panic("sfs: Link count of file %u found in dir %u is 0\n",
+		      (*ret)->sv_ino, sv->sv_ino);
+	}
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Object creation
+
+/*
+ * Look in inode block BLOCK for a free inode. Hands back SFS_NOINO
+ * if there isn't one.
+ */
+static
+int
+sfs_ifindfree(struct sfs_fs *sfs, uint32_t block, uint32_t *ino)
+{
+	struct sfs_buf *b;
+	struct sfs_inode *inodes;
+	uint32_t i;
+	int result;
+
+	result = sfs_bread(sfs, block, &b);
+	if (result) {
+		return result;
+	}
+	inodes = b->b_data;
+	*ino = SFS_NOINO;
+	for (i=0; i<sfs->sfs_inoperblock; i++) {
+		if (inodes[i].sfi_type == SFS_TYPE_INVAL) {
+			*ino = SFS_MKINO(block, i, sfs->sfs_inoperblock);
+			break;
+		}
+	}
+	sfs_brelse(sfs, b);
+	return 0;
 }
 
 /*
- * Unlink a name in a directory, by slot number.
+ * Pick an inode for a new object in directory DIR.
+ *
+ * On a packed volume, the inode goes in the same block as the
+ * directory's if there's room, or else in the last inode block used,
+ * so the inodes of a directory's files end up together and stat-ing
+ * all of them reads a few blocks instead of one block per file.
+ * Otherwise a new inode block is allocated where new objects go.
+ *
+ * The inode is still free on disk until the caller fills it in and
+ * syncs it, so nothing else may allocate in the meantime.
  */
 static
 int
-sfs_dir_unlink(struct sfs_vnode *sv, int slot)
+sfs_ialloc(struct sfs_vnode *dir, uint32_t *ino)
 {
-	struct sfs_dir sd;
+	struct sfs_fs *sfs = dir->sv_v.vn_fs->fs_data;
+	uint32_t ipb = sfs->sfs_inoperblock;
+	uint32_t block;
+	int result;
 
-	/* Initialize a suitable directory entry... */ 
-	bzero(&sd, sizeof(sd));
-	sd.sfd_ino = SFS_NOINO;
+	if (ipb > 1) {
+		block = SFS_INOBLOCK(dir->sv_ino, ipb);
+		result = sfs_ifindfree(sfs, block, ino);
+		if (result || *ino != SFS_NOINO) {
+			return result;
+		}
 
-	/* ... and write it */
-	return sfs_writedir(sv, &sd, slot);
+		block = sfs->sfs_inohint;
+		if (block != 0) {
+			result = sfs_ifindfree(sfs, block, ino);
+			if (result || *ino != SFS_NOINO) {
+				return result;
+			}
+		}
+	}
+
+	/* The new block comes back zeroed, so every inode in it is free */
+	result = sfs_balloc(sfs, sfs->sfs_allochint, &block);
+	if (result) {
+		return result;
+	}
+	if (ipb > 1) {
+		sfs->sfs_inohint = block;
+	}
+	*ino = SFS_MKINO(block, 0, ipb);
+	return 0;
 }
 
 /*
- * Look for a name in a directory and hand back a vnode for the
- * file, if there is one.
+ * Free the inode of SV, which has no links and no contents left, by
+ * writing it back zeroed. Its block is freed too if no other inode in
+ * it is in use.
  */
 static
 int
-sfs_lookonce(struct sfs_vnode *sv, const char *name, 
-		struct sfs_vnode **ret,
-		int *slot)
+sfs_ifree(struct sfs_vnode *sv)
 {
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-	uint32_t ino;
+	uint32_t ipb = sfs->sfs_inoperblock;
+	uint32_t block = SFS_INOBLOCK(sv->sv_ino, ipb);
+	struct sfs_buf *b;
+	struct sfs_inode *inodes;
+	uint32_t i;
 	int result;
 
-	result = sfs_dir_findname(sv, name, &ino, slot, NULL);
+	bzero(&sv->sv_i, sizeof(sv->sv_i));
+	sv->sv_dirty = true;
+	result = sfs_sync_inode(sv);
 	if (result) {
 		return result;
 	}
 
-	result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, ret);
+	if (block == SFS_ROOT_LOCATION) {
+		/* Holds the root directory, which is never freed */
+		return 0;
+	}
+
+	result = sfs_bread(sfs, block, &b);
 	if (result) {
 		return result;
 	}
-
-	if ((*ret)->sv_i.sfi_linkcount == 0) {
-		panic("sfs: Link count of file %u found in dir %u is 0\n",
-		      (*ret)->sv_ino, sv->sv_ino);
+	inodes = b->b_data;
+	for (i=0; i<ipb; i++) {
+		if (inodes[i].sfi_type != SFS_TYPE_INVAL) {
+			break;
+		}
 	}
+	sfs_brelse(sfs, b);
 
+	if (i == ipb) {
+		if (sfs->sfs_inohint == block) {
+			sfs->sfs_inohint = 0;
+		}
+		sfs_bfree(sfs, block);
+	}
 	return 0;
 }
 
-////////////////////////////////////////////////////////////
-//
-// Object creation
-
 /*
- * Create a new filesystem object and hand back its vnode.
+ * Create a new filesystem object in directory DIR and hand back its
+ * vnode.
  */
 static
 int
-sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
+sfs_makeobj(struct sfs_vnode *dir, int type, struct sfs_vnode **ret)
 {
+	struct sfs_fs *sfs = dir->sv_v.vn_fs->fs_data;
 	uint32_t ino;
 	int result;
 
-	/*
-	 * First, get an inode. (Each inode is a block, and the inode 
-	 * number is the block number, so just get a block.)
-	 */
+	/* First, get an inode. */
+	result = sfs_ialloc(dir, &ino);
+	if (result) {
+		return result;
+	}
 
-	result = sfs_balloc(sfs, &ino);
+	/* Now load a vnode for it. */
+	result = sfs_loadvnode(sfs, ino, type, ret);
 	if (result) {
 		return result;
 	}
 
+	/* Files start out empty, with their contents in the inode */
+	if (type == SFS_TYPE_FILE && SFS_SB_CANINLINE(&sfs->sfs_super)) {
+		(*ret)->sv_i.sfi_flags = SFS_IF_INLINE;
+	}
+
 	/*
-	 * Now load a vnode for it.
+	 * Write the new inode into its block right away, so the next
+	 * sfs_ialloc sees it's taken.
 	 */
-
-	return sfs_loadvnode(sfs, ino, type, ret);
+	result = sfs_sync_inode(*ret);
+	if (result) {
+		VOP_DECREF(&(*ret)->sv_v);
+		return result;
+	}
+	return 0;
 }
 
 ////////////////////////////////////////////////////////////
@@ -875,8 +1348,22 @@ static
 int
 sfs_close(struct vnode *v)
 {
-	/* Sync it. */
-	return VOP_FSYNC(v);
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	int result;
+
+	/*
+	 * Hand the inode to the buffer cache; the syncer writes it
+	 * back. Forcing it to disk is what fsync is for.
+	 */
+	vfs_biglock_acquire();
+	result = sfs_jcheck(sfs);
+	if (result == 0) {
+		result = sfs_sync_inode(sv);
+	}
+	vfs_biglock_release();
+
+	return result;
 }
 
 /*
@@ -890,7 +1377,6 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
 	vfs_biglock_acquire();
@@ -910,43 +1396,37 @@ sfs_reclaim(struct vnode *v)
 		return EBUSY;
 	}
 
-	/* If there are no on-disk references to the file either, erase it. */
-	if (sv->sv_i.sfi_linkcount==0) {
-		result = VOP_TRUNCATE(&sv->sv_v, 0);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
+	/*
+	 * If the file is still there on disk, keep the vnode in the
+	 * inode cache in case it's wanted again soon.
+	 */
+	if (sv->sv_i.sfi_linkcount > 0) {
+		result = sfs_irelease(sfs, sv);
+		vfs_biglock_release();
+		return result;
 	}
 
-	/* Sync the inode to disk */
-	result = sfs_sync_inode(sv);
+	/* There are no on-disk references to the file either; erase it. */
+	sfs_dirindex_destroy(sv);
+	result = sfs_dotruncate(&sv->sv_v, 0);
 	if (result) {
 		vfs_biglock_release();
 		return result;
 	}
 
-	/* If there are no on-disk references, discard the inode */
-	if (sv->sv_i.sfi_linkcount==0) {
-		sfs_bfree(sfs, sv->sv_ino);
+	if (sv->sv_i.sfi_type == SFS_TYPE_DIR) {
+		dcache_purgedir(&sv->sv_v);
 	}
 
-	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: reclaim vnode %u not in vnode pool\n",
-		      sv->sv_ino);
+	/* Discard the inode */
+	result = sfs_ifree(sv);
+	if (result) {
+		vfs_biglock_release();
+		return result;
 	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+
+	/* Remove the vnode structure from the inode cache. */
+	sfs_iremove(sfs, sv);
 
 	VOP_CLEANUP(&sv->sv_v);
 
@@ -967,31 +1447,58 @@ int
 sfs_read(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	off_t startpos;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
 	vfs_biglock_acquire();
+	startpos = uio->uio_offset;
 	result = sfs_io(sv, uio);
+	if (result == 0) {
+		sfs_ra_note(sv, startpos, uio->uio_offset);
+	}
 	vfs_biglock_release();
 
 	return result;
 }
 
 /*
- * Called for write(). sfs_io() does the work.
+ * Most blocks written by one pass of sfs_write. Even with the
+ * smallest blocks, 64 of them span at most two single, two double
+ * and one triple indirect block.
+ */
+#define SFS_WCHUNK	64
+
+/*
+ * Called for write(). sfs_io() does the work, SFS_WCHUNK blocks at
+ * a time, each piece being an operation of its own as far as the
+ * journal is concerned, so a long write can't fill the buffer cache
+ * with indirect blocks before there's a chance to commit.
  */
 static
 int
 sfs_write(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	size_t chunk = SFS_WCHUNK * sfs->sfs_blocksize;
+	size_t extra;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
 	vfs_biglock_acquire();
-	result = sfs_io(sv, uio);
+	do {
+		result = sfs_jcheck(sfs);
+		if (result) {
+			break;
+		}
+		extra = uio->uio_resid > chunk ? uio->uio_resid - chunk : 0;
+		uio->uio_resid -= extra;
+		result = sfs_io(sv, uio);
+		uio->uio_resid += extra;
+	} while (result == 0 && extra > 0);
 	vfs_biglock_release();
 
 	return result;
@@ -1094,16 +1601,24 @@ sfs_tryseek(struct vnode *v, off_t pos)
 /*
  * Called for fsync(), and also on filesystem unmount, global sync(),
  * and some other cases.
+ *
+ * Buffers aren't tracked per file, so this pushes out everything
+ * dirty on the volume; it's cheap when little is. With a journal,
+ * concurrent callers share one commit (sfs_jsync).
  */
 static
 int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
 	vfs_biglock_acquire();
 	result = sfs_sync_inode(sv);
+	if (result == 0) {
+		result = sfs_jsync(sfs);
+	}
 	vfs_biglock_release();
 
 	return result;
@@ -1121,102 +1636,241 @@ sfs_mmap(struct vnode *v   /* add stuff as needed */)
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Blocks freed by a truncate are gathered into runs of consecutive
+ * block numbers, so each run goes back to the free map (and out of
+ * the buffer cache) in one go. A file written sequentially is laid
+ * out mostly in order, with each indirect block just before the
+ * first block it maps, so runs are extended in either direction.
+ */
+struct sfs_freerun {
+	uint32_t fr_start;		/* first block */
+	uint32_t fr_count;		/* number of blocks; 0 if none */
+};
+
+static
+void
+sfs_freerun_flush(struct sfs_fs *sfs, struct sfs_freerun *fr)
+{
+	if (fr->fr_count > 0) {
+		sfs_bfreerun(sfs, fr->fr_start, fr->fr_count);
+		fr->fr_count = 0;
+	}
+}
+
+static
+void
+sfs_freerun_add(struct sfs_fs *sfs, struct sfs_freerun *fr, uint32_t block)
+{
+	if (fr->fr_count > 0) {
+		if (block == fr->fr_start + fr->fr_count) {
+			fr->fr_count++;
+			return;
+		}
+		if (block + 1 == fr->fr_start) {
+			fr->fr_start--;
+			fr->fr_count++;
+			return;
+		}
+		sfs_freerun_flush(sfs, fr);
+	}
+	fr->fr_start = block;
+	fr->fr_count = 1;
+}
+
+/*
+ * Free everything at or past file block BLOCKLEN in the tree of
+ * indirect blocks rooted at *IDBLOCKP, which is LEVELS deep and maps
+ * file blocks from BASEBLOCK on. Indirect blocks left empty are
+ * freed as well, and *IDBLOCKP cleared if the top one goes. The
+ * blocks are added to FR.
+ *
+ * An indirect block that lies entirely past the new EOF is freed
+ * without being written back, however much of it was cleared.
  */
 static
 int
-sfs_truncate(struct vnode *v, off_t len)
+sfs_truncate_indirect(struct sfs_vnode *sv, uint32_t *idblockp,
+		      unsigned levels, uint32_t baseblock, uint32_t blocklen,
+		      struct sfs_freerun *fr)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *idb;
+	uint32_t *idbuf;
+	uint32_t span, child, j;
+	uint64_t entbase;
+	unsigned i;
+	bool all, hasnonzero, iddirty;
+	int result;
+
+	if (*idblockp == 0) {
+		return 0;
+	}
+
+	/* Blocks covered by each entry */
+	span = 1;
+	for (i=1; i<levels; i++) {
+		span *= sfs->sfs_dbperidb;
+	}
+
+	if (blocklen >= baseblock + (uint64_t)span * sfs->sfs_dbperidb) {
+		/* All of it is before the new EOF */
+		return 0;
+	}
+	all = (baseblock >= blocklen);
+
+	/* Read the indirect block */
+	result = sfs_bread(sfs, *idblockp, &idb);
+	if (result) {
+		return result;
+	}
+	idbuf = idb->b_data;
+
+	hasnonzero = false;
+	iddirty = false;
+	for (j=0; j<sfs->sfs_dbperidb; j++) {
+		entbase = baseblock + (uint64_t)j * span;
+
+		/* Discard anything that reaches past the new EOF */
+		if (idbuf[j] != 0 && entbase + span > blocklen) {
+			child = idbuf[j];
+			if (levels == 1) {
+				sfs_freerun_add(sfs, fr, child);
+				child = 0;
+			}
+			else {
+				result = sfs_truncate_indirect(sv, &child,
+							       levels - 1,
+							       entbase,
+							       blocklen, fr);
+			}
+			if (child != idbuf[j]) {
+				idbuf[j] = child;
+				iddirty = true;
+			}
+			if (result) {
+				if (iddirty) {
+					sfs_bmetadirty(sfs, idb);
+				}
+				sfs_brelse(sfs, idb);
+				return result;
+			}
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (idbuf[j] != 0) {
+			hasnonzero = true;
+		}
+	}
+
+	if (all || !hasnonzero) {
+		/* The whole indirect block is empty now; free it */
+		sfs_brelse(sfs, idb);
+		sfs_freerun_add(sfs, fr, *idblockp);
+		*idblockp = 0;
+		sv->sv_dirty = true;
+	}
+	else if (iddirty) {
+		/* The indirect block is dirty */
+		sfs_bmetadirty(sfs, idb);
+		sfs_brelse(sfs, idb);
+	}
+	else {
+		sfs_brelse(sfs, idb);
+	}
+	return 0;
+}
 
+/*
+ * Truncate, for sfs_truncate and sfs_reclaim.
+ */
+static
+int
+sfs_dotruncate(struct vnode *v, off_t len)
+{
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 
 	/* Length in blocks (divide rounding up) */
-	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
+	uint32_t blocklen = DIVROUNDUP(len, sfs->sfs_blocksize);
 
-	uint32_t i, j, block;
-	uint32_t idblock, baseblock, highblock;
+	struct sfs_freerun fr;
+	uint32_t i, block, baseblock;
 	int result;
-	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	if (len > sfs->sfs_maxfilesize) {
+		return EFBIG;
+	}
 
 	vfs_biglock_acquire();
 
+	/*
+	 * An inline file stays inline if the new length fits, with the
+	 * bytes past it cleared; otherwise it moves out to a block and
+	 * carries on like any other.
+	 */
+	if (sv->sv_i.sfi_flags & SFS_IF_INLINE) {
+		if (len <= SFS_INLINESIZE) {
+			if (len < sv->sv_i.sfi_size) {
+				bzero(SFS_INLINEDATA(&sv->sv_i) + len,
+				      SFS_INLINESIZE - len);
+			}
+			sv->sv_i.sfi_size = len;
+			sv->sv_dirty = true;
+			vfs_biglock_release();
+			return 0;
+		}
+		result = sfs_uninline(sv);
+		if (result) {
+			vfs_biglock_release();
+			return result;
+		}
+	}
+
 	/*
 	 * Go through the direct blocks. Discard any that are
 	 * past the limit we're truncating to.
 	 */
+	fr.fr_count = 0;
 	for (i=0; i<SFS_NDIRECT; i++) {
 		block = sv->sv_i.sfi_direct[i];
 		if (i >= blocklen && block != 0) {
-			sfs_bfree(sfs, block);
+			sfs_freerun_add(sfs, &fr, block);
 			sv->sv_i.sfi_direct[i] = 0;
 			sv->sv_dirty = true;
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
+	/*
+	 * Then the trees under the indirect blocks, each starting
+	 * where the one before leaves off.
+	 */
 	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-		
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
-		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_wblock(sfs, idbuf, idblock);
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
+	result = sfs_truncate_indirect(sv, &sv->sv_i.sfi_indirect, 1,
+				       baseblock, blocklen, &fr);
+	if (result == 0) {
+		baseblock += sfs->sfs_dbperidb;
+		result = sfs_truncate_indirect(sv, &sv->sv_i.sfi_dindirect,
+					       2, baseblock, blocklen, &fr);
+	}
+	if (result == 0) {
+		baseblock += sfs->sfs_dbperidb * sfs->sfs_dbperidb;
+		result = sfs_truncate_indirect(sv, &sv->sv_i.sfi_tindirect,
+					       3, baseblock, blocklen, &fr);
+	}
+	sfs_freerun_flush(sfs, &fr);
+	if (result) {
+		vfs_biglock_release();
+		return result;
 	}
 
 	/* Set the file size */
 	sv->sv_i.sfi_size = len;
 
+	/* An emptied file can go back to keeping its contents inline */
+	if (len == 0 && sv->sv_i.sfi_type == SFS_TYPE_FILE &&
+	    SFS_SB_CANINLINE(&sfs->sfs_super)) {
+		sv->sv_i.sfi_flags |= SFS_IF_INLINE;
+	}
+
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
@@ -1224,6 +1878,25 @@ sfs_truncate(struct vnode *v, off_t len)
 	return 0;
 }
 
+/*
+ * Called for ftruncate().
+ */
+static
+int
+sfs_truncate(struct vnode *v, off_t len)
+{
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	int result;
+
+	vfs_biglock_acquire();
+	result = sfs_jcheck(sfs);
+	if (result == 0) {
+		result = sfs_dotruncate(v, len);
+	}
+	vfs_biglock_release();
+	return result;
+}
+
 /*
  * Get the full pathname for a file. This only needs to work on directories.
  * Since we don't support subdirectories, assume it's the root directory
@@ -1235,7 +1908,8 @@ int
 sfs_namefile(struct vnode *vv, struct uio *uio)
 {
 	struct sfs_vnode *sv = vv->vn_data;
-	KASSERT(sv->sv_ino == SFS_ROOT_LOCATION);
+	struct sfs_fs *sfs = vv->vn_fs->fs_data;
+	KASSERT(sv->sv_ino == SFS_ROOT_INO(sfs->sfs_inoperblock));
 
 	/* send back the empty string - just return */
 
@@ -1261,8 +1935,14 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 
 	vfs_biglock_acquire();
 
+	result = sfs_jcheck(sfs);
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+
 	/* Look up the name */
-	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
+	result = sfs_dir_lookup(sv, name, &ino);
 	if (result!=0 && result!=ENOENT) {
 		vfs_biglock_release();
 		return result;
@@ -1287,7 +1967,7 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	}
 
 	/* Didn't exist - create it */
-	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
+	result = sfs_makeobj(sv, SFS_TYPE_FILE, &newguy);
 	if (result) {
 		vfs_biglock_release();
 		return result;
@@ -1304,6 +1984,8 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		return result;
 	}
 
+	dcache_enter(&sv->sv_v, name, newguy->sv_ino);
+
 	/* Update the linkcount of the new file */
 	newguy->sv_i.sfi_linkcount++;
 
@@ -1327,18 +2009,26 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 {
 	struct sfs_vnode *sv = dir->vn_data;
 	struct sfs_vnode *f = file->vn_data;
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	int result;
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
 	vfs_biglock_acquire();
 
+	result = sfs_jcheck(sfs);
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+
 	/* Just create a link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
 		vfs_biglock_release();
 		return result;
 	}
+	dcache_enter(&sv->sv_v, name, f->sv_ino);
 
 	/* and update the link count, marking the inode dirty */
 	f->sv_i.sfi_linkcount++;
@@ -1356,12 +2046,19 @@ int
 sfs_remove(struct vnode *dir, const char *name)
 {
 	struct sfs_vnode *sv = dir->vn_data;
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	struct sfs_vnode *victim;
 	int slot;
 	int result;
 
 	vfs_biglock_acquire();
 
+	result = sfs_jcheck(sfs);
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
@@ -1370,6 +2067,7 @@ sfs_remove(struct vnode *dir, const char *name)
 	}
 
 	/* Erase its directory entry. */
+	dcache_purge(&sv->sv_v, name);
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
@@ -1397,6 +2095,7 @@ sfs_rename(struct vnode *d1, const char *n1,
 	   struct vnode *d2, const char *n2)
 {
 	struct sfs_vnode *sv = d1->vn_data;
+	struct sfs_fs *sfs = d1->vn_fs->fs_data;
 	struct sfs_vnode *g1;
 	int slot1, slot2;
 	int result, result2;
@@ -1404,7 +2103,17 @@ sfs_rename(struct vnode *d1, const char *n1,
 	vfs_biglock_acquire();
 
 	KASSERT(d1==d2);
-	KASSERT(sv->sv_ino == SFS_ROOT_LOCATION);
+	KASSERT(sv->sv_ino == SFS_ROOT_INO(sfs->sfs_inoperblock));
+
+	result = sfs_jcheck(sfs);
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+
+	/* Whatever happens, neither name is to be trusted in the cache */
+	dcache_purge(&sv->sv_v, n1);
+	dcache_purge(&sv->sv_v, n2);
 
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
@@ -1651,36 +2360,26 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops = NULL;
-	unsigned i, num;
+	struct sfs_buf *b;
+	uint32_t block;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
-
+	/* Look in the inode cache */
+	sv = sfs_ifind(sfs, ino);
+	if (sv != NULL) {
 		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
+		if (!sfs_bused(sfs, SFS_INOBLOCK(ino, sfs->sfs_inoperblock))) {
 			panic("sfs: Found inode %u in unallocated block\n",
 			      sv->sv_ino);
 		}
 
-		if (sv->sv_ino==ino) {
-			/* Found */
+		/* May only be set when creating new objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
-			/* May only be set when creating new objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
-
-			VOP_INCREF(&sv->sv_v);
-			*ret = sv;
-			return 0;
-		}
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
@@ -1691,25 +2390,28 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	}
 
 	/* Must be in an allocated block */
-	if (!sfs_bused(sfs, ino)) {
+	block = SFS_INOBLOCK(ino, sfs->sfs_inoperblock);
+	if (block < SFS_ROOT_LOCATION || !sfs_bused(sfs, block)) {
 		panic("sfs: Tried to load inode %u from unallocated block\n",
 		      ino);
 	}
 
 	/* Read the block the inode is in */
-	result = sfs_rblock(sfs, &sv->sv_i, ino);
+	result = sfs_bread(sfs, block, &b);
 	if (result) {
 		kfree(sv);
 		return result;
 	}
+	memcpy(&sv->sv_i, sfs_inoptr(sfs, b, ino), sizeof(sv->sv_i));
+	sfs_brelse(sfs, b);
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
 
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
-	 * block on disk will have been zeroed out and thus the type
-	 * recorded there will be SFS_TYPE_INVAL.
+	 * inode on disk is free and thus the type recorded there will
+	 * be SFS_TYPE_INVAL.
 	 */
 	if (forcetype != SFS_TYPE_INVAL) {
 		KASSERT(sv->sv_i.sfi_type == SFS_TYPE_INVAL);
@@ -1742,14 +2444,12 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
+	sv->sv_ranext = 0;
+	sv->sv_rawindow = 0;
+	sv->sv_rahigh = 0;
 
-	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
-	if (result) {
-		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
-		return result;
-	}
+	/* Add it to the inode cache */
+	sfs_iadd(sfs, sv);
 
 	/* Hand it back */
 	*ret = sv;
@@ -1758,7 +2458,8 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 /*
  * Get vnode for the root of the filesystem.
- * The root vnode is always found in block 1 (SFS_ROOT_LOCATION).
+ * The root vnode is always the first inode in block 1
+ * (SFS_ROOT_LOCATION).
  */
 struct vnode *
 sfs_getroot(struct fs *fs)
@@ -1769,7 +2470,8 @@ sfs_getroot(struct fs *fs)
 
 	vfs_biglock_acquire();
 
-	result = sfs_loadvnode(sfs, SFS_ROOT_LOCATION, SFS_TYPE_INVAL, &sv);
+	result = sfs_loadvnode(sfs, SFS_ROOT_INO(sfs->sfs_inoperblock),
+			       SFS_TYPE_INVAL, &sv);
 	if (result) {
 		panic("sfs: getroot: Cannot load root vnode\n");
 	}
@@ -0,0 +1,50 @@
+#ifndef _ARGBUF_H_
+#define _ARGBUF_H_
+
+/*
+ * Staging area for program arguments passed through execv() and
+ * runprogram().
+ *
+ * The argument strings are copied exactly once, from the caller
+ * (the old user address space, or the kernel menu) into a single
+ * ARG_MAX-sized kernel buffer. Each string is stored NUL-terminated
+ * and padded to a pointer-aligned boundary, so the buffer already
+ * has the layout the strings will have on the new user stack, and
+ * argbuf_copyout() can move the whole thing there in one copyout
+ * plus one more for the argv[] pointer array.
+ *
+ * There is only one staging buffer and it is handed out to one
+ * exec at a time: argbuf_acquire() blocks until it is free and
+ * argbuf_release() gives it back. ARG_MAX covers both the strings
+ * and the argv[] pointers, as in POSIX; going over it yields E2BIG.
+ */
+
+struct argbuf {
+	char *ab_data;		/* ARG_MAX bytes of staging space */
+	size_t ab_len;		/* bytes of packed strings in ab_data */
+	int ab_argc;		/* number of strings in ab_data */
+};
+
+/* Call once during system startup to allocate the staging buffer. */
+void argbuf_bootstrap(void);
+
+/* Get exclusive use of the (empty) staging buffer; may block. */
+struct argbuf *argbuf_acquire(void);
+
+/* Give the staging buffer back. */
+void argbuf_release(struct argbuf *ab);
+
+/* Stage a NULL-terminated argv[] from the current user address space. */
+int argbuf_copyin(struct argbuf *ab, userptr_t uargv);
+
+/* Stage NARGS kernel strings, e.g. from the kernel menu. */
+int argbuf_kcopyin(struct argbuf *ab, int nargs, char **args);
+
+/*
+ * Lay the staged arguments out at the top of the user stack in the
+ * current address space. STACKPTR is updated to point at the argv[]
+ * array, which is also handed back in UARGV.
+ */
+int argbuf_copyout(struct argbuf *ab, vaddr_t *stackptr, userptr_t *uargv);
+
+#endif /* _ARGBUF_H_ */
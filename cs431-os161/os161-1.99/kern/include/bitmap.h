@@ -38,8 +38,14 @@
  *                      Returns NULL on error.
  *     bitmap_getdata - return pointer to raw bit data (for I/O).
  *     bitmap_alloc   - locate a cleared bit, set it, and return its index.
+ *     bitmap_alloc_near - same, but take the first cleared bit at or
+ *                      after a given index, wrapping around at the end.
  *     bitmap_mark    - set a clear bit by its index.
  *     bitmap_unmark  - clear a set bit by its index.
+ *     bitmap_markrange - set a run of clear bits.
+ *     bitmap_unmarkrange - clear a run of set bits.
+ *     bitmap_subtract - clear in one bitmap the bits set in another
+ *                      (of the same size), and clear those too.
  *     bitmap_isset   - return whether a particular bit is set or not.
  *     bitmap_destroy - destroy bitmap.
  */
@@ -50,8 +56,15 @@ struct bitmap;  /* Opaque. */
 struct bitmap *bitmap_create(unsigned nbits);
 void          *bitmap_getdata(struct bitmap *);
 int            bitmap_alloc(struct bitmap *, unsigned *index);
+int            bitmap_alloc_near(struct bitmap *, unsigned hint,
+                                 unsigned *index);
 void           bitmap_mark(struct bitmap *, unsigned index);
 void           bitmap_unmark(struct bitmap *, unsigned index);
+void           bitmap_markrange(struct bitmap *, unsigned index,
+                                unsigned count);
+void           bitmap_unmarkrange(struct bitmap *, unsigned index,
+                                  unsigned count);
+void           bitmap_subtract(struct bitmap *, struct bitmap *sub);
 int            bitmap_isset(struct bitmap *, unsigned index);
 void           bitmap_destroy(struct bitmap *);
 
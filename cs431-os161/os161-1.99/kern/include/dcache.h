@@ -0,0 +1,44 @@
+#ifndef _DCACHE_H_
+#define _DCACHE_H_
+
+/*
+ * Directory name lookup cache.
+ *
+ * Maps (directory vnode, name) to the inode number the name refers
+ * to in that directory, or records that the name isn't there. It's
+ * up to the filesystem to consult it from its lookup code, fill it
+ * in after looking in the directory itself, and purge names when it
+ * changes the directory. Inode numbers rather than vnodes are cached
+ * so that the cache holds no vnode references; the filesystem turns
+ * the number back into a vnode however it normally would.
+ *
+ * Entries are keyed by vnode pointer, so a filesystem must call
+ * dcache_purgedir before it frees a directory vnode.
+ *
+ * Names longer than DCACHE_NAMELEN-1 aren't cached. Callers hold
+ * vfs_biglock.
+ *
+ *    dcache_lookup   - returns DCACHE_HIT and sets *ino, DCACHE_NEGATIVE
+ *                      if the name is known not to exist, or DCACHE_MISS.
+ *    dcache_enter    - record that NAME in DIR is inode INO.
+ *    dcache_enterneg - record that NAME isn't in DIR.
+ *    dcache_purge    - forget anything about NAME in DIR.
+ *    dcache_purgedir - forget everything about DIR.
+ */
+
+#define DCACHE_NAMELEN	32
+
+#define DCACHE_MISS	0
+#define DCACHE_HIT	1
+#define DCACHE_NEGATIVE	2
+
+struct vnode;
+
+void dcache_bootstrap(void);
+int dcache_lookup(struct vnode *dir, const char *name, ino_t *ino);
+void dcache_enter(struct vnode *dir, const char *name, ino_t ino);
+void dcache_enterneg(struct vnode *dir, const char *name);
+void dcache_purge(struct vnode *dir, const char *name);
+void dcache_purgedir(struct vnode *dir);
+
+#endif /* _DCACHE_H_ */
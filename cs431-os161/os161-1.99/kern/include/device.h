@@ -37,15 +37,43 @@
 
 struct uio;  /* in <uio.h> */
 
+/*
+ * Asynchronous block transfer, for devices that provide d_submit.
+ *
+ * The caller fills in dr_block, dr_nblocks, dr_buf, dr_write, dr_done
+ * and dr_data, and hands the request to d_submit, which returns at
+ * once. When the transfer is finished (or has failed) the driver sets
+ * dr_result and calls dr_done. dr_done may be called from an interrupt
+ * handler, so it must not sleep; waking up a semaphore is the usual
+ * thing to do. The request and its buffer belong to the driver until
+ * then.
+ */
+struct devreq {
+	struct devreq *dr_next;		/* for the driver's queue */
+	uint32_t dr_block;		/* first block, in d_blocksize units */
+	uint32_t dr_nblocks;		/* number of blocks */
+	void *dr_buf;			/* kernel buffer, dr_nblocks blocks */
+	bool dr_write;			/* true to write, false to read */
+	int dr_result;			/* set by the driver on completion */
+	void (*dr_done)(struct devreq *);	/* completion callback */
+	void *dr_data;			/* for use by dr_done */
+
+	/* For the driver's scheduler (see <disksched.h>). */
+	struct devreq *dr_merged;	/* requests run on after this one */
+	uint32_t dr_deadline;		/* dispatch count to be done by */
+};
+
 /*
  * Filesystem-namespace-accessible device.
  * d_io is for both reads and writes; the uio indicates the direction.
+ * d_submit is NULL for devices that can't do asynchronous I/O.
  */
 struct device {
 	int (*d_open)(struct device *, int flags_from_open);
 	int (*d_close)(struct device *);
 	int (*d_io)(struct device *, struct uio *);
 	int (*d_ioctl)(struct device *, int op, userptr_t data);
+	int (*d_submit)(struct device *, struct devreq *);
 
 	blkcnt_t d_blocks;
 	blksize_t d_blocksize;
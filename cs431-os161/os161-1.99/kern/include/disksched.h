@@ -0,0 +1,37 @@
+#ifndef _DISKSCHED_H_
+#define _DISKSCHED_H_
+
+/*
+ * Disk request scheduling, for block device drivers that queue
+ * struct devreq (see <device.h>).
+ *
+ * Pending requests are kept sorted by block and handed out in C-LOOK
+ * order: upwards from the last block dispatched, then back to the
+ * lowest pending block and up again. A request that starts where a
+ * pending one of the same direction ends (or ends where it starts)
+ * is merged into it, and the resulting run goes out as one unit
+ * linked through dr_merged, in block order. To bound starvation each
+ * queued run must be dispatched within DISKSCHED_DEADLINE dispatches
+ * of its arrival; once one is overdue, runs go out oldest first
+ * until none is.
+ *
+ * Requests may be reordered, so a caller must not have two
+ * outstanding at once for overlapping blocks.
+ *
+ * None of this locks anything; the driver calls it with its own
+ * queue lock held, from interrupt handlers as well as threads.
+ */
+
+struct devreq;
+
+struct disksched {
+	struct devreq *ds_queue;	/* pending runs, by dr_block */
+	uint32_t ds_pos;		/* block after last dispatched */
+	uint32_t ds_ticket;		/* dispatches so far */
+};
+
+void disksched_init(struct disksched *ds);
+void disksched_add(struct disksched *ds, struct devreq *req);
+struct devreq *disksched_next(struct disksched *ds);
+
+#endif /* _DISKSCHED_H_ */
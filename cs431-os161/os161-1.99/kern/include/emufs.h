@@ -47,11 +47,55 @@ struct emufs_vnode {
 	uint32_t ev_handle;		/* file handle */
 };
 
+/*
+ * Cache sizes: pages of file data, and names recently looked up.
+ */
+#define EMUFS_NPAGES	16
+#define EMUFS_PAGESIZE	4096
+#define EMUFS_NNAMES	8
+
+/*
+ * A cached page of file data. EP_LEN is short only at EOF. While
+ * EP_BUSY is nonzero someone is using the page without holding the
+ * cache lock (filling it, copying out of it, or staging a write in
+ * it) and it can't be reused.
+ */
+struct emufs_page {
+	struct emufs_vnode *ep_ev;	/* file, or NULL if unused */
+	uint32_t ep_pageno;		/* page number within the file */
+	uint32_t ep_len;		/* bytes of valid data */
+	uint32_t ep_stamp;		/* when last used */
+	unsigned ep_busy;		/* number of users */
+	bool ep_filling;		/* being read in; data not valid yet */
+	char *ep_data;
+};
+
+/*
+ * A remembered lookup. Holds a reference to both vnodes, so the file
+ * stays open on the host and its cached pages stay valid.
+ */
+struct emufs_name {
+	struct emufs_vnode *en_dir;	/* directory, or NULL if unused */
+	char *en_name;			/* name looked up in it */
+	struct emufs_vnode *en_ev;	/* what it found */
+	uint32_t en_stamp;		/* when last used */
+};
+
 struct emufs_fs {
 	struct fs ef_fs;		/* abstract filesystem structure */
 	struct emu_softc *ef_emu;	/* device */
 	struct emufs_vnode *ef_root;	/* root vnode */
 	struct vnodearray *ef_vnodes;	/* table of loaded vnodes */
+
+	/* Page cache; protected by ef_cachelock */
+	struct lock *ef_cachelock;
+	struct cv *ef_cachecv;		/* for pages to stop being busy */
+	struct emufs_page ef_pages[EMUFS_NPAGES];
+	uint32_t ef_pageclock;		/* for ep_stamp */
+
+	/* Name cache; protected by vfs_biglock */
+	struct emufs_name ef_names[EMUFS_NNAMES];
+	uint32_t ef_nameclock;		/* for en_stamp */
 };
 
 
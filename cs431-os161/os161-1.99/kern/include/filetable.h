@@ -0,0 +1,40 @@
+#ifndef _FILETABLE_H_
+#define _FILETABLE_H_
+
+/*
+ * Per-process file descriptor table: a fixed array of OPEN_MAX
+ * slots, each either empty or holding one reference to an openfile.
+ *
+ * User processes are single-threaded, so the table itself is only
+ * ever touched by its owner and needs no lock.
+ */
+
+#include <limits.h>
+
+struct openfile;
+
+struct filetable {
+	struct openfile *ft_openfiles[OPEN_MAX];
+};
+
+/* Create an empty table / destroy one, closing anything left open. */
+struct filetable *filetable_create(void);
+void filetable_destroy(struct filetable *ft);
+
+/*
+ * Look up descriptor FD. The openfile handed back is borrowed from
+ * the table, not referenced; it stays valid until FD is closed.
+ * Fails with EBADF.
+ */
+int filetable_get(struct filetable *ft, int fd, struct openfile **ret);
+
+/*
+ * Put FILE in the lowest free slot and hand back its number. The
+ * table takes over the caller's reference. Fails with EMFILE.
+ */
+int filetable_place(struct filetable *ft, struct openfile *file, int *fd);
+
+/* Close descriptor FD, dropping the table's reference. Fails with EBADF. */
+int filetable_close(struct filetable *ft, int fd);
+
+#endif /* _FILETABLE_H_ */
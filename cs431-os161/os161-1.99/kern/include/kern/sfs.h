@@ -37,30 +37,95 @@
  */
 
 #define SFS_MAGIC         0xabadf001    /* magic number identifying us */
-#define SFS_BLOCKSIZE     512           /* size of our blocks */
+#define SFS_BLOCKSIZE     512           /* smallest (and default) block size */
+#define SFS_MAXBLOCKSIZE  8192          /* largest block size */
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
 #define SFS_NDIRECT       15            /* # of direct blocks in inode */
-#define SFS_DBPERIDB      128           /* # direct blks per indirect blk */
 #define SFS_NAMELEN       60            /* max length of filename */
 #define SFS_SB_LOCATION    0            /* block the superblock lives in */
-#define SFS_ROOT_LOCATION  1            /* loc'n of the root dir inode */
+#define SFS_ROOT_LOCATION  1            /* block of the root dir inode */
 #define SFS_MAP_LOCATION   2            /* 1st block of the freemap */
 #define SFS_NOINO          0            /* inode # for free dir entry */
+#define SFS_DIRHASH_NBUCKETS 127        /* hash chains in a dir index */
+#define SFS_DIRHASH_PERBLOCK 63         /* entries per index chain block */
+#define SFS_JMAGIC        0x6a726e6c    /* journal header magic number */
+#define SFS_JMAXBLOCKS    124           /* most blocks in a transaction */
+#define SFS_JBLOCKS       (1+SFS_JMAXBLOCKS) /* size of the journal */
+#define SFS_JMAXMAPBLOCKS 24            /* most freemap blocks, if journaled */
+#define SFS_JMAXBLOCKSIZE 4096          /* largest block size, if journaled */
+#define SFS_INODESIZE     128           /* size of a packed inode */
+
+/*
+ * The block size of a volume is chosen by mksfs and recorded in the
+ * superblock; it is a power of 2 from SFS_BLOCKSIZE to
+ * SFS_MAXBLOCKSIZE. The superblock and the other on-disk structures
+ * below, apart from inodes, stay SFS_BLOCKSIZE bytes and sit at the
+ * start of their blocks. The sizes below depend on the block size,
+ * BSIZE.
+ */
+
+/* Block size of a volume, given its superblock */
+#define SFS_SB_BLOCKSIZE(sp) \
+	((sp)->sp_blocksize == 0 ? SFS_BLOCKSIZE : (sp)->sp_blocksize)
+
+/* Number of block numbers in an indirect block */
+#define SFS_DBPERIDB(bsize) ((bsize) / sizeof(uint32_t))
 
 /* Number of bits in a block */
-#define SFS_BLOCKBITS (SFS_BLOCKSIZE * CHAR_BIT)
+#define SFS_BLOCKBITS(bsize) ((bsize) * CHAR_BIT)
 
 /* Utility macro */
 #define SFS_ROUNDUP(a,b)       ((((a)+(b)-1)/(b))*b)
 
 /* Size of bitmap (in bits) */
-#define SFS_BITMAPSIZE(nblocks) SFS_ROUNDUP(nblocks, SFS_BLOCKBITS)
+#define SFS_BITMAPSIZE(nblocks, bsize) \
+	SFS_ROUNDUP(nblocks, SFS_BLOCKBITS(bsize))
 
 /* Size of bitmap (in blocks) */
-#define SFS_BITBLOCKS(nblocks)  (SFS_BITMAPSIZE(nblocks)/SFS_BLOCKBITS)
+#define SFS_BITBLOCKS(nblocks, bsize) \
+	(SFS_BITMAPSIZE(nblocks, bsize) / SFS_BLOCKBITS(bsize))
+
+/*
+ * Inodes. Inode blocks come out of the freemap like any other block.
+ * On a volume with sp_inodesize set, each inode block holds
+ * BSIZE/sp_inodesize inodes (IPB), and inode number INO is index
+ * INO % IPB in block INO / IPB. Older volumes have one inode at the
+ * start of each inode block, so IPB is 1 and the inode number is
+ * just the block number. Either way the root directory is the first
+ * inode in block SFS_ROOT_LOCATION, and inode numbers below IPB
+ * (in the superblock) are never used.
+ */
+
+/* Inodes per inode block, given the superblock */
+#define SFS_SB_INOPERBLOCK(sp) \
+	((sp)->sp_inodesize == 0 ? 1 : \
+	 SFS_SB_BLOCKSIZE(sp) / (sp)->sp_inodesize)
+
+/* Where inode INO is, and inode number of index INDEX in BLOCK */
+#define SFS_INOBLOCK(ino, ipb)          ((ino) / (ipb))
+#define SFS_INOINDEX(ino, ipb)          ((ino) % (ipb))
+#define SFS_MKINO(block, index, ipb)    ((block) * (ipb) + (index))
+
+/* Inode number of the root directory */
+#define SFS_ROOT_INO(ipb)               SFS_MKINO(SFS_ROOT_LOCATION, 0, ipb)
+
+/*
+ * A regular file with SFS_IF_INLINE set in sfi_flags keeps its
+ * contents, up to SFS_INLINESIZE bytes, in the inode itself, in
+ * place of the block numbers from sfi_direct through sfi_tindirect.
+ * Bytes past sfi_size are zero. Only volumes with sp_inodesize set
+ * have inline files; on older ones the flag is never set, so tools
+ * that predate it still read them correctly.
+ */
+#define SFS_SB_CANINLINE(sp)  ((sp)->sp_inodesize != 0)
+#define SFS_INLINESIZE    ((SFS_NDIRECT+3) * sizeof(uint32_t))
+#define SFS_INLINEDATA(sfi)  ((char *)(sfi)->sfi_direct)
+
+/* Flags for sfi_flags */
+#define SFS_IF_INLINE     0x1     /* Contents are in the inode */
 
 /* File types for sfi_type */
-#define SFS_TYPE_INVAL    0       /* Should not appear on disk */
+#define SFS_TYPE_INVAL    0       /* Free inode */
 #define SFS_TYPE_FILE     1
 #define SFS_TYPE_DIR      2
 
@@ -71,11 +136,16 @@ struct sfs_super {
 	uint32_t sp_magic;		/* Magic number, should be SFS_MAGIC */
 	uint32_t sp_nblocks;			/* Number of blocks in fs */
 	char sp_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];
+	uint32_t sp_jstart;			/* First block of journal */
+	uint32_t sp_jblocks;			/* Journal size; 0 if none */
+	uint32_t sp_blocksize;			/* Block size; 0 if 512 */
+	uint32_t sp_inodesize;			/* Inode size; 0 if unpacked */
+	uint32_t reserved[114];
 };
 
 /*
- * On-disk inode
+ * On-disk inode. On an unpacked volume the rest of the inode's block
+ * is zeros.
  */
 struct sfs_inode {
 	uint32_t sfi_size;			/* Size of this file (bytes) */
@@ -83,7 +153,44 @@ struct sfs_inode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
+	uint32_t sfi_dirindex;			/* Directory index, or 0 */
+	uint32_t sfi_flags;			/* SFS_IF_* */
+	uint32_t sfi_waste[SFS_INODESIZE/4-7-SFS_NDIRECT]; /* unused, 0 */
+};
+
+/*
+ * Metadata journal.
+ *
+ * A volume with sp_jblocks nonzero has a journal of SFS_JBLOCKS
+ * blocks at sp_jstart: this header, then room for SFS_JMAXBLOCKS
+ * block images. Changes to metadata (inodes, indirect blocks,
+ * directories and their indexes, and the free block bitmap) are
+ * written first as images to the journal, then the header is
+ * written with jh_count set to say they are complete, and only then
+ * are they written to their real locations (jh_home). Once that's
+ * done, jh_count goes back to 0. So if jh_count is nonzero when the
+ * volume is mounted, the images are copied out again to finish the
+ * job.
+ *
+ * jh_sum covers the images, so a transaction whose images didn't all
+ * make it to disk is recognized and ignored. It is computed over the
+ * images in order, as 32-bit words w, as sum = ((sum << 1) |
+ * (sum >> 31)) + w, starting from 0.
+ *
+ * A transaction may have to include the whole free block bitmap, and
+ * the kernel has to be able to hold it in memory alongside everything
+ * else, so only volumes whose bitmap is at most SFS_JMAXMAPBLOCKS
+ * blocks long, with blocks of at most SFS_JMAXBLOCKSIZE bytes, have
+ * a journal.
+ */
+struct sfs_jheader {
+	uint32_t jh_magic;			/* SFS_JMAGIC */
+	uint32_t jh_seq;			/* Last transaction number */
+	uint32_t jh_count;			/* Images to replay, or 0 */
+	uint32_t jh_sum;			/* Checksum of the images */
+	uint32_t jh_home[SFS_JMAXBLOCKS];	/* Where each image goes */
 };
 
 /*
@@ -94,5 +201,39 @@ struct sfs_dir {
 	char sfd_name[SFS_NAMELEN];		/* Filename */
 };
 
+/*
+ * On-disk directory index.
+ *
+ * A directory whose sfi_dirindex is nonzero has, in that block, the
+ * heads of SFS_DIRHASH_NBUCKETS hash chains. Every entry in use is
+ * listed, by slot number, on the chain its name hashes to; every
+ * free slot is listed on di_free. A directory with no index (any
+ * directory on an older volume) is simply searched from end to end.
+ *
+ * Names are hashed with 32-bit FNV-1a over the bytes of the name
+ * (offset basis 2166136261, prime 16777619); the chain is the hash
+ * modulo SFS_DIRHASH_NBUCKETS. The index blocks are not part of the
+ * directory's contents and are not counted in sfi_size.
+ */
+struct sfs_dirindex {
+	uint32_t di_bucket[SFS_DIRHASH_NBUCKETS]; /* chains of entries */
+	uint32_t di_free;			/* chain of free slots */
+};
+
+/*
+ * One block of an index chain. Only the first block of a chain may
+ * be partly full; dc_ents[0..dc_count-1] are in use.
+ */
+struct sfs_dirhent {
+	uint32_t dh_hash;			/* Hash of name; 0 if free */
+	uint32_t dh_slot;			/* Directory slot */
+};
+
+struct sfs_dirchain {
+	uint32_t dc_next;			/* Next block, or 0 */
+	uint32_t dc_count;			/* Entries in use */
+	struct sfs_dirhent dc_ents[SFS_DIRHASH_PERBLOCK];
+};
+
 
 #endif /* _KERN_SFS_H_ */
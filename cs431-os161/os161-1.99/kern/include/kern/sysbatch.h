@@ -0,0 +1,28 @@
+#ifndef _KERN_SYSBATCH_H_
+#define _KERN_SYSBATCH_H_
+
+/*
+ * Batched system call submission.
+ *
+ * sysbatch(ents, n) runs the N entries of ENTS in order in a single
+ * kernel entry. Each entry names a system call and gives its
+ * arguments laid out exactly as for a trap: sb_args[0..3] are a0-a3
+ * (64-bit arguments in aligned pairs) and sb_args[4..5] are the words
+ * that would otherwise be at sp+16. On the way back sb_err is 0 or
+ * the error code, and sb_retval is the call's result.
+ *
+ * The batch stops after the first entry that fails; the return value
+ * is the number of entries run, including the failed one. _exit,
+ * execv, and sysbatch itself cannot be batched and fail with EINVAL.
+ */
+
+#define SYSBATCH_MAX 1024	/* most entries in one call */
+
+struct sysbatch {
+	__i32 sb_callno;	/* in: SYS_ number */
+	__u32 sb_args[6];	/* in: arguments */
+	__i32 sb_err;		/* out: error code or 0 */
+	__i64 sb_retval;	/* out: return value */
+};
+
+#endif /* _KERN_SYSBATCH_H_ */
@@ -0,0 +1,52 @@
+#ifndef _OPENFILE_H_
+#define _OPENFILE_H_
+
+/*
+ * Open file object: what a file descriptor refers to.
+ *
+ * An openfile holds one vfs_open() reference on its vnode, the access
+ * mode it was opened with, and the seek position. Several descriptors
+ * (and, once there is fork, several processes) may share an openfile,
+ * so it is reference counted; the vnode is closed when the last
+ * reference goes away.
+ *
+ * of_offsetlock serializes I/O that uses or updates the seek position.
+ */
+
+#include <spinlock.h>
+
+struct lock;
+struct vnode;
+
+struct openfile {
+	struct vnode *of_vnode;		/* the file itself */
+	int of_flags;			/* O_ACCMODE bits, plus O_APPEND */
+
+	struct lock *of_offsetlock;	/* protects of_offset */
+	off_t of_offset;		/* seek position */
+
+	struct spinlock of_reflock;	/* protects of_refcount */
+	unsigned of_refcount;
+};
+
+/* Open PATH with vfs_open and wrap it in a new openfile. May destroy PATH. */
+int openfile_open(char *path, int openflags, mode_t mode,
+		  struct openfile **ret);
+
+/*
+ * Wrap a vnode that did not come from vfs_open (a pipe end, say).
+ * The vnode's reference is taken over and its open count bumped so
+ * that the final openfile_decref can vfs_close it like any other.
+ */
+int openfile_fromvnode(struct vnode *vn, int openflags,
+		       struct openfile **ret);
+
+/* Reference counting. Dropping the last reference closes the file. */
+void openfile_incref(struct openfile *file);
+void openfile_decref(struct openfile *file);
+
+/* True if the file may be read (or written) according to its open mode. */
+bool openfile_readable(struct openfile *file);
+bool openfile_writable(struct openfile *file);
+
+#endif /* _OPENFILE_H_ */
@@ -0,0 +1,19 @@
+#ifndef _PIPE_H_
+#define _PIPE_H_
+
+/*
+ * Anonymous pipes.
+ *
+ * pipe_create makes a new pipe and hands back two vnodes for it, one
+ * for each end. Each comes with one reference, which the caller is
+ * expected to wrap with openfile_fromvnode(); closing all openfiles
+ * for an end closes that end. Reading from a pipe whose write end is
+ * closed gives EOF once it drains; writing to one whose read end is
+ * closed fails with EPIPE.
+ */
+
+struct vnode;
+
+int pipe_create(struct vnode **readend, struct vnode **writeend);
+
+#endif /* _PIPE_H_ */
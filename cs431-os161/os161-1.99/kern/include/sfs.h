@@ -53,16 +53,64 @@ struct sfs_vnode {
 	struct sfs_inode sv_i;		/* on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+
+	/* Inode cache state (sfs_icache.c) */
+	struct sfs_vnode *sv_hashnext;  /* hash chain */
+	struct sfs_vnode *sv_lruprev;   /* LRU list, while idle */
+	struct sfs_vnode *sv_lrunext;
+	bool sv_idle;                   /* unreferenced but kept */
+
+	/* Readahead state (sfs_readahead.c) */
+	uint32_t sv_ranext;             /* block a sequential read starts at */
+	uint32_t sv_rawindow;           /* blocks to read ahead; 0 if random */
+	uint32_t sv_rahigh;             /* end of readahead already queued */
 };
 
+/*
+ * One block of a volume in the buffer cache (sfs_buf.c). b_data holds
+ * the block's contents when b_valid is set; b_dirty means they differ
+ * from what is on disk.
+ */
+struct sfs_buf {
+	struct sfs_buf *b_hashnext;     /* hash chain */
+	struct sfs_buf *b_lruprev;      /* LRU list, while unreferenced */
+	struct sfs_buf *b_lrunext;
+	struct sfs_buf *b_dirtyprev;    /* dirty list, while dirty */
+	struct sfs_buf *b_dirtynext;
+	time_t b_dirtytime;             /* when it last became dirty */
+	void *b_data;                   /* block contents */
+	uint32_t b_block;               /* block number */
+	unsigned b_refcount;            /* current holders */
+	bool b_hashed;                  /* on a hash chain */
+	bool b_valid;                   /* b_data is meaningful */
+	bool b_dirty;                   /* b_data needs writing back */
+	bool b_meta;                    /* metadata, for the journal */
+	bool b_prefetch;                /* held by sfs_bprefetch() */
+	bool b_busy;                    /* being read in; wait for it */
+};
+
+struct sfs_bufcache;                    /* private to sfs_buf.c */
+struct sfs_icache;                      /* private to sfs_icache.c */
+struct sfs_journal;                     /* private to sfs_journal.c */
+
 struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
 	struct sfs_super sfs_super;	/* on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
+	uint32_t sfs_blocksize;         /* bytes per block */
+	uint32_t sfs_dbperidb;          /* block numbers per indirect block */
+	off_t sfs_maxfilesize;          /* largest file the inode can map */
+	uint32_t sfs_inoperblock;       /* inodes per inode block */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct sfs_icache *sfs_inodes;  /* vnodes loaded into memory */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct bitmap *sfs_dirtymap;    /* freemap blocks modified */
+	uint32_t sfs_allochint;         /* where new objects are put */
+	uint32_t sfs_inohint;           /* inode block with room, or 0 */
+	struct sfs_bufcache *sfs_bufs;  /* buffer cache */
+	struct sfs_journal *sfs_journal; /* metadata journal, or NULL */
+	struct sfs_fs *sfs_nextvol;     /* list of volumes for the syncer */
 };
 
 /*
@@ -75,14 +123,88 @@ int sfs_mount(const char *device);
  * Internal functions
  */
 
-/* Initialize uio structure */
-#define SFSUIO(iov, uio, ptr, block, rw) \
-    uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
+/* Initialize uio structure for the first LEN bytes of a block */
+#define SFSUIO(sfs, iov, uio, ptr, block, len, rw) \
+    uio_kinit(iov, uio, ptr, len, ((off_t)(block))*(sfs)->sfs_blocksize, rw)
 
 /* Convenience functions for block I/O */
 int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
 int sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block);
 int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block);
+int sfs_rhead(struct sfs_fs *sfs, void *data, uint32_t block);
+int sfs_whead(struct sfs_fs *sfs, void *data, uint32_t block);
+
+/* Buffer cache */
+int sfs_bcache_create(struct sfs_fs *sfs);
+void sfs_bcache_destroy(struct sfs_fs *sfs);
+int sfs_bget(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret);
+int sfs_bread(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret);
+void sfs_bdirty(struct sfs_fs *sfs, struct sfs_buf *b);
+void sfs_bmetadirty(struct sfs_fs *sfs, struct sfs_buf *b);
+void sfs_brelse(struct sfs_fs *sfs, struct sfs_buf *b);
+void sfs_binval(struct sfs_fs *sfs, uint32_t block, uint32_t count);
+int sfs_bsync(struct sfs_fs *sfs);
+int sfs_bsyncer(struct sfs_fs *sfs);
+int sfs_bwrite(struct sfs_fs *sfs, struct sfs_buf **bufs,
+	       const uint32_t *blocks, unsigned n);
+void sfs_bwritten(struct sfs_fs *sfs, struct sfs_buf *b);
+void sfs_bprefetch(struct sfs_fs *sfs, const uint32_t *blocks, unsigned n);
+bool sfs_bmetahigh(struct sfs_fs *sfs);
+bool sfs_broom(struct sfs_fs *sfs, unsigned n);
+int sfs_bsyncdata(struct sfs_fs *sfs);
+unsigned sfs_bgetmeta(struct sfs_fs *sfs, struct sfs_buf **bufs,
+		      unsigned max);
+
+/* Metadata journal */
+int sfs_jcreate(struct sfs_fs *sfs);
+void sfs_jdestroy(struct sfs_fs *sfs);
+int sfs_jcommit(struct sfs_fs *sfs);
+int sfs_jcheck(struct sfs_fs *sfs);
+void sfs_jfree(struct sfs_fs *sfs, uint32_t block, uint32_t count);
+int sfs_jsync(struct sfs_fs *sfs);
+
+/* Inode cache */
+int sfs_icache_create(struct sfs_fs *sfs);
+void sfs_icache_destroy(struct sfs_fs *sfs);
+struct sfs_vnode *sfs_ifind(struct sfs_fs *sfs, uint32_t ino);
+void sfs_iadd(struct sfs_fs *sfs, struct sfs_vnode *sv);
+void sfs_iremove(struct sfs_fs *sfs, struct sfs_vnode *sv);
+int sfs_irelease(struct sfs_fs *sfs, struct sfs_vnode *sv);
+int sfs_ipurge(struct sfs_fs *sfs);
+int sfs_isync(struct sfs_fs *sfs);
+
+/* Copy dirty inodes and freemap into the buffer cache */
+int sfs_pushmeta(struct sfs_fs *sfs);
+void sfs_markmap(struct sfs_fs *sfs, uint32_t block, uint32_t count);
+int sfs_sync_inode(struct sfs_vnode *sv);
+
+/* Space allocation */
+int sfs_balloc(struct sfs_fs *sfs, uint32_t goal, uint32_t *diskblock);
+void sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock);
+void sfs_bfreerun(struct sfs_fs *sfs, uint32_t diskblock, uint32_t count);
+
+/* Directory slots */
+int sfs_readdir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot);
+int sfs_dir_nentries(struct sfs_vnode *sv);
+
+/* Directory index */
+uint32_t sfs_dirindex_hash(const char *name);
+int sfs_dirindex_lookup(struct sfs_vnode *sv, const char *name,
+			uint32_t *ino, int *slot);
+int sfs_dirindex_add(struct sfs_vnode *sv, const char *name, int slot);
+int sfs_dirindex_remove(struct sfs_vnode *sv, const char *name, int slot);
+int sfs_dirindex_getslot(struct sfs_vnode *sv, int *slot);
+int sfs_dirindex_putslot(struct sfs_vnode *sv, int slot);
+int sfs_dirindex_build(struct sfs_vnode *sv);
+void sfs_dirindex_destroy(struct sfs_vnode *sv);
+
+/* Block mapping */
+int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
+	     uint32_t *diskblock);
+
+/* Readahead */
+int sfs_ra_start(void);
+void sfs_ra_note(struct sfs_vnode *sv, off_t startpos, off_t endpos);
 
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
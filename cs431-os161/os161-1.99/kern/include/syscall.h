@@ -60,9 +60,21 @@ int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
 
 #ifdef UW
 int sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
+int sys_read(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
+int sys_pread(int fdesc,userptr_t ubuf,unsigned int nbytes,off_t pos,int *retval);
+int sys_pwrite(int fdesc,userptr_t ubuf,unsigned int nbytes,off_t pos,int *retval);
+int sys_readv(int fdesc,userptr_t iov,int iovcnt,int *retval);
+int sys_writev(int fdesc,userptr_t iov,int iovcnt,int *retval);
+int sys_sendfile(int outfd,int infd,userptr_t uoffset,size_t count,int *retval);
+int sys_open(userptr_t upath,int flags,mode_t mode,int *retval);
+int sys_lseek(int fdesc,off_t pos,int whence,off_t *retval);
+int sys_close(int fdesc);
+int sys_pipe(userptr_t fdsptr);
 void sys__exit(int exitcode);
 int sys_getpid(pid_t *retval);
 int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
+int sys_execv(userptr_t progname, userptr_t args);
+int sys_sysbatch(userptr_t uents, int n, int *retval);
 
 #endif // UW
 
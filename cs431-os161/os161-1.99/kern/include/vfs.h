@@ -192,5 +192,17 @@ void vfs_biglock_acquire(void);
 void vfs_biglock_release(void);
 bool vfs_biglock_do_i_hold(void);
 
+/*
+ * Give up the big lock for a while, when it is held only once: to
+ * sleep on a CV (broadcast with the lock held), or to let other
+ * threads run. Both return false, having done nothing, when the lock
+ * is held recursively, since the caller's callers may not expect
+ * things to change under them.
+ */
+struct cv;
+bool vfs_biglock_wait(struct cv *cv);
+void vfs_biglock_broadcast(struct cv *cv);
+bool vfs_biglock_yield(void);
+
 
 #endif /* _VFS_H_ */
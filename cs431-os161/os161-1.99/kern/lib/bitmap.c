@@ -95,31 +95,104 @@ bitmap_getdata(struct bitmap *b)
         return b->v;
 }
 
+/*
+ * Full words are skipped SCAN_WORDS at a time by looking at them as
+ * one uint32_t. That reads the same whatever the byte order, since
+ * all we ask is whether every bit is set. b->v comes from kmalloc, so
+ * it's suitably aligned.
+ */
+#define SCAN_WORDS      (sizeof(uint32_t) / sizeof(WORD_TYPE))
+
+/*
+ * Return the index of the first word in [ix, maxix) with a clear
+ * bit, or maxix if there isn't one.
+ */
+static
+unsigned
+bitmap_scan(const struct bitmap *b, unsigned ix, unsigned maxix)
+{
+        const uint32_t *chunk;
+
+        while (ix < maxix && ix % SCAN_WORDS != 0) {
+                if (b->v[ix] != WORD_ALLBITS) {
+                        return ix;
+                }
+                ix++;
+        }
+        while (ix + SCAN_WORDS <= maxix) {
+                chunk = (const uint32_t *)&b->v[ix];
+                if (*chunk != 0xffffffff) {
+                        break;
+                }
+                ix += SCAN_WORDS;
+        }
+        while (ix < maxix && b->v[ix] == WORD_ALLBITS) {
+                ix++;
+        }
+        return ix;
+}
+
+/*
+ * Set the first clear bit of word IX at or above bit OFFSET, and
+ * return its index. ENOSPC if there isn't one.
+ */
+static
 int
-bitmap_alloc(struct bitmap *b, unsigned *index)
+bitmap_takebit(struct bitmap *b, unsigned ix, unsigned offset,
+               unsigned *index)
+{
+        for (; offset < BITS_PER_WORD; offset++) {
+                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
+
+                if ((b->v[ix] & mask)==0) {
+                        b->v[ix] |= mask;
+                        *index = (ix*BITS_PER_WORD)+offset;
+                        KASSERT(*index < b->nbits);
+                        return 0;
+                }
+        }
+        return ENOSPC;
+}
+
+int
+bitmap_alloc_near(struct bitmap *b, unsigned hint, unsigned *index)
 {
-        unsigned ix;
         unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
-        unsigned offset;
+        unsigned hintix, ix;
 
-        for (ix=0; ix<maxix; ix++) {
-                if (b->v[ix]!=WORD_ALLBITS) {
-                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
-                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
-
-                                if ((b->v[ix] & mask)==0) {
-                                        b->v[ix] |= mask;
-                                        *index = (ix*BITS_PER_WORD)+offset;
-                                        KASSERT(*index < b->nbits);
-                                        return 0;
-                                }
-                        }
-                        KASSERT(0);
+        if (hint >= b->nbits) {
+                hint = 0;
+        }
+        hintix = hint / BITS_PER_WORD;
+
+        /* The hint itself, or above it in the same word */
+        if (bitmap_takebit(b, hintix, hint % BITS_PER_WORD, index) == 0) {
+                return 0;
+        }
+
+        /* Then upwards to the end, then around from the start */
+        ix = bitmap_scan(b, hintix+1, maxix);
+        if (ix == maxix) {
+                ix = bitmap_scan(b, 0, hintix+1);
+                if (ix == hintix+1) {
+                        return ENOSPC;
                 }
         }
+        if (bitmap_takebit(b, ix, 0, index) == 0) {
+                return 0;
+        }
+
+        /* Only the part of the hint word below the hint can get here */
+        KASSERT(ix == hintix);
         return ENOSPC;
 }
 
+int
+bitmap_alloc(struct bitmap *b, unsigned *index)
+{
+        return bitmap_alloc_near(b, 0, index);
+}
+
 static
 inline
 void
@@ -157,6 +230,80 @@ bitmap_unmark(struct bitmap *b, unsigned index)
         b->v[ix] &= ~mask;
 }
 
+/*
+ * The range operations go a word at a time, apart from the partial
+ * words at either end.
+ */
+void
+bitmap_markrange(struct bitmap *b, unsigned index, unsigned count)
+{
+        unsigned end = index + count;
+
+        KASSERT(end >= index && end <= b->nbits);
+
+        while (index < end && index % BITS_PER_WORD != 0) {
+                bitmap_mark(b, index++);
+        }
+        while (index + BITS_PER_WORD <= end) {
+                KASSERT(b->v[index / BITS_PER_WORD] == 0);
+                b->v[index / BITS_PER_WORD] = WORD_ALLBITS;
+                index += BITS_PER_WORD;
+        }
+        while (index < end) {
+                bitmap_mark(b, index++);
+        }
+}
+
+void
+bitmap_unmarkrange(struct bitmap *b, unsigned index, unsigned count)
+{
+        unsigned end = index + count;
+
+        KASSERT(end >= index && end <= b->nbits);
+
+        while (index < end && index % BITS_PER_WORD != 0) {
+                bitmap_unmark(b, index++);
+        }
+        while (index + BITS_PER_WORD <= end) {
+                KASSERT(b->v[index / BITS_PER_WORD] == WORD_ALLBITS);
+                b->v[index / BITS_PER_WORD] = 0;
+                index += BITS_PER_WORD;
+        }
+        while (index < end) {
+                bitmap_unmark(b, index++);
+        }
+}
+
+/*
+ * Every bit set in SUB must be set in B. Runs of clear words in SUB
+ * are skipped SCAN_WORDS at a time. The bits past nbits in the last
+ * word, which bitmap_create set in both, are left alone.
+ */
+void
+bitmap_subtract(struct bitmap *b, struct bitmap *sub)
+{
+        unsigned fullwords = b->nbits / BITS_PER_WORD;
+        unsigned ix, index;
+
+        KASSERT(b->nbits == sub->nbits);
+
+        for (ix = 0; ix < fullwords; ix++) {
+                if (ix % SCAN_WORDS == 0 && ix + SCAN_WORDS <= fullwords &&
+                    *(const uint32_t *)&sub->v[ix] == 0) {
+                        ix += SCAN_WORDS - 1;
+                        continue;
+                }
+                KASSERT((b->v[ix] & sub->v[ix]) == sub->v[ix]);
+                b->v[ix] &= ~sub->v[ix];
+                sub->v[ix] = 0;
+        }
+        for (index = fullwords * BITS_PER_WORD; index < b->nbits; index++) {
+                if (bitmap_isset(sub, index)) {
+                        bitmap_unmark(sub, index);
+                        bitmap_unmark(b, index);
+                }
+        }
+}
 
 int
 bitmap_isset(struct bitmap *b, unsigned index) 
@@ -49,6 +49,8 @@
 #include <vnode.h>
 #include <vfs.h>
 #include <synch.h>
+#include <openfile.h>
+#include <filetable.h>
 #include <kern/fcntl.h>  
 
 /*
@@ -98,10 +100,7 @@ proc_create(const char *name)
 
 	/* VFS fields */
 	proc->p_cwd = NULL;
-
-#ifdef UW
-	proc->console = NULL;
-#endif // UW
+	proc->p_filetable = NULL;
 
 	return proc;
 }
@@ -135,6 +134,10 @@ proc_destroy(struct proc *proc)
 		VOP_DECREF(proc->p_cwd);
 		proc->p_cwd = NULL;
 	}
+	if (proc->p_filetable) {
+		filetable_destroy(proc->p_filetable);
+		proc->p_filetable = NULL;
+	}
 
 
 #ifndef UW  // in the UW version, space destruction occurs in sys_exit, not here
@@ -157,12 +160,6 @@ proc_destroy(struct proc *proc)
 	}
 #endif // UW
 
-#ifdef UW
-	if (proc->console) {
-	  vfs_close(proc->console);
-	}
-#endif // UW
-
 	threadarray_cleanup(&proc->p_threads);
 	spinlock_cleanup(&proc->p_lock);
 
@@ -210,34 +207,60 @@ proc_bootstrap(void)
 #endif // UW 
 }
 
+/*
+ * Open the console on descriptors 0, 1, and 2 of a new file table.
+ */
+static
+int
+proc_openconsole(struct filetable *ft)
+{
+	static const int modes[3] = { O_RDONLY, O_WRONLY, O_WRONLY };
+	struct openfile *file;
+	char path[sizeof("con:")];
+	int fd, i, result;
+
+	for (i=0; i<3; i++) {
+		/* vfs_open may destroy the path, so start fresh each time */
+		strcpy(path, "con:");
+		result = openfile_open(path, modes[i], 0, &file);
+		if (result) {
+			return result;
+		}
+		result = filetable_place(ft, file, &fd);
+		if (result) {
+			openfile_decref(file);
+			return result;
+		}
+		KASSERT(fd == i);
+	}
+	return 0;
+}
+
 /*
  * Create a fresh proc for use by runprogram.
  *
  * It will have no address space and will inherit the current
- * process's (that is, the kernel menu's) current directory.
+ * process's (that is, the kernel menu's) current directory. Its
+ * stdin, stdout, and stderr are the console.
  */
 struct proc *
 proc_create_runprogram(const char *name)
 {
 	struct proc *proc;
-	char *console_path;
 
 	proc = proc_create(name);
 	if (proc == NULL) {
 		return NULL;
 	}
 
-#ifdef UW
 	/* open the console - this should always succeed */
-	console_path = kstrdup("con:");
-	if (console_path == NULL) {
-	  panic("unable to copy console path name during process creation\n");
+	proc->p_filetable = filetable_create();
+	if (proc->p_filetable == NULL) {
+		panic("unable to create a file table during process creation\n");
 	}
-	if (vfs_open(console_path,O_WRONLY,0,&(proc->console))) {
-	  panic("unable to open the console during process creation\n");
+	if (proc_openconsole(proc->p_filetable)) {
+		panic("unable to open the console during process creation\n");
 	}
-	kfree(console_path);
-#endif // UW
 	  
 	/* VM fields */
 
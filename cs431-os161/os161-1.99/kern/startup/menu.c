@@ -74,11 +74,8 @@ getinterval(time_t s1, uint32_t ns1, time_t s2, uint32_t ns2,
 
 /*
  * Function for a thread that runs an arbitrary userlevel program by
- * name.
- *
- * Note: this cannot pass arguments to the program. You may wish to 
- * change it so it can, because that will make testing much easier
- * in the future.
+ * name. The whole argument list, program name included, is passed
+ * on to the program as its argv[].
  *
  * It copies the program name because runprogram destroys the copy
  * it gets by passing it to vfs_open(). 
@@ -93,16 +90,12 @@ cmd_progthread(void *ptr, unsigned long nargs)
 
 	KASSERT(nargs >= 1);
 
-	if (nargs > 2) {
-		kprintf("Warning: argument passing from menu not supported\n");
-	}
-
 	/* Hope we fit. */
 	KASSERT(strlen(args[0]) < sizeof(progname));
 
 	strcpy(progname, args[0]);
 
-	result = runprogram(progname);
+	result = runprogram(progname, nargs, args);
 	if (result) {
 		kprintf("Running program %s failed: %s\n", args[0],
 			strerror(result));
@@ -0,0 +1,198 @@
+/*
+ * Argument staging for execv() and runprogram().
+ *
+ * See argbuf.h for the overall scheme. The buffer is allocated once
+ * at boot: an ARG_MAX-sized kmalloc per exec would come out of
+ * alloc_kpages(), and dumbvm never gives those pages back.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <limits.h>
+#include <lib.h>
+#include <synch.h>
+#include <copyinout.h>
+#include <argbuf.h>
+
+/* Each string is padded so the next one (and argv[]) stays aligned. */
+#define ARGBUF_ALIGN		sizeof(userptr_t)
+#define ARGBUF_ROUNDUP(x)	(((x) + ARGBUF_ALIGN - 1) & ~(ARGBUF_ALIGN - 1))
+#define ARGBUF_ROUNDDOWN(x)	((x) & ~(ARGBUF_ALIGN - 1))
+
+static struct argbuf staging;
+
+/* Only one exec may use the staging buffer at a time. */
+static struct semaphore *argbuf_sem;
+
+void
+argbuf_bootstrap(void)
+{
+	staging.ab_data = kmalloc(ARG_MAX);
+	if (staging.ab_data == NULL) {
+		panic("argbuf_bootstrap: out of memory\n");
+	}
+	staging.ab_len = 0;
+	staging.ab_argc = 0;
+
+	argbuf_sem = sem_create("argbuf", 1);
+	if (argbuf_sem == NULL) {
+		panic("argbuf_bootstrap: could not create semaphore\n");
+	}
+}
+
+struct argbuf *
+argbuf_acquire(void)
+{
+	P(argbuf_sem);
+	staging.ab_len = 0;
+	staging.ab_argc = 0;
+	return &staging;
+}
+
+void
+argbuf_release(struct argbuf *ab)
+{
+	KASSERT(ab == &staging);
+	V(argbuf_sem);
+}
+
+/*
+ * Space left for the next string. Room is held back for the argv[]
+ * array: one pointer per string so far, one for the next string, and
+ * the terminating NULL. Rounded down so that padding the string
+ * never takes us past the limit.
+ */
+static
+size_t
+argbuf_room(struct argbuf *ab)
+{
+	size_t used;
+
+	used = ab->ab_len + (ab->ab_argc + 2) * sizeof(userptr_t);
+	if (used >= ARG_MAX) {
+		return 0;
+	}
+	return ARGBUF_ROUNDDOWN(ARG_MAX - used);
+}
+
+/*
+ * Account for a string of LEN bytes (including the NUL) that has just
+ * been placed at the end of the buffer, zeroing the padding after it.
+ */
+static
+void
+argbuf_commit(struct argbuf *ab, size_t len)
+{
+	size_t padded;
+
+	padded = ARGBUF_ROUNDUP(len);
+	bzero(ab->ab_data + ab->ab_len + len, padded - len);
+	ab->ab_len += padded;
+	ab->ab_argc++;
+}
+
+int
+argbuf_copyin(struct argbuf *ab, userptr_t uargv)
+{
+	userptr_t uarg;
+	vaddr_t uslot;
+	size_t room, got;
+	int result;
+
+	KASSERT(ab->ab_len == 0 && ab->ab_argc == 0);
+
+	if (uargv == NULL) {
+		return EFAULT;
+	}
+
+	uslot = (vaddr_t)uargv;
+	while (1) {
+		result = copyin((const_userptr_t)uslot, &uarg, sizeof(uarg));
+		if (result) {
+			return result;
+		}
+		if (uarg == NULL) {
+			break;
+		}
+		uslot += sizeof(userptr_t);
+
+		room = argbuf_room(ab);
+		if (room == 0) {
+			return E2BIG;
+		}
+		/* Copy straight into place; no intermediate string. */
+		result = copyinstr((const_userptr_t)uarg,
+				   ab->ab_data + ab->ab_len, room, &got);
+		if (result == ENAMETOOLONG) {
+			return E2BIG;
+		}
+		if (result) {
+			return result;
+		}
+		argbuf_commit(ab, got);
+	}
+	return 0;
+}
+
+int
+argbuf_kcopyin(struct argbuf *ab, int nargs, char **args)
+{
+	size_t len;
+	int i;
+
+	KASSERT(ab->ab_len == 0 && ab->ab_argc == 0);
+
+	for (i=0; i<nargs; i++) {
+		len = strlen(args[i]) + 1;
+		if (len > argbuf_room(ab)) {
+			return E2BIG;
+		}
+		memcpy(ab->ab_data + ab->ab_len, args[i], len);
+		argbuf_commit(ab, len);
+	}
+	return 0;
+}
+
+int
+argbuf_copyout(struct argbuf *ab, vaddr_t *stackptr, userptr_t *uargv)
+{
+	vaddr_t strbase, argvbase;
+	userptr_t *argv;
+	size_t off, argvlen;
+	int i, result;
+
+	/*
+	 * Strings go at the very top of the stack, argv[] right below
+	 * them. The MIPS calling convention wants the stack pointer
+	 * doubleword-aligned, which may leave a gap of one word.
+	 */
+	argvlen = (ab->ab_argc + 1) * sizeof(userptr_t);
+	strbase = *stackptr - ab->ab_len;
+	argvbase = (strbase - argvlen) & ~(vaddr_t)7;
+
+	/*
+	 * Build argv[] in the staging buffer just past the strings;
+	 * argbuf_room() made sure there is space for it.
+	 */
+	argv = (userptr_t *)(ab->ab_data + ab->ab_len);
+	off = 0;
+	for (i=0; i<ab->ab_argc; i++) {
+		argv[i] = (userptr_t)(strbase + off);
+		off += ARGBUF_ROUNDUP(strlen(ab->ab_data + off) + 1);
+	}
+	argv[ab->ab_argc] = NULL;
+	KASSERT(off == ab->ab_len);
+
+	result = copyout(ab->ab_data, (userptr_t)strbase, ab->ab_len);
+	if (result) {
+		return result;
+	}
+	result = copyout(argv, (userptr_t)argvbase, argvlen);
+	if (result) {
+		return result;
+	}
+
+	*stackptr = argvbase;
+	*uargv = (userptr_t)argvbase;
+	return 0;
+}
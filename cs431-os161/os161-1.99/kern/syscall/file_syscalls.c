@@ -1,60 +1,630 @@
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/seek.h>
 #include <kern/unistd.h>
+#include <limits.h>
 #include <lib.h>
 #include <uio.h>
+#include <vm.h>
+#include <stat.h>
+#include <synch.h>
 #include <syscall.h>
 #include <vnode.h>
 #include <vfs.h>
 #include <current.h>
 #include <proc.h>
+#include <copyinout.h>
+#include <openfile.h>
+#include <filetable.h>
+#include <pipe.h>
+
+/*
+ * Number of user iovecs brought into the kernel per VOP call by
+ * readv/writev. The kernel stack is only a page, so they are
+ * processed in batches rather than copied in all at once.
+ */
+#define FILE_IOVBATCH 16
+
+/* Largest transfer whose length fits in the (int) return value. */
+#define FILE_XFERMAX 0x7fffffff
 
-/* handler for write() system call                  */
 /*
- * n.b.
- * This implementation handles only writes to standard output 
- * and standard error, both of which go to the console.
- * Also, it does not provide any synchronization, so writes
- * are not atomic.
- *
- * You will need to improve this implementation
+ * Size of the kernel buffers sendfile copies through. These are
+ * several pages, so like pipe ring buffers they are recycled through
+ * a free list instead of being handed back to kfree, which under
+ * dumbvm would leak them. Linked through the first word.
  */
+#define FILE_BUFSIZE (4 * PAGE_SIZE)
+
+static struct spinlock file_buflock = SPINLOCK_INITIALIZER;
+static void *file_freebufs;
+
+static
+char *
+file_getbuf(void)
+{
+  void *buf;
+
+  spinlock_acquire(&file_buflock);
+  buf = file_freebufs;
+  if (buf != NULL) {
+    file_freebufs = *(void **)buf;
+  }
+  spinlock_release(&file_buflock);
+
+  if (buf == NULL) {
+    buf = kmalloc(FILE_BUFSIZE);
+  }
+  return buf;
+}
+
+static
+void
+file_putbuf(char *buf)
+{
+  spinlock_acquire(&file_buflock);
+  *(void **)buf = file_freebufs;
+  file_freebufs = buf;
+  spinlock_release(&file_buflock);
+}
 
+/*
+ * Look up descriptor FDESC and check that it is open for RW.
+ */
+static
 int
-sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
+file_get(int fdesc, enum uio_rw rw, struct openfile **ret)
+{
+  struct openfile *file;
+  int res;
+
+  KASSERT(curproc != NULL);
+  KASSERT(curproc->p_filetable != NULL);
+
+  res = filetable_get(curproc->p_filetable, fdesc, &file);
+  if (res) {
+    return res;
+  }
+  if (rw == UIO_READ ? !openfile_readable(file) : !openfile_writable(file)) {
+    return EBADF;
+  }
+  *ret = file;
+  return 0;
+}
+
+/*
+ * Work out where a transfer on FILE starts. Positioned I/O (POSP not
+ * NULL) goes at *POSP, which must be a legal seek position, and does
+ * not touch the seek pointer at all. Otherwise the seek lock is taken
+ * (and held until file_end) and the transfer starts at the seek
+ * pointer, or at EOF for an O_APPEND write.
+ */
+static
+int
+file_begin(struct openfile *file, enum uio_rw rw, const off_t *posp,
+	   off_t *pos)
+{
+  struct stat st;
+  int res;
+
+  if (posp != NULL) {
+    res = VOP_TRYSEEK(file->of_vnode, *posp);
+    if (res) {
+      return res;
+    }
+    *pos = *posp;
+    return 0;
+  }
+
+  lock_acquire(file->of_offsetlock);
+  if (rw == UIO_WRITE && (file->of_flags & O_APPEND)) {
+    res = VOP_STAT(file->of_vnode, &st);
+    if (res) {
+      lock_release(file->of_offsetlock);
+      return res;
+    }
+    file->of_offset = st.st_size;
+  }
+  *pos = file->of_offset;
+  return 0;
+}
+
+/*
+ * Finish a transfer started with file_begin, leaving the seek pointer
+ * at POS unless it was positioned I/O.
+ */
+static
+void
+file_end(struct openfile *file, const off_t *posp, off_t pos)
+{
+  if (posp == NULL) {
+    file->of_offset = pos;
+    lock_release(file->of_offsetlock);
+  }
+}
+
+/*
+ * One VOP_READ or VOP_WRITE through IOVCNT iovecs in SEG holding LEN
+ * bytes in all, at *POS. *POS is advanced and *DONE increased by the
+ * amount actually moved, even on error.
+ */
+static
+int
+file_xfer(struct openfile *file, enum uio_rw rw, enum uio_seg seg,
+	  struct iovec *iov, unsigned iovcnt, size_t len, off_t *pos,
+	  size_t *done)
 {
-  struct iovec iov;
   struct uio u;
   int res;
 
-  DEBUG(DB_SYSCALL,"Syscall: write(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
-  
-  /* only stdout and stderr writes are currently implemented */
-  if (!((fdesc==STDOUT_FILENO)||(fdesc==STDERR_FILENO))) {
-    return EUNIMP;
+  u.uio_iov = iov;
+  u.uio_iovcnt = iovcnt;
+  u.uio_offset = *pos;
+  u.uio_resid = len;
+  u.uio_segflg = seg;
+  u.uio_rw = rw;
+  u.uio_space = seg == UIO_USERSPACE ? curproc->p_addrspace : NULL;
+
+  if (rw == UIO_READ) {
+    res = VOP_READ(file->of_vnode, &u);
   }
-  KASSERT(curproc != NULL);
-  KASSERT(curproc->console != NULL);
+  else {
+    res = VOP_WRITE(file->of_vnode, &u);
+  }
+
+  *pos += len - u.uio_resid;
+  *done += len - u.uio_resid;
+  return res;
+}
+
+/*
+ * Common code for read, write, pread, and pwrite: move NBYTES between
+ * UBUF and descriptor FDESC, at *POSP if given, or at the seek
+ * pointer. The number of bytes actually moved goes in RETVAL.
+ */
+static
+int
+file_rw(int fdesc, userptr_t ubuf, size_t nbytes, enum uio_rw rw,
+	const off_t *posp, int *retval)
+{
+  struct openfile *file;
+  struct iovec iov;
+  size_t done;
+  off_t pos;
+  int res;
+
   KASSERT(curproc->p_addrspace != NULL);
 
-  /* set up a uio structure to refer to the user program's buffer (ubuf) */
+  res = file_get(fdesc, rw, &file);
+  if (res) {
+    return res;
+  }
+  res = file_begin(file, rw, posp, &pos);
+  if (res) {
+    return res;
+  }
+
+  /* set up an iovec to refer to the user program's buffer (ubuf) */
   iov.iov_ubase = ubuf;
   iov.iov_len = nbytes;
-  u.uio_iov = &iov;
-  u.uio_iovcnt = 1;
-  u.uio_offset = 0;  /* not needed for the console */
-  u.uio_resid = nbytes;
-  u.uio_segflg = UIO_USERSPACE;
-  u.uio_rw = UIO_WRITE;
-  u.uio_space = curproc->p_addrspace;
+  done = 0;
+  res = file_xfer(file, rw, UIO_USERSPACE, &iov, 1, nbytes, &pos, &done);
 
-  res = VOP_WRITE(curproc->console,&u);
+  file_end(file, posp, pos);
   if (res) {
     return res;
   }
 
-  /* pass back the number of bytes actually written */
-  *retval = nbytes - u.uio_resid;
+  /* pass back the number of bytes actually transferred */
+  *retval = done;
   KASSERT(*retval >= 0);
   return 0;
 }
+
+/*
+ * Common code for readv and writev: gather/scatter through the
+ * IOVCNT iovecs at UIOV in as few VOP calls as the batch size allows,
+ * all under one hold of the seek lock so the transfer is contiguous
+ * in the file. Stops early on a short transfer, as read and write do.
+ */
+static
+int
+file_rwv(int fdesc, const_userptr_t uiov, int iovcnt, enum uio_rw rw,
+	 int *retval)
+{
+  struct openfile *file;
+  struct iovec iov[FILE_IOVBATCH];
+  unsigned n, i;
+  size_t len, total, done;
+  off_t pos;
+  int res;
+
+  KASSERT(curproc->p_addrspace != NULL);
+
+  if (iovcnt <= 0 || iovcnt > IOV_MAX) {
+    return EINVAL;
+  }
+
+  res = file_get(fdesc, rw, &file);
+  if (res) {
+    return res;
+  }
+  res = file_begin(file, rw, NULL, &pos);
+  if (res) {
+    return res;
+  }
+
+  total = 0;
+  done = 0;
+  while (iovcnt > 0) {
+    n = iovcnt < FILE_IOVBATCH ? iovcnt : FILE_IOVBATCH;
+    res = copyin(uiov, iov, n * sizeof(struct iovec));
+    if (res) {
+      break;
+    }
+
+    len = 0;
+    for (i=0; i<n; i++) {
+      if (iov[i].iov_len > (size_t)FILE_XFERMAX - total - len) {
+        res = EINVAL;
+        break;
+      }
+      len += iov[i].iov_len;
+    }
+    if (res) {
+      break;
+    }
+    total += len;
+
+    res = file_xfer(file, rw, UIO_USERSPACE, iov, n, len, &pos, &done);
+    if (res || done < total) {
+      break;
+    }
+
+    uiov = (const_userptr_t)((vaddr_t)uiov + n * sizeof(struct iovec));
+    iovcnt -= n;
+  }
+
+  file_end(file, NULL, pos);
+
+  /* report errors only if nothing was transferred */
+  if (res && done == 0) {
+    return res;
+  }
+  *retval = done;
+  return 0;
+}
+
+/* handler for write() system call                  */
+int
+sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: write(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
+
+  return file_rw(fdesc, ubuf, nbytes, UIO_WRITE, NULL, retval);
+}
+
+/* handler for read() system call                  */
+int
+sys_read(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: read(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
+
+  return file_rw(fdesc, ubuf, nbytes, UIO_READ, NULL, retval);
+}
+
+/* handler for pwrite() system call                  */
+int
+sys_pwrite(int fdesc,userptr_t ubuf,unsigned int nbytes,off_t pos,int *retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: pwrite(%d,%x,%d,%lld)\n",fdesc,(unsigned int)ubuf,nbytes,pos);
+
+  return file_rw(fdesc, ubuf, nbytes, UIO_WRITE, &pos, retval);
+}
+
+/* handler for pread() system call                  */
+int
+sys_pread(int fdesc,userptr_t ubuf,unsigned int nbytes,off_t pos,int *retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: pread(%d,%x,%d,%lld)\n",fdesc,(unsigned int)ubuf,nbytes,pos);
+
+  return file_rw(fdesc, ubuf, nbytes, UIO_READ, &pos, retval);
+}
+
+/* handler for writev() system call                  */
+int
+sys_writev(int fdesc,userptr_t iov,int iovcnt,int *retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: writev(%d,%x,%d)\n",fdesc,(unsigned int)iov,iovcnt);
+
+  return file_rwv(fdesc, iov, iovcnt, UIO_WRITE, retval);
+}
+
+/* handler for readv() system call                  */
+int
+sys_readv(int fdesc,userptr_t iov,int iovcnt,int *retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: readv(%d,%x,%d)\n",fdesc,(unsigned int)iov,iovcnt);
+
+  return file_rwv(fdesc, iov, iovcnt, UIO_READ, retval);
+}
+
+/*
+ * handler for sendfile() system call: copy up to COUNT bytes from
+ * INFD to OUTFD through a kernel buffer, never touching user memory.
+ * If UOFFSET is not NULL the input is read from *UOFFSET, which is
+ * updated, and its seek pointer is left alone; otherwise the input
+ * seek pointer is used and advanced. Both seek locks are held while
+ * a chunk is read and written, taken in address order so that two
+ * sendfiles in opposite directions cannot deadlock. If a write comes
+ * up short the input position is wound back over the part that was
+ * not written, under the same lock, provided the input can seek;
+ * from a pipe or the console the bytes are gone, and only the short
+ * count is reported.
+ */
+int
+sys_sendfile(int outfd,int infd,userptr_t uoffset,size_t count,int *retval)
+{
+  struct openfile *in, *out;
+  struct iovec iov;
+  char *buf;
+  off_t pos, *posp, inpos, outpos;
+  size_t len, done, got, put;
+  int res, cres;
+
+  DEBUG(DB_SYSCALL,"Syscall: sendfile(%d,%d,%x,%d)\n",outfd,infd,(unsigned int)uoffset,count);
+
+  res = file_get(infd, UIO_READ, &in);
+  if (res) {
+    return res;
+  }
+  res = file_get(outfd, UIO_WRITE, &out);
+  if (res) {
+    return res;
+  }
+
+  posp = NULL;
+  if (uoffset != NULL) {
+    res = copyin(uoffset, &pos, sizeof(pos));
+    if (res) {
+      return res;
+    }
+    posp = &pos;
+  }
+  else if (in == out) {
+    /* would need the same seek lock twice */
+    return EINVAL;
+  }
+  if (count > FILE_XFERMAX) {
+    count = FILE_XFERMAX;
+  }
+
+  buf = file_getbuf();
+  if (buf == NULL) {
+    return ENOMEM;
+  }
+
+  done = 0;
+  while (done < count) {
+    len = count - done;
+    if (len > FILE_BUFSIZE) {
+      len = FILE_BUFSIZE;
+    }
+
+    if (posp == NULL && out < in) {
+      res = file_begin(out, UIO_WRITE, NULL, &outpos);
+      if (res) {
+	break;
+      }
+      res = file_begin(in, UIO_READ, posp, &inpos);
+      if (res) {
+	file_end(out, NULL, outpos);
+	break;
+      }
+    }
+    else {
+      res = file_begin(in, UIO_READ, posp, &inpos);
+      if (res) {
+	break;
+      }
+      res = file_begin(out, UIO_WRITE, NULL, &outpos);
+      if (res) {
+	file_end(in, posp, inpos);
+	break;
+      }
+    }
+
+    iov.iov_kbase = buf;
+    iov.iov_len = len;
+    got = 0;
+    res = file_xfer(in, UIO_READ, UIO_SYSSPACE, &iov, 1, len, &inpos, &got);
+
+    put = 0;
+    if (res == 0 && got > 0) {
+      iov.iov_kbase = buf;
+      iov.iov_len = got;
+      res = file_xfer(out, UIO_WRITE, UIO_SYSSPACE, &iov, 1, got, &outpos,
+		      &put);
+      if (put < got &&
+	  VOP_TRYSEEK(in->of_vnode, inpos - (got - put)) == 0) {
+	/* give back what was read but not written */
+	inpos -= got - put;
+      }
+    }
+
+    file_end(out, NULL, outpos);
+    file_end(in, posp, inpos);
+    if (posp != NULL) {
+      pos = inpos;
+    }
+
+    done += put;
+    if (res || got == 0 || put < got) {
+      break;
+    }
+  }
+
+  file_putbuf(buf);
+
+  if (posp != NULL) {
+    cres = copyout(&pos, uoffset, sizeof(pos));
+    if (res == 0) {
+      res = cres;
+    }
+  }
+
+  /* report errors only if nothing was transferred */
+  if (res && done == 0) {
+    return res;
+  }
+  *retval = done;
+  return 0;
+}
+
+/* handler for open() system call                  */
+int
+sys_open(userptr_t upath,int flags,mode_t mode,int *retval)
+{
+  struct openfile *file;
+  char *path;
+  int res;
+
+  DEBUG(DB_SYSCALL,"Syscall: open(%x,%d)\n",(unsigned int)upath,flags);
+
+  path = kmalloc(PATH_MAX);
+  if (path == NULL) {
+    return ENOMEM;
+  }
+  res = copyinstr(upath, path, PATH_MAX, NULL);
+  if (res) {
+    kfree(path);
+    return res;
+  }
+
+  res = openfile_open(path, flags, mode, &file);
+  kfree(path);
+  if (res) {
+    return res;
+  }
+
+  res = filetable_place(curproc->p_filetable, file, retval);
+  if (res) {
+    openfile_decref(file);
+    return res;
+  }
+  return 0;
+}
+
+/* handler for lseek() system call                  */
+int
+sys_lseek(int fdesc,off_t pos,int whence,off_t *retval)
+{
+  struct openfile *file;
+  struct stat st;
+  off_t newpos;
+  int res;
+
+  DEBUG(DB_SYSCALL,"Syscall: lseek(%d,%lld,%d)\n",fdesc,pos,whence);
+
+  res = filetable_get(curproc->p_filetable, fdesc, &file);
+  if (res) {
+    return res;
+  }
+
+  lock_acquire(file->of_offsetlock);
+  switch (whence) {
+  case SEEK_SET:
+    newpos = pos;
+    break;
+  case SEEK_CUR:
+    newpos = file->of_offset + pos;
+    break;
+  case SEEK_END:
+    res = VOP_STAT(file->of_vnode, &st);
+    if (res) {
+      lock_release(file->of_offsetlock);
+      return res;
+    }
+    newpos = st.st_size + pos;
+    break;
+  default:
+    lock_release(file->of_offsetlock);
+    return EINVAL;
+  }
+
+  res = VOP_TRYSEEK(file->of_vnode, newpos);
+  if (res) {
+    lock_release(file->of_offsetlock);
+    return res;
+  }
+  file->of_offset = newpos;
+  lock_release(file->of_offsetlock);
+
+  *retval = newpos;
+  return 0;
+}
+
+/* handler for close() system call                  */
+int
+sys_close(int fdesc)
+{
+  DEBUG(DB_SYSCALL,"Syscall: close(%d)\n",fdesc);
+
+  return filetable_close(curproc->p_filetable, fdesc);
+}
+
+/* handler for pipe() system call                  */
+/*
+ * Makes a pipe and puts its read end and write end in the two lowest
+ * free descriptors, which are passed back in the user's array.
+ */
+int
+sys_pipe(userptr_t fdsptr)
+{
+  struct vnode *rvn, *wvn;
+  struct openfile *rfile, *wfile;
+  int fds[2];
+  int res;
+
+  DEBUG(DB_SYSCALL,"Syscall: pipe(%x)\n",(unsigned int)fdsptr);
+
+  res = pipe_create(&rvn, &wvn);
+  if (res) {
+    return res;
+  }
+
+  res = openfile_fromvnode(rvn, O_RDONLY, &rfile);
+  if (res) {
+    VOP_DECREF(rvn);
+    VOP_DECREF(wvn);
+    return res;
+  }
+  res = openfile_fromvnode(wvn, O_WRONLY, &wfile);
+  if (res) {
+    openfile_decref(rfile);
+    VOP_DECREF(wvn);
+    return res;
+  }
+
+  res = filetable_place(curproc->p_filetable, rfile, &fds[0]);
+  if (res) {
+    openfile_decref(rfile);
+    openfile_decref(wfile);
+    return res;
+  }
+  res = filetable_place(curproc->p_filetable, wfile, &fds[1]);
+  if (res) {
+    filetable_close(curproc->p_filetable, fds[0]);
+    openfile_decref(wfile);
+    return res;
+  }
+
+  res = copyout(fds, fdsptr, sizeof(fds));
+  if (res) {
+    filetable_close(curproc->p_filetable, fds[0]);
+    filetable_close(curproc->p_filetable, fds[1]);
+    return res;
+  }
+  return 0;
+}
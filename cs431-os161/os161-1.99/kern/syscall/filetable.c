@@ -0,0 +1,81 @@
+/*
+ * Per-process file descriptor tables. See filetable.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <openfile.h>
+#include <filetable.h>
+
+struct filetable *
+filetable_create(void)
+{
+	struct filetable *ft;
+	int fd;
+
+	ft = kmalloc(sizeof(*ft));
+	if (ft == NULL) {
+		return NULL;
+	}
+	for (fd=0; fd<OPEN_MAX; fd++) {
+		ft->ft_openfiles[fd] = NULL;
+	}
+	return ft;
+}
+
+void
+filetable_destroy(struct filetable *ft)
+{
+	int fd;
+
+	KASSERT(ft != NULL);
+
+	for (fd=0; fd<OPEN_MAX; fd++) {
+		if (ft->ft_openfiles[fd] != NULL) {
+			openfile_decref(ft->ft_openfiles[fd]);
+			ft->ft_openfiles[fd] = NULL;
+		}
+	}
+	kfree(ft);
+}
+
+int
+filetable_get(struct filetable *ft, int fd, struct openfile **ret)
+{
+	if (fd < 0 || fd >= OPEN_MAX || ft->ft_openfiles[fd] == NULL) {
+		return EBADF;
+	}
+	*ret = ft->ft_openfiles[fd];
+	return 0;
+}
+
+int
+filetable_place(struct filetable *ft, struct openfile *file, int *fd)
+{
+	int i;
+
+	for (i=0; i<OPEN_MAX; i++) {
+		if (ft->ft_openfiles[i] == NULL) {
+			ft->ft_openfiles[i] = file;
+			*fd = i;
+			return 0;
+		}
+	}
+	return EMFILE;
+}
+
+int
+filetable_close(struct filetable *ft, int fd)
+{
+	struct openfile *file;
+	int result;
+
+	result = filetable_get(ft, fd, &file);
+	if (result) {
+		return result;
+	}
+	ft->ft_openfiles[fd] = NULL;
+	openfile_decref(file);
+	return 0;
+}
@@ -0,0 +1,121 @@
+/*
+ * Open file objects. See openfile.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <synch.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <openfile.h>
+
+/*
+ * Common constructor: wrap an already-open vnode.
+ */
+static
+struct openfile *
+openfile_create(struct vnode *vn, int openflags)
+{
+	struct openfile *file;
+
+	file = kmalloc(sizeof(*file));
+	if (file == NULL) {
+		return NULL;
+	}
+
+	file->of_offsetlock = lock_create("openfile");
+	if (file->of_offsetlock == NULL) {
+		kfree(file);
+		return NULL;
+	}
+
+	file->of_vnode = vn;
+	file->of_flags = openflags & (O_ACCMODE | O_APPEND);
+	file->of_offset = 0;
+	spinlock_init(&file->of_reflock);
+	file->of_refcount = 1;
+
+	return file;
+}
+
+int
+openfile_open(char *path, int openflags, mode_t mode, struct openfile **ret)
+{
+	struct openfile *file;
+	struct vnode *vn;
+	int result;
+
+	result = vfs_open(path, openflags, mode, &vn);
+	if (result) {
+		return result;
+	}
+
+	file = openfile_create(vn, openflags);
+	if (file == NULL) {
+		vfs_close(vn);
+		return ENOMEM;
+	}
+
+	*ret = file;
+	return 0;
+}
+
+int
+openfile_fromvnode(struct vnode *vn, int openflags, struct openfile **ret)
+{
+	struct openfile *file;
+
+	file = openfile_create(vn, openflags);
+	if (file == NULL) {
+		return ENOMEM;
+	}
+
+	/* Match what vfs_open would have done, so vfs_close balances. */
+	VOP_INCOPEN(vn);
+
+	*ret = file;
+	return 0;
+}
+
+void
+openfile_incref(struct openfile *file)
+{
+	spinlock_acquire(&file->of_reflock);
+	file->of_refcount++;
+	spinlock_release(&file->of_reflock);
+}
+
+void
+openfile_decref(struct openfile *file)
+{
+	bool last;
+
+	spinlock_acquire(&file->of_reflock);
+	KASSERT(file->of_refcount > 0);
+	file->of_refcount--;
+	last = (file->of_refcount == 0);
+	spinlock_release(&file->of_reflock);
+
+	if (!last) {
+		return;
+	}
+
+	vfs_close(file->of_vnode);
+	spinlock_cleanup(&file->of_reflock);
+	lock_destroy(file->of_offsetlock);
+	kfree(file);
+}
+
+bool
+openfile_readable(struct openfile *file)
+{
+	return (file->of_flags & O_ACCMODE) != O_WRONLY;
+}
+
+bool
+openfile_writable(struct openfile *file)
+{
+	return (file->of_flags & O_ACCMODE) != O_RDONLY;
+}
@@ -2,12 +2,17 @@
 #include <kern/errno.h>
 #include <kern/unistd.h>
 #include <kern/wait.h>
+#include <kern/fcntl.h>
+#include <limits.h>
 #include <lib.h>
 #include <syscall.h>
 #include <current.h>
 #include <proc.h>
 #include <thread.h>
 #include <addrspace.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <argbuf.h>
 #include <copyinout.h>
 
   /* this implementation of sys__exit does not do anything with the exit code */
@@ -92,3 +97,95 @@ sys_waitpid(pid_t pid,
   return(0);
 }
 
+
+/* handler for execv() system call                */
+/*
+ * The argument strings are copied out of the old address space once,
+ * into the shared argbuf staging area, and from there straight onto
+ * the new user stack. The old address space is kept until the new
+ * program is fully loaded, so on any error execv returns to the
+ * caller with its image intact.
+ */
+int
+sys_execv(userptr_t progname, userptr_t args)
+{
+  struct addrspace *as, *oldas;
+  struct argbuf *ab;
+  struct vnode *v;
+  vaddr_t entrypoint, stackptr;
+  userptr_t argv;
+  char *path;
+  int argc;
+  int result;
+
+  DEBUG(DB_SYSCALL,"Syscall: execv(%x,%x)\n",
+	(unsigned int)progname,(unsigned int)args);
+
+  path = kmalloc(PATH_MAX);
+  if (path == NULL) {
+    return ENOMEM;
+  }
+  result = copyinstr((const_userptr_t)progname, path, PATH_MAX, NULL);
+  if (result) {
+    kfree(path);
+    return result;
+  }
+
+  ab = argbuf_acquire();
+  result = argbuf_copyin(ab, args);
+  if (result) {
+    goto fail_args;
+  }
+
+  /* vfs_open may destroy path, but we have no further use for it */
+  result = vfs_open(path, O_RDONLY, 0, &v);
+  if (result) {
+    goto fail_args;
+  }
+
+  as = as_create();
+  if (as == NULL) {
+    vfs_close(v);
+    result = ENOMEM;
+    goto fail_args;
+  }
+
+  oldas = curproc_setas(as);
+  as_activate();
+
+  result = load_elf(v, &entrypoint);
+  vfs_close(v);
+  if (result) {
+    goto fail_as;
+  }
+
+  result = as_define_stack(as, &stackptr);
+  if (result) {
+    goto fail_as;
+  }
+
+  result = argbuf_copyout(ab, &stackptr, &argv);
+  if (result) {
+    goto fail_as;
+  }
+  argc = ab->ab_argc;
+  argbuf_release(ab);
+  kfree(path);
+
+  /* the point of no return: the old image is gone after this */
+  as_destroy(oldas);
+
+  enter_new_process(argc, argv, stackptr, entrypoint);
+  /* enter_new_process does not return */
+  panic("enter_new_process returned in sys_execv\n");
+  return EINVAL;
+
+ fail_as:
+  curproc_setas(oldas);
+  as_activate();
+  as_destroy(as);
+ fail_args:
+  argbuf_release(ab);
+  kfree(path);
+  return result;
+}
@@ -43,25 +43,39 @@
 #include <vm.h>
 #include <vfs.h>
 #include <syscall.h>
+#include <argbuf.h>
 #include <test.h>
 
 /*
- * Load program "progname" and start running it in usermode.
+ * Load program "progname" and start running it in usermode, passing
+ * it the NARGS strings in ARGS as argv[].
  * Does not return except on error.
  *
  * Calls vfs_open on progname and thus may destroy it.
  */
 int
-runprogram(char *progname)
+runprogram(char *progname, int nargs, char **args)
 {
 	struct addrspace *as;
+	struct argbuf *ab;
 	struct vnode *v;
 	vaddr_t entrypoint, stackptr;
+	userptr_t argv;
+	int argc;
 	int result;
 
+	/* Stage the arguments before anything else can fail. */
+	ab = argbuf_acquire();
+	result = argbuf_kcopyin(ab, nargs, args);
+	if (result) {
+		argbuf_release(ab);
+		return result;
+	}
+
 	/* Open the file. */
 	result = vfs_open(progname, O_RDONLY, 0, &v);
 	if (result) {
+		argbuf_release(ab);
 		return result;
 	}
 
@@ -72,6 +86,7 @@ runprogram(char *progname)
 	as = as_create();
 	if (as ==NULL) {
 		vfs_close(v);
+		argbuf_release(ab);
 		return ENOMEM;
 	}
 
@@ -84,6 +99,7 @@ runprogram(char *progname)
 	if (result) {
 		/* p_addrspace will go away when curproc is destroyed */
 		vfs_close(v);
+		argbuf_release(ab);
 		return result;
 	}
 
@@ -92,14 +108,23 @@ runprogram(char *progname)
 
 	/* Define the user stack in the address space */
 	result = as_define_stack(as, &stackptr);
+	if (result) {
+		/* p_addrspace will go away when curproc is destroyed */
+		argbuf_release(ab);
+		return result;
+	}
+
+	/* Put argv[] and its strings at the top of the stack. */
+	result = argbuf_copyout(ab, &stackptr, &argv);
+	argc = ab->ab_argc;
+	argbuf_release(ab);
 	if (result) {
 		/* p_addrspace will go away when curproc is destroyed */
 		return result;
 	}
 
 	/* Warp to user mode. */
-	enter_new_process(0 /*argc*/, NULL /*userspace addr of argv*/,
-			  stackptr, entrypoint);
+	enter_new_process(argc, argv, stackptr, entrypoint);
 	
 	/* enter_new_process does not return. */
 	panic("enter_new_process returned\n");
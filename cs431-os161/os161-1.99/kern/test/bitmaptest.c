@@ -28,6 +28,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
 #include <test.h>
@@ -37,7 +38,7 @@
 int
 bitmaptest(int nargs, char **args)
 {
-	struct bitmap *b;
+	struct bitmap *b, *sub;
 	char data[TESTSIZE];
 	uint32_t x;
 	int i;
@@ -101,6 +102,89 @@ bitmaptest(int nargs, char **args)
 		KASSERT(data[i]==0);
 	}
 
+	/* A range that starts and ends partway into a word */
+	bitmap_unmarkrange(b, 5, 300);
+	for (i=0; i<TESTSIZE; i++) {
+		if (i >= 5 && i < 305) {
+			KASSERT(bitmap_isset(b, i)==0);
+		}
+		else {
+			KASSERT(bitmap_isset(b, i));
+		}
+	}
+	bitmap_markrange(b, 5, 300);
+
+	sub = bitmap_create(TESTSIZE);
+	KASSERT(sub != NULL);
+	for (i=0; i<TESTSIZE; i++) {
+		data[i] = random()%2;
+		if (data[i]) {
+			bitmap_mark(sub, i);
+		}
+	}
+	bitmap_subtract(b, sub);
+	for (i=0; i<TESTSIZE; i++) {
+		KASSERT(bitmap_isset(sub, i)==0);
+		if (data[i]) {
+			KASSERT(bitmap_isset(b, i)==0);
+		}
+		else {
+			KASSERT(bitmap_isset(b, i));
+		}
+	}
+	bitmap_destroy(sub);
+	bitmap_destroy(b);
+
+	/* bitmap_alloc_near, on a map that starts empty */
+	b = bitmap_create(TESTSIZE);
+	KASSERT(b != NULL);
+
+	/* A free hint is taken itself */
+	KASSERT(bitmap_alloc_near(b, 200, &x)==0);
+	KASSERT(x == 200);
+
+	/* An allocated hint gives the next free bit above it */
+	bitmap_markrange(b, 100, 3);
+	KASSERT(bitmap_alloc_near(b, 100, &x)==0);
+	KASSERT(x == 103);
+
+	/* Nothing free from the hint to the end wraps to the start */
+	bitmap_markrange(b, 0, 10);
+	bitmap_markrange(b, 400, TESTSIZE - 400);
+	KASSERT(bitmap_alloc_near(b, 450, &x)==0);
+	KASSERT(x == 10);
+
+	/* Wrapping comes back to the hint's own word below the hint */
+	bitmap_unmarkrange(b, 100, 4);
+	bitmap_unmark(b, 200);
+	bitmap_markrange(b, 11, 260 - 11);
+	bitmap_markrange(b, 261, 400 - 261);
+	for (i=0; i<TESTSIZE; i++) {
+		KASSERT((bitmap_isset(b, i)==0) == (i == 260));
+	}
+	KASSERT(bitmap_alloc_near(b, 262, &x)==0);
+	KASSERT(x == 260);
+
+	/* The partial last word: only bits below nbits come back */
+	bitmap_unmark(b, TESTSIZE-1);
+	KASSERT(bitmap_alloc_near(b, TESTSIZE-10, &x)==0);
+	KASSERT(x == TESTSIZE-1);
+
+	/* Full: ENOSPC whatever the hint, including one past the end */
+	KASSERT(bitmap_alloc_near(b, 0, &x)==ENOSPC);
+	KASSERT(bitmap_alloc_near(b, 300, &x)==ENOSPC);
+	KASSERT(bitmap_alloc_near(b, TESTSIZE-1, &x)==ENOSPC);
+	KASSERT(bitmap_alloc_near(b, TESTSIZE+40, &x)==ENOSPC);
+
+	/* A hint past the end counts as zero */
+	bitmap_unmark(b, 5);
+	bitmap_unmark(b, 300);
+	KASSERT(bitmap_alloc_near(b, TESTSIZE+40, &x)==0);
+	KASSERT(x == 5);
+	KASSERT(bitmap_alloc_near(b, TESTSIZE+40, &x)==0);
+	KASSERT(x == 300);
+	bitmap_destroy(b);
+
 	kprintf("Bitmap test complete\n");
 	return 0;
 }
@@ -0,0 +1,249 @@
+/*
+ * Directory name lookup cache. See dcache.h.
+ *
+ * A fixed pool of DCACHE_SIZE entries, found through a hash of the
+ * directory and name, and recycled least recently used first.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <vfs.h>
+#include <dcache.h>
+
+#define DCACHE_SIZE	64
+#define DCACHE_HASH	31
+
+struct dcache_entry {
+	struct dcache_entry *de_hashnext;	/* hash chain */
+	struct dcache_entry *de_lruprev;	/* LRU list */
+	struct dcache_entry *de_lrunext;
+	struct vnode *de_dir;			/* NULL if unused */
+	ino_t de_ino;				/* what the name refers to */
+	bool de_negative;			/* name isn't there */
+	unsigned de_hash;			/* chain it's on */
+	char de_name[DCACHE_NAMELEN];
+};
+
+static struct dcache_entry dcache_entries[DCACHE_SIZE];
+static struct dcache_entry *dcache_hash[DCACHE_HASH];
+static struct dcache_entry *dcache_lruhead;	/* next to be reused */
+static struct dcache_entry *dcache_lrutail;	/* most recently used */
+
+static
+unsigned
+dcache_hashfn(struct vnode *dir, const char *name)
+{
+	unsigned h = (unsigned)(uintptr_t)dir >> 4;
+
+	while (*name) {
+		h = h*33 + (unsigned char)*name++;
+	}
+	return h % DCACHE_HASH;
+}
+
+static
+void
+dcache_lruremove(struct dcache_entry *de)
+{
+	if (de->de_lruprev != NULL) {
+		de->de_lruprev->de_lrunext = de->de_lrunext;
+	}
+	else {
+		dcache_lruhead = de->de_lrunext;
+	}
+	if (de->de_lrunext != NULL) {
+		de->de_lrunext->de_lruprev = de->de_lruprev;
+	}
+	else {
+		dcache_lrutail = de->de_lruprev;
+	}
+	de->de_lruprev = de->de_lrunext = NULL;
+}
+
+static
+void
+dcache_lruaddtail(struct dcache_entry *de)
+{
+	de->de_lruprev = dcache_lrutail;
+	de->de_lrunext = NULL;
+	if (dcache_lrutail != NULL) {
+		dcache_lrutail->de_lrunext = de;
+	}
+	else {
+		dcache_lruhead = de;
+	}
+	dcache_lrutail = de;
+}
+
+static
+void
+dcache_lruaddhead(struct dcache_entry *de)
+{
+	de->de_lruprev = NULL;
+	de->de_lrunext = dcache_lruhead;
+	if (dcache_lruhead != NULL) {
+		dcache_lruhead->de_lruprev = de;
+	}
+	else {
+		dcache_lrutail = de;
+	}
+	dcache_lruhead = de;
+}
+
+/*
+ * Take an entry off its hash chain and make it the next to be reused.
+ */
+static
+void
+dcache_drop(struct dcache_entry *de)
+{
+	struct dcache_entry **pp;
+
+	KASSERT(de->de_dir != NULL);
+	for (pp = &dcache_hash[de->de_hash]; *pp != de;
+	     pp = &(*pp)->de_hashnext) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = de->de_hashnext;
+	de->de_hashnext = NULL;
+	de->de_dir = NULL;
+
+	dcache_lruremove(de);
+	dcache_lruaddhead(de);
+}
+
+static
+struct dcache_entry *
+dcache_find(struct vnode *dir, const char *name, unsigned h)
+{
+	struct dcache_entry *de;
+
+	for (de = dcache_hash[h]; de != NULL; de = de->de_hashnext) {
+		if (de->de_dir == dir && !strcmp(de->de_name, name)) {
+			return de;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Common code for dcache_enter and dcache_enterneg.
+ */
+static
+void
+dcache_add(struct vnode *dir, const char *name, ino_t ino, bool negative)
+{
+	struct dcache_entry *de;
+	unsigned h;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (strlen(name) >= DCACHE_NAMELEN) {
+		return;
+	}
+	h = dcache_hashfn(dir, name);
+
+	de = dcache_find(dir, name, h);
+	if (de == NULL) {
+		de = dcache_lruhead;
+		if (de->de_dir != NULL) {
+			dcache_drop(de);
+		}
+		strcpy(de->de_name, name);
+		de->de_dir = dir;
+		de->de_hash = h;
+		de->de_hashnext = dcache_hash[h];
+		dcache_hash[h] = de;
+	}
+	de->de_ino = ino;
+	de->de_negative = negative;
+
+	dcache_lruremove(de);
+	dcache_lruaddtail(de);
+}
+
+////////////////////////////////////////////////////////////
+
+void
+dcache_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<DCACHE_HASH; i++) {
+		dcache_hash[i] = NULL;
+	}
+	dcache_lruhead = dcache_lrutail = NULL;
+	for (i=0; i<DCACHE_SIZE; i++) {
+		dcache_entries[i].de_hashnext = NULL;
+		dcache_entries[i].de_dir = NULL;
+		dcache_lruaddtail(&dcache_entries[i]);
+	}
+}
+
+int
+dcache_lookup(struct vnode *dir, const char *name, ino_t *ino)
+{
+	struct dcache_entry *de;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (strlen(name) >= DCACHE_NAMELEN) {
+		return DCACHE_MISS;
+	}
+
+	de = dcache_find(dir, name, dcache_hashfn(dir, name));
+	if (de == NULL) {
+		return DCACHE_MISS;
+	}
+
+	dcache_lruremove(de);
+	dcache_lruaddtail(de);
+
+	if (de->de_negative) {
+		return DCACHE_NEGATIVE;
+	}
+	*ino = de->de_ino;
+	return DCACHE_HIT;
+}
+
+void
+dcache_enter(struct vnode *dir, const char *name, ino_t ino)
+{
+	dcache_add(dir, name, ino, false);
+}
+
+void
+dcache_enterneg(struct vnode *dir, const char *name)
+{
+	dcache_add(dir, name, 0, true);
+}
+
+void
+dcache_purge(struct vnode *dir, const char *name)
+{
+	struct dcache_entry *de;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (strlen(name) >= DCACHE_NAMELEN) {
+		return;
+	}
+	de = dcache_find(dir, name, dcache_hashfn(dir, name));
+	if (de != NULL) {
+		dcache_drop(de);
+	}
+}
+
+void
+dcache_purgedir(struct vnode *dir)
+{
+	unsigned i;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	for (i=0; i<DCACHE_SIZE; i++) {
+		if (dcache_entries[i].de_dir == dir) {
+			dcache_drop(&dcache_entries[i]);
+		}
+	}
+}
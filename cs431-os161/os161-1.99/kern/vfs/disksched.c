@@ -0,0 +1,159 @@
+/*
+ * C-LOOK disk scheduling with merging and deadlines. See disksched.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <device.h>
+#include <disksched.h>
+
+/* Dispatches a run may wait before it goes ahead of everything else. */
+#define DISKSCHED_DEADLINE	32
+
+/* Longest run merging may build, in blocks. */
+#define DISKSCHED_MAXRUN	64
+
+/*
+ * Last request of a run.
+ */
+static
+struct devreq *
+disksched_last(struct devreq *run)
+{
+	while (run->dr_merged != NULL) {
+		run = run->dr_merged;
+	}
+	return run;
+}
+
+/*
+ * Block after the end of a run.
+ */
+static
+uint32_t
+disksched_end(struct devreq *run)
+{
+	struct devreq *last = disksched_last(run);
+
+	return last->dr_block + last->dr_nblocks;
+}
+
+/*
+ * Try to merge REQ into the run at *PP. Returns true if it was.
+ */
+static
+bool
+disksched_merge(struct devreq **pp, struct devreq *req)
+{
+	struct devreq *run = *pp;
+	uint32_t end;
+
+	if (run->dr_write != req->dr_write) {
+		return false;
+	}
+	end = disksched_end(run);
+	if (end - run->dr_block + req->dr_nblocks > DISKSCHED_MAXRUN) {
+		return false;
+	}
+
+	if (end == req->dr_block) {
+		/* on the end */
+		disksched_last(run)->dr_merged = req;
+		return true;
+	}
+	if (req->dr_block + req->dr_nblocks == run->dr_block) {
+		/* on the front; it takes over the run's place and age */
+		req->dr_merged = run;
+		req->dr_next = run->dr_next;
+		req->dr_deadline = run->dr_deadline;
+		run->dr_next = NULL;
+		*pp = req;
+		return true;
+	}
+	return false;
+}
+
+void
+disksched_init(struct disksched *ds)
+{
+	ds->ds_queue = NULL;
+	ds->ds_pos = 0;
+	ds->ds_ticket = 0;
+}
+
+/*
+ * Add a request, merging it with a pending run if it adjoins one.
+ */
+void
+disksched_add(struct disksched *ds, struct devreq *req)
+{
+	struct devreq **pp;
+
+	req->dr_next = NULL;
+	req->dr_merged = NULL;
+
+	/*
+	 * Runs that could take it on the end start below it, and the
+	 * one that could take it on the front is the first above it,
+	 * which is also where it goes if it can't be merged.
+	 */
+	for (pp = &ds->ds_queue; *pp != NULL; pp = &(*pp)->dr_next) {
+		if (disksched_merge(pp, req)) {
+			return;
+		}
+		if ((*pp)->dr_block > req->dr_block) {
+			break;
+		}
+	}
+
+	req->dr_deadline = ds->ds_ticket + DISKSCHED_DEADLINE;
+	req->dr_next = *pp;
+	*pp = req;
+}
+
+/*
+ * Take the next run to dispatch off the queue, or return NULL if
+ * there's nothing pending. The driver carries out the requests of
+ * the run one after the other, following dr_merged.
+ */
+struct devreq *
+disksched_next(struct disksched *ds)
+{
+	struct devreq **pp, **pick, *run;
+
+	if (ds->ds_queue == NULL) {
+		return NULL;
+	}
+	ds->ds_ticket++;
+
+	/* The most overdue run, if any is overdue. */
+	pick = NULL;
+	for (pp = &ds->ds_queue; *pp != NULL; pp = &(*pp)->dr_next) {
+		if ((int32_t)(ds->ds_ticket - (*pp)->dr_deadline) < 0) {
+			continue;
+		}
+		if (pick == NULL ||
+		    (int32_t)((*pp)->dr_deadline - (*pick)->dr_deadline) < 0) {
+			pick = pp;
+		}
+	}
+
+	/* Otherwise the next one up, wrapping around to the lowest. */
+	if (pick == NULL) {
+		for (pp = &ds->ds_queue; *pp != NULL; pp = &(*pp)->dr_next) {
+			if ((*pp)->dr_block >= ds->ds_pos) {
+				pick = pp;
+				break;
+			}
+		}
+		if (pick == NULL) {
+			pick = &ds->ds_queue;
+		}
+	}
+
+	run = *pick;
+	*pick = run->dr_next;
+	run->dr_next = NULL;
+	ds->ds_pos = disksched_end(run);
+	return run;
+}
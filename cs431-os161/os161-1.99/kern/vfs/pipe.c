@@ -0,0 +1,613 @@
+/*
+ * Anonymous pipes.
+ *
+ * A pipe is a PIPE_SIZE ring buffer with two vnodes, one per end,
+ * both embedded in struct pipe.
+ *
+ * The ring is single-producer/single-consumer: the reader only ever
+ * advances pp_head and the writer only ever advances pp_tail, both
+ * free-running counters, so bytes can be moved in and out without
+ * taking any lock the other side needs. Multiple readers (or
+ * writers) are serialized against each other by pp_rlock (pp_wlock),
+ * so there is never more than one of each inside the ring. Holding
+ * pp_wlock for a whole write also keeps writes from interleaving,
+ * which is more than PIPE_BUF atomicity requires.
+ *
+ * pp_lock and the two CVs are only touched on the slow path, when the
+ * ring is empty (reader) or full (writer). A side about to sleep
+ * first raises its pp_*sleeping flag and only then rechecks the ring;
+ * the other side publishes its index first and only then looks at the
+ * flag. System/161 memory is sequentially consistent, so one of the
+ * two always sees the other's update and no wakeup is lost.
+ *
+ * Wakeups are batched: a writer wakes a sleeping reader once at the
+ * end of each write() (or when it has to stop because the ring is
+ * full), not per chunk; a reader wakes a sleeping writer as soon as
+ * half the ring is free, and otherwise once at the end of each read().
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <stat.h>
+#include <uio.h>
+#include <synch.h>
+#include <vm.h>
+#include <vnode.h>
+#include <pipe.h>
+
+/* Ring size; must be a power of two. */
+#define PIPE_SIZE	PAGE_SIZE
+#define PIPE_MASK	(PIPE_SIZE - 1)
+
+struct pipe {
+	char *pp_buf;			/* PIPE_SIZE bytes */
+	volatile unsigned pp_head;	/* next byte to read (reader only) */
+	volatile unsigned pp_tail;	/* next byte to write (writer only) */
+
+	struct lock *pp_rlock;		/* one reader in the ring at a time */
+	struct lock *pp_wlock;		/* one writer in the ring at a time */
+
+	/* Slow path. */
+	struct lock *pp_lock;
+	struct cv *pp_readable;
+	struct cv *pp_writable;
+	volatile bool pp_rsleeping;
+	volatile bool pp_wsleeping;
+	volatile bool pp_rclosed;
+	volatile bool pp_wclosed;
+	unsigned pp_ends;		/* vnodes not yet reclaimed */
+
+	struct vnode pp_rvn;		/* read end */
+	struct vnode pp_wvn;		/* write end */
+};
+
+#define PIPE_USED(pp)	((pp)->pp_tail - (pp)->pp_head)
+#define PIPE_FREE(pp)	(PIPE_SIZE - PIPE_USED(pp))
+
+////////////////////////////////////////////////////////////
+// Ring buffer pages
+
+/*
+ * Freed ring buffers are kept here and reused rather than handed back
+ * to kfree: a PIPE_SIZE allocation comes from alloc_kpages(), and
+ * dumbvm never gets those pages back. Linked through the first word.
+ */
+static struct spinlock pipe_pagelock = SPINLOCK_INITIALIZER;
+static void *pipe_freepages;
+
+static
+char *
+pipe_getpage(void)
+{
+	void *page;
+
+	spinlock_acquire(&pipe_pagelock);
+	page = pipe_freepages;
+	if (page != NULL) {
+		pipe_freepages = *(void **)page;
+	}
+	spinlock_release(&pipe_pagelock);
+
+	if (page == NULL) {
+		page = kmalloc(PIPE_SIZE);
+	}
+	return page;
+}
+
+static
+void
+pipe_putpage(char *page)
+{
+	spinlock_acquire(&pipe_pagelock);
+	*(void **)page = pipe_freepages;
+	pipe_freepages = page;
+	spinlock_release(&pipe_pagelock);
+}
+
+////////////////////////////////////////////////////////////
+// Sleeping and waking
+
+/*
+ * Sleep until there is data to read or there are no more writers.
+ */
+static
+void
+pipe_waitdata(struct pipe *pp)
+{
+	lock_acquire(pp->pp_lock);
+	pp->pp_rsleeping = true;
+	while (PIPE_USED(pp) == 0 && !pp->pp_wclosed) {
+		cv_wait(pp->pp_readable, pp->pp_lock);
+	}
+	pp->pp_rsleeping = false;
+	lock_release(pp->pp_lock);
+}
+
+/*
+ * Sleep until there is room to write or there are no more readers.
+ */
+static
+void
+pipe_waitspace(struct pipe *pp)
+{
+	lock_acquire(pp->pp_lock);
+	pp->pp_wsleeping = true;
+	while (PIPE_FREE(pp) == 0 && !pp->pp_rclosed) {
+		cv_wait(pp->pp_writable, pp->pp_lock);
+	}
+	pp->pp_wsleeping = false;
+	lock_release(pp->pp_lock);
+}
+
+static
+void
+pipe_wakereader(struct pipe *pp)
+{
+	if (pp->pp_rsleeping) {
+		lock_acquire(pp->pp_lock);
+		cv_signal(pp->pp_readable, pp->pp_lock);
+		lock_release(pp->pp_lock);
+	}
+}
+
+static
+void
+pipe_wakewriter(struct pipe *pp)
+{
+	if (pp->pp_wsleeping) {
+		lock_acquire(pp->pp_lock);
+		cv_signal(pp->pp_writable, pp->pp_lock);
+		lock_release(pp->pp_lock);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Vnode operations
+
+static
+int
+pipe_open(struct vnode *v, int flags)
+{
+	(void)v;
+	(void)flags;
+
+	/* Pipes are only made by pipe(); nothing can look them up. */
+	return 0;
+}
+
+/*
+ * Called on the last close of one end. Let anyone sleeping on the
+ * other end know.
+ */
+static
+int
+pipe_close(struct vnode *v)
+{
+	struct pipe *pp = v->vn_data;
+
+	lock_acquire(pp->pp_lock);
+	if (v == &pp->pp_rvn) {
+		pp->pp_rclosed = true;
+		cv_broadcast(pp->pp_writable, pp->pp_lock);
+	}
+	else {
+		pp->pp_wclosed = true;
+		cv_broadcast(pp->pp_readable, pp->pp_lock);
+	}
+	lock_release(pp->pp_lock);
+	return 0;
+}
+
+static
+void
+pipe_destroy(struct pipe *pp)
+{
+	pipe_putpage(pp->pp_buf);
+	cv_destroy(pp->pp_writable);
+	cv_destroy(pp->pp_readable);
+	lock_destroy(pp->pp_lock);
+	lock_destroy(pp->pp_wlock);
+	lock_destroy(pp->pp_rlock);
+	kfree(pp);
+}
+
+/*
+ * Called when an end's refcount goes to zero. The pipe itself goes
+ * away with the second end.
+ */
+static
+int
+pipe_reclaim(struct vnode *v)
+{
+	struct pipe *pp = v->vn_data;
+	bool last;
+
+	VOP_CLEANUP(v);
+
+	lock_acquire(pp->pp_lock);
+	KASSERT(pp->pp_ends > 0);
+	pp->pp_ends--;
+	last = (pp->pp_ends == 0);
+	lock_release(pp->pp_lock);
+
+	if (last) {
+		pipe_destroy(pp);
+	}
+	return 0;
+}
+
+static
+int
+pipe_read(struct vnode *v, struct uio *uio)
+{
+	struct pipe *pp = v->vn_data;
+	unsigned head, used, off, len;
+	size_t before;
+	int result = 0;
+
+	KASSERT(uio->uio_rw == UIO_READ);
+	if (v != &pp->pp_rvn) {
+		return EBADF;
+	}
+	if (uio->uio_resid == 0) {
+		/* nothing asked for; don't wait for a writer */
+		return 0;
+	}
+
+	lock_acquire(pp->pp_rlock);
+
+	if (PIPE_USED(pp) == 0) {
+		pipe_waitdata(pp);
+	}
+
+	/* Take whatever is there, up to what was asked for. */
+	while (uio->uio_resid > 0) {
+		head = pp->pp_head;
+		used = pp->pp_tail - head;
+		if (used == 0) {
+			break;
+		}
+		off = head & PIPE_MASK;
+		len = PIPE_SIZE - off;
+		if (len > used) {
+			len = used;
+		}
+
+		before = uio->uio_resid;
+		result = uiomove(pp->pp_buf + off, len, uio);
+		pp->pp_head = head + (before - uio->uio_resid);
+		if (result) {
+			break;
+		}
+
+		if (PIPE_FREE(pp) >= PIPE_SIZE / 2) {
+			pipe_wakewriter(pp);
+		}
+	}
+
+	/* A writer still waiting can have whatever room there is now. */
+	pipe_wakewriter(pp);
+
+	lock_release(pp->pp_rlock);
+	return result;
+}
+
+static
+int
+pipe_write(struct vnode *v, struct uio *uio)
+{
+	struct pipe *pp = v->vn_data;
+	unsigned tail, space, off, len;
+	size_t before, start;
+	int result = 0;
+
+	KASSERT(uio->uio_rw == UIO_WRITE);
+	if (v != &pp->pp_wvn) {
+		return EBADF;
+	}
+
+	start = uio->uio_resid;
+	lock_acquire(pp->pp_wlock);
+
+	while (uio->uio_resid > 0) {
+		if (pp->pp_rclosed) {
+			result = EPIPE;
+			break;
+		}
+
+		tail = pp->pp_tail;
+		space = PIPE_SIZE - (tail - pp->pp_head);
+		if (space == 0) {
+			/* Full: let the reader at what we have, then wait. */
+			pipe_wakereader(pp);
+			pipe_waitspace(pp);
+			continue;
+		}
+		off = tail & PIPE_MASK;
+		len = PIPE_SIZE - off;
+		if (len > space) {
+			len = space;
+		}
+
+		before = uio->uio_resid;
+		result = uiomove(pp->pp_buf + off, len, uio);
+		pp->pp_tail = tail + (before - uio->uio_resid);
+		if (result) {
+			break;
+		}
+	}
+
+	pipe_wakereader(pp);
+	lock_release(pp->pp_wlock);
+
+	/* A partial write still succeeds; report the error next time. */
+	if (result == EPIPE && uio->uio_resid < start) {
+		result = 0;
+	}
+	return result;
+}
+
+static
+int
+pipe_stat(struct vnode *v, struct stat *statbuf)
+{
+	struct pipe *pp = v->vn_data;
+
+	bzero(statbuf, sizeof(struct stat));
+	statbuf->st_mode = S_IFIFO | 0600;
+	statbuf->st_nlink = 1;
+	statbuf->st_size = PIPE_USED(pp);
+	statbuf->st_blksize = PIPE_SIZE;
+	return 0;
+}
+
+static
+int
+pipe_gettype(struct vnode *v, mode_t *ret)
+{
+	(void)v;
+	*ret = S_IFIFO;
+	return 0;
+}
+
+static
+int
+pipe_tryseek(struct vnode *v, off_t pos)
+{
+	(void)v;
+	(void)pos;
+	return ESPIPE;
+}
+
+/*
+ * Operations that are not meaningful on pipes.
+ */
+
+static
+int
+pipe_isnotfile(struct vnode *v, struct uio *uio)
+{
+	(void)v;
+	(void)uio;
+	return EINVAL;
+}
+
+static
+int
+pipe_ioctl(struct vnode *v, int op, userptr_t data)
+{
+	(void)v;
+	(void)op;
+	(void)data;
+	return EINVAL;
+}
+
+static
+int
+pipe_fsync(struct vnode *v)
+{
+	(void)v;
+	return 0;
+}
+
+static
+int
+pipe_mmap(struct vnode *v)
+{
+	(void)v;
+	return ENODEV;
+}
+
+static
+int
+pipe_truncate(struct vnode *v, off_t len)
+{
+	(void)v;
+	(void)len;
+	return EINVAL;
+}
+
+static
+int
+pipe_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
+	   struct vnode **result)
+{
+	(void)v;
+	(void)name;
+	(void)excl;
+	(void)mode;
+	(void)result;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_symlink(struct vnode *v, const char *contents, const char *name)
+{
+	(void)v;
+	(void)contents;
+	(void)name;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_mkdir(struct vnode *v, const char *name, mode_t mode)
+{
+	(void)v;
+	(void)name;
+	(void)mode;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_link(struct vnode *v, const char *name, struct vnode *file)
+{
+	(void)v;
+	(void)name;
+	(void)file;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_nameop(struct vnode *v, const char *name)
+{
+	(void)v;
+	(void)name;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_rename(struct vnode *v1, const char *n1, struct vnode *v2, const char *n2)
+{
+	(void)v1;
+	(void)n1;
+	(void)v2;
+	(void)n2;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_lookup(struct vnode *v, char *pathname, struct vnode **result)
+{
+	(void)v;
+	(void)pathname;
+	(void)result;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_lookparent(struct vnode *v, char *pathname, struct vnode **result,
+		char *buf, size_t len)
+{
+	(void)v;
+	(void)pathname;
+	(void)result;
+	(void)buf;
+	(void)len;
+	return ENOTDIR;
+}
+
+static const struct vnode_ops pipe_vnode_ops = {
+	VOP_MAGIC,
+
+	pipe_open,
+	pipe_close,
+	pipe_reclaim,
+	pipe_read,
+	pipe_isnotfile,	/* readlink */
+	pipe_isnotfile,	/* getdirentry */
+	pipe_write,
+	pipe_ioctl,
+	pipe_stat,
+	pipe_gettype,
+	pipe_tryseek,
+	pipe_fsync,
+	pipe_mmap,
+	pipe_truncate,
+	pipe_isnotfile,	/* namefile */
+	pipe_creat,
+	pipe_symlink,
+	pipe_mkdir,
+	pipe_link,
+	pipe_nameop,	/* remove */
+	pipe_nameop,	/* rmdir */
+	pipe_rename,
+	pipe_lookup,
+	pipe_lookparent,
+};
+
+////////////////////////////////////////////////////////////
+// Creation
+
+int
+pipe_create(struct vnode **readend, struct vnode **writeend)
+{
+	struct pipe *pp;
+
+	pp = kmalloc(sizeof(*pp));
+	if (pp == NULL) {
+		return ENOMEM;
+	}
+
+	pp->pp_buf = pipe_getpage();
+	if (pp->pp_buf == NULL) {
+		goto fail_pp;
+	}
+	pp->pp_rlock = lock_create("pipe-read");
+	if (pp->pp_rlock == NULL) {
+		goto fail_buf;
+	}
+	pp->pp_wlock = lock_create("pipe-write");
+	if (pp->pp_wlock == NULL) {
+		goto fail_rlock;
+	}
+	pp->pp_lock = lock_create("pipe");
+	if (pp->pp_lock == NULL) {
+		goto fail_wlock;
+	}
+	pp->pp_readable = cv_create("pipe-readable");
+	if (pp->pp_readable == NULL) {
+		goto fail_lock;
+	}
+	pp->pp_writable = cv_create("pipe-writable");
+	if (pp->pp_writable == NULL) {
+		goto fail_readable;
+	}
+
+	pp->pp_head = 0;
+	pp->pp_tail = 0;
+	pp->pp_rsleeping = false;
+	pp->pp_wsleeping = false;
+	pp->pp_rclosed = false;
+	pp->pp_wclosed = false;
+	pp->pp_ends = 2;
+
+	VOP_INIT(&pp->pp_rvn, &pipe_vnode_ops, NULL, pp);
+	VOP_INIT(&pp->pp_wvn, &pipe_vnode_ops, NULL, pp);
+
+	*readend = &pp->pp_rvn;
+	*writeend = &pp->pp_wvn;
+	return 0;
+
+ fail_readable:
+	cv_destroy(pp->pp_readable);
+ fail_lock:
+	lock_destroy(pp->pp_lock);
+ fail_wlock:
+	lock_destroy(pp->pp_wlock);
+ fail_rlock:
+	lock_destroy(pp->pp_rlock);
+ fail_buf:
+	pipe_putpage(pp->pp_buf);
+ fail_pp:
+	kfree(pp);
+	return ENOMEM;
+}
@@ -39,10 +39,12 @@
 #include <lib.h>
 #include <array.h>
 #include <synch.h>
+#include <thread.h>
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
 #include <device.h>
+#include <dcache.h>
 
 /*
  * Structure for a single named device.
@@ -109,6 +111,8 @@ vfs_bootstrap(void)
 	}
 	vfs_biglock_depth = 0;
 
+	dcache_bootstrap();
+
 	devnull_create();
 }
 
@@ -145,6 +149,40 @@ vfs_biglock_do_i_hold(void)
 	return lock_do_i_hold(vfs_biglock);
 }
 
+bool
+vfs_biglock_wait(struct cv *cv)
+{
+	KASSERT(lock_do_i_hold(vfs_biglock));
+	if (vfs_biglock_depth != 1) {
+		return false;
+	}
+	vfs_biglock_depth = 0;
+	cv_wait(cv, vfs_biglock);
+	vfs_biglock_depth = 1;
+	return true;
+}
+
+void
+vfs_biglock_broadcast(struct cv *cv)
+{
+	cv_broadcast(cv, vfs_biglock);
+}
+
+bool
+vfs_biglock_yield(void)
+{
+	KASSERT(lock_do_i_hold(vfs_biglock));
+	if (vfs_biglock_depth != 1) {
+		return false;
+	}
+	vfs_biglock_depth = 0;
+	lock_release(vfs_biglock);
+	thread_yield();
+	lock_acquire(vfs_biglock);
+	vfs_biglock_depth = 1;
+	return true;
+}
+
 /*
  * Global sync function - call FSOP_SYNC on all devices.
  */
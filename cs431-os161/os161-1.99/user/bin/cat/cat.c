@@ -38,6 +38,9 @@
 
 
 
+/* Bytes to ask sendfile for at a time. */
+#define CATCHUNK (64*1024)
+
 /* Print a file that's already been opened. */
 static
 void
@@ -45,6 +48,21 @@ docat(const char *name, int fd)
 {
 	char buf[1024];
 	int len, wr, wrtot;
+	int copied = 0;
+
+	/*
+	 * Let the kernel move the data if it can. If sendfile fails
+	 * before copying anything, fall back to read and write.
+	 */
+	while ((len = sendfile(STDOUT_FILENO, fd, NULL, CATCHUNK))>0) {
+		copied = 1;
+	}
+	if (len==0) {
+		return;
+	}
+	if (copied) {
+		err(1, "%s", name);
+	}
 
 	/*
 	 * As long as we get more than zero bytes, we haven't hit EOF.
@@ -36,6 +36,9 @@
  */
 
 
+/* Bytes to ask sendfile for at a time. */
+#define COPYCHUNK (64*1024)
+
 /* Copy one file to another. */
 static
 void
@@ -45,6 +48,7 @@ copy(const char *from, const char *to)
 	int tofd;
 	char buf[1024];
 	int len, wr, wrtot;
+	int copied = 0;
 
 	/*
 	 * Open the files, and give up if they won't open
@@ -58,6 +62,20 @@ copy(const char *from, const char *to)
 		err(1, "%s", to);
 	}
 
+	/*
+	 * Let the kernel move the data if it can. If sendfile fails
+	 * before copying anything, fall back to read and write.
+	 */
+	while ((len = sendfile(tofd, fromfd, NULL, COPYCHUNK))>0) {
+		copied = 1;
+	}
+	if (len==0) {
+		goto done;
+	}
+	if (copied) {
+		err(1, "%s", to);
+	}
+
 	/*
 	 * As long as we get more than zero bytes, we haven't hit EOF.
 	 * Zero means EOF. Less than zero means an error occurred.
@@ -85,6 +103,7 @@ copy(const char *from, const char *to)
 		err(1, "%s", from);
 	}
 
+ done:
 	if (close(fromfd) < 0) {
 		err(1, "%s: close", from);
 	}
@@ -0,0 +1,15 @@
+#ifndef _SYS_SYSBATCH_H_
+#define _SYS_SYSBATCH_H_
+
+/*
+ * Batched system call submission; see <kern/sysbatch.h>. Returns the
+ * number of entries run, or -1 if none could be.
+ */
+
+#include <sys/types.h>
+#include <kern/sysbatch.h>
+#include <kern/syscall.h>
+
+int sysbatch(struct sysbatch *ents, int n);
+
+#endif /* _SYS_SYSBATCH_H_ */
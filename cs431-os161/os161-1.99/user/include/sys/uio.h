@@ -0,0 +1,16 @@
+#ifndef _SYS_UIO_H_
+#define _SYS_UIO_H_
+
+/*
+ * Scatter/gather I/O: readv and writev transfer through IOVCNT
+ * buffers (at most IOV_MAX) in order, as one contiguous read or
+ * write on the file.
+ */
+
+#include <sys/types.h>
+#include <kern/iovec.h>
+
+int readv(int filehandle, const struct iovec *iov, int iovcnt);
+int writev(int filehandle, const struct iovec *iov, int iovcnt);
+
+#endif /* _SYS_UIO_H_ */
@@ -0,0 +1,126 @@
+/*
+ * batchtest - checks of sysbatch.
+ *
+ * Runs a write, lseek and read of a file as one batch and checks each
+ * entry's result; checks that a batch stops after the first entry
+ * that fails; and checks that _exit, execv and sysbatch itself are
+ * refused.
+ *
+ * Usage: batchtest [file]
+ */
+
+#include <sys/sysbatch.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <stdio.h>
+
+#define NOTRUN (-1)
+
+static
+void
+setent(struct sysbatch *sb, int callno, uint32_t a0, uint32_t a1,
+       uint32_t a2, uint32_t a3, uint32_t a4)
+{
+	sb->sb_callno = callno;
+	sb->sb_args[0] = a0;
+	sb->sb_args[1] = a1;
+	sb->sb_args[2] = a2;
+	sb->sb_args[3] = a3;
+	sb->sb_args[4] = a4;
+	sb->sb_args[5] = 0;
+	sb->sb_err = NOTRUN;
+	sb->sb_retval = 0;
+}
+
+/*
+ * One entry that must be refused without being run.
+ */
+static
+void
+refused(int callno, const char *name)
+{
+	struct sysbatch sb;
+	int r;
+
+	setent(&sb, callno, 0, 0, 0, 0, 0);
+	r = sysbatch(&sb, 1);
+	if (r != 1) {
+		err(1, "sysbatch of %s returned %d", name, r);
+	}
+	if (sb.sb_err != EINVAL) {
+		errx(1, "%s in a batch: error %d, expected EINVAL",
+		     name, sb.sb_err);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *file = argc > 1 ? argv[1] : "batchtest.dat";
+	struct sysbatch ents[3];
+	char buf[8];
+	int fd, r;
+
+	fd = open(file, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: open", file);
+	}
+
+	/* write, seek back (offset in a2/a3, whence on the stack), read */
+	setent(&ents[0], SYS_write, fd, (uint32_t)"hello", 5, 0, 0);
+	setent(&ents[1], SYS_lseek, fd, 0, 0, 0, SEEK_SET);
+	setent(&ents[2], SYS_read, fd, (uint32_t)buf, 5, 0, 0);
+	r = sysbatch(ents, 3);
+	if (r != 3) {
+		err(1, "sysbatch returned %d", r);
+	}
+	if (ents[0].sb_err != 0 || ents[0].sb_retval != 5) {
+		errx(1, "write: error %d, result %ld", ents[0].sb_err,
+		     (long)ents[0].sb_retval);
+	}
+	if (ents[1].sb_err != 0 || ents[1].sb_retval != 0) {
+		errx(1, "lseek: error %d, result %ld", ents[1].sb_err,
+		     (long)ents[1].sb_retval);
+	}
+	if (ents[2].sb_err != 0 || ents[2].sb_retval != 5) {
+		errx(1, "read: error %d, result %ld", ents[2].sb_err,
+		     (long)ents[2].sb_retval);
+	}
+	if (memcmp(buf, "hello", 5) != 0) {
+		errx(1, "read: data mismatch");
+	}
+
+	/* the batch stops at the failed read; the last write never runs */
+	setent(&ents[0], SYS_write, fd, (uint32_t)"abc", 3, 0, 0);
+	setent(&ents[1], SYS_read, -1, (uint32_t)buf, 1, 0, 0);
+	setent(&ents[2], SYS_write, fd, (uint32_t)"def", 3, 0, 0);
+	r = sysbatch(ents, 3);
+	if (r != 2) {
+		errx(1, "failing batch returned %d, expected 2", r);
+	}
+	if (ents[0].sb_err != 0 || ents[0].sb_retval != 3) {
+		errx(1, "write before failure: error %d", ents[0].sb_err);
+	}
+	if (ents[1].sb_err != EBADF) {
+		errx(1, "read of bad fd: error %d, expected EBADF",
+		     ents[1].sb_err);
+	}
+	if (ents[2].sb_err != NOTRUN) {
+		errx(1, "entry after the failure was run");
+	}
+	if (lseek(fd, 0, SEEK_END) != 8) {
+		errx(1, "file has the wrong size after the failing batch");
+	}
+
+	refused(SYS__exit, "_exit");
+	refused(SYS_execv, "execv");
+	refused(SYS_sysbatch, "sysbatch");
+
+	close(fd);
+	printf("batchtest: passed\n");
+	return 0;
+}
@@ -0,0 +1,95 @@
+/*
+ * iovtest - checks of readv/writev and pread/pwrite on a file.
+ *
+ * Writes a file with writev using more iovecs than the kernel handles
+ * per batch, reads it back with readv in a different split, and then
+ * checks that pread and pwrite work at explicit offsets without
+ * moving the seek pointer.
+ *
+ * Usage: iovtest [file]
+ */
+
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <err.h>
+#include <stdio.h>
+
+#define NIOV 40
+#define PIECE 37
+#define TOTAL (NIOV * PIECE)
+
+static char wbuf[TOTAL];
+static char rbuf[TOTAL];
+
+int
+main(int argc, char *argv[])
+{
+	const char *file = argc > 1 ? argv[1] : "iovtest.dat";
+	struct iovec iov[NIOV];
+	char tmp[16];
+	off_t pos;
+	int fd, r, i;
+
+	for (i=0; i<TOTAL; i++) {
+		wbuf[i] = (char)(i * 13 + 5);
+	}
+
+	fd = open(file, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: open", file);
+	}
+
+	for (i=0; i<NIOV; i++) {
+		iov[i].iov_base = wbuf + i * PIECE;
+		iov[i].iov_len = PIECE;
+	}
+	r = writev(fd, iov, NIOV);
+	if (r != TOTAL) {
+		err(1, "writev returned %d", r);
+	}
+
+	if (lseek(fd, 0, SEEK_SET) != 0) {
+		err(1, "lseek");
+	}
+
+	/* read back as two uneven pieces */
+	iov[0].iov_base = rbuf;
+	iov[0].iov_len = 100;
+	iov[1].iov_base = rbuf + 100;
+	iov[1].iov_len = TOTAL - 100;
+	r = readv(fd, iov, 2);
+	if (r != TOTAL) {
+		err(1, "readv returned %d", r);
+	}
+	if (memcmp(wbuf, rbuf, TOTAL) != 0) {
+		errx(1, "readv: data mismatch");
+	}
+
+	/* positioned I/O must leave the seek pointer alone */
+	r = pwrite(fd, "0123456789", 10, 50);
+	if (r != 10) {
+		err(1, "pwrite returned %d", r);
+	}
+	memcpy(wbuf + 50, "0123456789", 10);
+	r = pread(fd, tmp, 10, 50);
+	if (r != 10 || memcmp(tmp, "0123456789", 10) != 0) {
+		errx(1, "pread: data mismatch");
+	}
+	pos = lseek(fd, 0, SEEK_CUR);
+	if (pos != TOTAL) {
+		errx(1, "seek pointer moved to %ld", (long)pos);
+	}
+
+	if (pread(fd, tmp, 10, -1) >= 0) {
+		errx(1, "pread at negative offset succeeded");
+	}
+	if (readv(fd, iov, 0) >= 0) {
+		errx(1, "readv with no iovecs succeeded");
+	}
+
+	close(fd);
+	printf("iovtest: passed\n");
+	return 0;
+}
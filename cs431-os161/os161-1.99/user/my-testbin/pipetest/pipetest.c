@@ -0,0 +1,107 @@
+/*
+ * pipetest - basic checks of pipe() in a single process.
+ *
+ * Pushes data through a pipe in several sizes, including chunks that
+ * wrap around the end of the kernel's ring buffer, and checks that
+ * it comes out intact and in order. Then checks EOF once the write
+ * end is closed and EPIPE once the read end is closed.
+ *
+ * Usage: pipetest
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <stdio.h>
+
+/* Small enough that a single process can never fill the pipe. */
+#define CHUNK 1000
+#define ROUNDS 20
+
+static char wbuf[CHUNK];
+static char rbuf[CHUNK];
+
+static
+void
+fill(char *buf, size_t len, unsigned seed)
+{
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		buf[i] = (char)(seed + i * 7);
+	}
+}
+
+int
+main(void)
+{
+	int fds[2];
+	int r, i, len, got;
+
+	if (pipe(fds) < 0) {
+		err(1, "pipe");
+	}
+	if (fds[0] == fds[1]) {
+		errx(1, "pipe returned the same descriptor twice");
+	}
+
+	for (i=0; i<ROUNDS; i++) {
+		/* Vary the size so the ring's head and tail wander around. */
+		len = CHUNK - i * 37;
+		fill(wbuf, len, i);
+
+		r = write(fds[1], wbuf, len);
+		if (r < 0) {
+			err(1, "write");
+		}
+		if (r != len) {
+			errx(1, "short write: %d of %d", r, len);
+		}
+
+		got = 0;
+		while (got < len) {
+			r = read(fds[0], rbuf + got, len - got);
+			if (r < 0) {
+				err(1, "read");
+			}
+			if (r == 0) {
+				errx(1, "unexpected EOF");
+			}
+			got += r;
+		}
+		if (memcmp(wbuf, rbuf, len) != 0) {
+			errx(1, "round %d: data mismatch", i);
+		}
+	}
+
+	/* Leave something behind, close the write end, drain, see EOF. */
+	if (write(fds[1], "x", 1) != 1) {
+		err(1, "write");
+	}
+	if (close(fds[1]) < 0) {
+		err(1, "close");
+	}
+	if (read(fds[0], rbuf, sizeof(rbuf)) != 1 || rbuf[0] != 'x') {
+		errx(1, "lost data written before close");
+	}
+	r = read(fds[0], rbuf, sizeof(rbuf));
+	if (r != 0) {
+		errx(1, "expected EOF, got %d", r);
+	}
+	close(fds[0]);
+
+	/* With no reader left, writing should fail with EPIPE. */
+	if (pipe(fds) < 0) {
+		err(1, "pipe");
+	}
+	close(fds[0]);
+	r = write(fds[1], wbuf, 10);
+	if (r >= 0 || errno != EPIPE) {
+		errx(1, "write with no reader: expected EPIPE");
+	}
+	close(fds[1]);
+
+	printf("pipetest: passed\n");
+	return 0;
+}
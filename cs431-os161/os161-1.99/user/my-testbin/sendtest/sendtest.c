@@ -0,0 +1,117 @@
+/*
+ * sendtest - checks of sendfile between files.
+ *
+ * Copies a file to another with sendfile through the seek pointers
+ * and checks the copy; checks that asking for more than is left gives
+ * a short count; and checks that an explicit offset is read from and
+ * updated without moving the input's seek pointer.
+ *
+ * Usage: sendtest [file]
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <err.h>
+#include <stdio.h>
+
+#define TOTAL 5000
+#define CHUNK 1536
+
+static char wbuf[TOTAL];
+static char rbuf[TOTAL];
+
+static
+int
+openfile(const char *name)
+{
+	int fd;
+
+	fd = open(name, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: open", name);
+	}
+	return fd;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *file = argc > 1 ? argv[1] : "sendtest.dat";
+	char copyname[64];
+	off_t pos;
+	int in, out, r, tot, i;
+
+	snprintf(copyname, sizeof(copyname), "%s.copy", file);
+
+	for (i=0; i<TOTAL; i++) {
+		wbuf[i] = (char)(i * 7 + 3);
+	}
+
+	in = openfile(file);
+	if (write(in, wbuf, TOTAL) != TOTAL) {
+		err(1, "%s: write", file);
+	}
+	if (lseek(in, 0, SEEK_SET) != 0) {
+		err(1, "lseek");
+	}
+	out = openfile(copyname);
+
+	/* whole file, in chunks, through both seek pointers */
+	tot = 0;
+	while ((r = sendfile(out, in, NULL, CHUNK)) > 0) {
+		tot += r;
+	}
+	if (r < 0) {
+		err(1, "sendfile");
+	}
+	if (tot != TOTAL) {
+		errx(1, "copied %d bytes, expected %d", tot, TOTAL);
+	}
+	if (lseek(in, 0, SEEK_CUR) != TOTAL) {
+		errx(1, "input seek pointer not at EOF");
+	}
+	if (lseek(out, 0, SEEK_SET) != 0 || read(out, rbuf, TOTAL) != TOTAL) {
+		err(1, "%s: read back", copyname);
+	}
+	if (memcmp(wbuf, rbuf, TOTAL) != 0) {
+		errx(1, "copy: data mismatch");
+	}
+
+	/* more than is left comes back short */
+	if (lseek(in, TOTAL - 10, SEEK_SET) != TOTAL - 10) {
+		err(1, "lseek");
+	}
+	r = sendfile(out, in, NULL, 100);
+	if (r != 10) {
+		errx(1, "sendfile near EOF returned %d, expected 10", r);
+	}
+
+	/* explicit offset: read from and updated, seek pointer left alone */
+	if (lseek(in, 0, SEEK_SET) != 0 || lseek(out, 0, SEEK_SET) != 0) {
+		err(1, "lseek");
+	}
+	pos = 1000;
+	r = sendfile(out, in, &pos, 100);
+	if (r != 100) {
+		errx(1, "sendfile at offset returned %d", r);
+	}
+	if (pos != 1100) {
+		errx(1, "offset is %ld after sendfile, expected 1100",
+		     (long)pos);
+	}
+	if (lseek(in, 0, SEEK_CUR) != 0) {
+		errx(1, "sendfile with an offset moved the seek pointer");
+	}
+	if (lseek(out, 0, SEEK_SET) != 0 || read(out, rbuf, 100) != 100) {
+		err(1, "%s: read back", copyname);
+	}
+	if (memcmp(wbuf + 1000, rbuf, 100) != 0) {
+		errx(1, "sendfile at offset: data mismatch");
+	}
+
+	close(in);
+	close(out);
+	printf("sendtest: passed\n");
+	return 0;
+}
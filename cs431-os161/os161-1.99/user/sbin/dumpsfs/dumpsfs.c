@@ -56,18 +56,62 @@
 
 #include "disk.h"
 
+/* Block size of the volume */
+static uint32_t blocksize;
+static uint32_t inoperblock;
+
+static
+void
+dumpjournal(uint32_t jstart, uint32_t jblocks)
+{
+	struct sfs_jheader jh;
+
+	diskreadhead(&jh, jstart);
+	printf("Journal: blocks %u-%u", jstart, jstart + jblocks - 1);
+	if (SWAPL(jh.jh_magic) != SFS_JMAGIC) {
+		printf(", bad magic number\n");
+		return;
+	}
+	printf(", last transaction %u", SWAPL(jh.jh_seq));
+	if (jh.jh_count != 0) {
+		printf(", %u blocks to replay", SWAPL(jh.jh_count));
+	}
+	printf("\n");
+}
+
 static
 uint32_t
 dumpsb(void)
 {
 	struct sfs_super sp;
-	diskread(&sp, SFS_SB_LOCATION);
+	diskreadhead(&sp, SFS_SB_LOCATION);
 	if (SWAPL(sp.sp_magic) != SFS_MAGIC) {
 		errx(1, "Not an sfs filesystem");
 	}
+	blocksize = sp.sp_blocksize == 0 ? SFS_BLOCKSIZE :
+		SWAPL(sp.sp_blocksize);
+	if (blocksize < SFS_BLOCKSIZE || blocksize > SFS_MAXBLOCKSIZE ||
+	    (blocksize & (blocksize - 1)) != 0) {
+		errx(1, "Invalid block size %u", blocksize);
+	}
+	disksetblocksize(blocksize);
+	if (sp.sp_inodesize == 0) {
+		inoperblock = 1;
+	}
+	else if (SWAPL(sp.sp_inodesize) == SFS_INODESIZE) {
+		inoperblock = blocksize / SFS_INODESIZE;
+	}
+	else {
+		errx(1, "Invalid inode size %u", SWAPL(sp.sp_inodesize));
+	}
+
 	sp.sp_volname[sizeof(sp.sp_volname)-1] = 0;
-	printf("Volume name: %-40s  %u blocks\n", sp.sp_volname, 
-	       SWAPL(sp.sp_nblocks));
+	printf("Volume name: %-40s  %u blocks of %u bytes\n", sp.sp_volname,
+	       SWAPL(sp.sp_nblocks), blocksize);
+	printf("    %u inodes per inode block\n", inoperblock);
+	if (sp.sp_jblocks != 0) {
+		dumpjournal(SWAPL(sp.sp_jstart), SWAPL(sp.sp_jblocks));
+	}
 
 	return SWAPL(sp.sp_nblocks);
 }
@@ -76,8 +120,8 @@ static
 void
 dodirblock(uint32_t block)
 {
-	struct sfs_dir sds[SFS_BLOCKSIZE/sizeof(struct sfs_dir)];
-	int nsds = SFS_BLOCKSIZE/sizeof(struct sfs_dir);
+	struct sfs_dir sds[SFS_MAXBLOCKSIZE/sizeof(struct sfs_dir)];
+	int nsds = blocksize/sizeof(struct sfs_dir);
 	int i;
 
 	diskread(&sds, block);
@@ -95,16 +139,111 @@ dodirblock(uint32_t block)
 	}
 }
 
+/*
+ * Call FN (if not NULL) for each data block under the tree of
+ * indirect blocks rooted at BLOCK, INDIRECTION levels deep (0 for a
+ * data block), counting them in *NBLOCKSP and the indirect blocks
+ * in *NIBLOCKSP.
+ */
+static
+void
+doblocks(uint32_t block, int indirection, void (*fn)(uint32_t),
+	 uint32_t *nblocksp, uint32_t *niblocksp)
+{
+	uint32_t ib[SFS_MAXBLOCKSIZE/sizeof(uint32_t)];
+	uint32_t i;
+
+	if (block == 0) {
+		return;
+	}
+	if (indirection == 0) {
+		if (fn != NULL) {
+			fn(block);
+		}
+		(*nblocksp)++;
+		return;
+	}
+
+	diskread(&ib, block);
+	(*niblocksp)++;
+	for (i=0; i<SFS_DBPERIDB(blocksize); i++) {
+		doblocks(SWAPL(ib[i]), indirection-1, fn,
+			 nblocksp, niblocksp);
+	}
+}
+
+/*
+ * Same, for all the blocks of an inode.
+ */
+static
+void
+doinodeblocks(const struct sfs_inode *sfi, void (*fn)(uint32_t),
+	      uint32_t *nblocksp, uint32_t *niblocksp)
+{
+	int i;
+
+	*nblocksp = *niblocksp = 0;
+	for (i=0; i<SFS_NDIRECT; i++) {
+		doblocks(SWAPL(sfi->sfi_direct[i]), 0, fn,
+			 nblocksp, niblocksp);
+	}
+	doblocks(SWAPL(sfi->sfi_indirect), 1, fn, nblocksp, niblocksp);
+	doblocks(SWAPL(sfi->sfi_dindirect), 2, fn, nblocksp, niblocksp);
+	doblocks(SWAPL(sfi->sfi_tindirect), 3, fn, nblocksp, niblocksp);
+}
+
+/*
+ * Print the shape of a directory index: how long the hash chains are.
+ */
+static
+void
+dumpdirindex(uint32_t indexblock)
+{
+	struct sfs_dirindex di;
+	struct sfs_dirchain dc;
+	uint32_t block, nents, nchainblocks, nfree, longest;
+	int i;
+
+	diskreadhead(&di, indexblock);
+
+	nents = nchainblocks = nfree = longest = 0;
+	for (i=0; i<=SFS_DIRHASH_NBUCKETS; i++) {
+		uint32_t len = 0;
+
+		block = (i < SFS_DIRHASH_NBUCKETS) ?
+			SWAPL(di.di_bucket[i]) : SWAPL(di.di_free);
+		for (; block != 0; block = SWAPL(dc.dc_next)) {
+			diskreadhead(&dc, block);
+			nchainblocks++;
+			len += SWAPL(dc.dc_count);
+		}
+		if (i < SFS_DIRHASH_NBUCKETS) {
+			nents += len;
+			if (len > longest) {
+				longest = len;
+			}
+		}
+		else {
+			nfree = len;
+		}
+	}
+	printf("    index in block %u: %u entries, %u free slots, "
+	       "longest chain %u, %u chain blocks\n",
+	       indexblock, nents, nfree, longest, nchainblocks);
+}
+
 static
 void
 dumpdir(uint32_t ino)
 {
+	char buf[SFS_MAXBLOCKSIZE];
 	struct sfs_inode sfi;
-	uint32_t ib[SFS_DBPERIDB];
-	int nentries, i;
-	uint32_t block, nblocks=0;
+	int nentries;
+	uint32_t nblocks, niblocks;
 
-	diskread(&sfi, ino);
+	diskread(buf, SFS_INOBLOCK(ino, inoperblock));
+	memcpy(&sfi, buf + SFS_INOINDEX(ino, inoperblock)*SFS_INODESIZE,
+	       sizeof(sfi));
 
 	nentries = SWAPL(sfi.sfi_size) / sizeof(struct sfs_dir);
 	if (SWAPL(sfi.sfi_size) % sizeof(struct sfs_dir) != 0) {
@@ -112,39 +251,30 @@ dumpdir(uint32_t ino)
 	}
 	printf("Directory %u: %d entries\n", ino, nentries);
 
-	for (i=0; i<SFS_NDIRECT; i++) {
-		block = SWAPL(sfi.sfi_direct[i]);
-		if (block) {
-			dodirblock(block);
-			nblocks++;
-		}
-	}
-	if (SWAPL(sfi.sfi_indirect)) {
-		diskread(&ib, SWAPL(sfi.sfi_indirect));
-		for (i=0; i<SFS_DBPERIDB; i++) {
-			block = SWAPL(ib[i]);
-			if (block) {
-				dodirblock(block);
-				nblocks++;
-			}
-		}
+	doinodeblocks(&sfi, dodirblock, &nblocks, &niblocks);
+	printf("    %u blocks in directory (%u indirect)\n",
+	       nblocks, niblocks);
+
+	if (SWAPL(sfi.sfi_dirindex) != 0) {
+		dumpdirindex(SWAPL(sfi.sfi_dirindex));
 	}
-	printf("    %u blocks in directory\n", nblocks);
 }
 
 static
 void
 dumpbits(uint32_t fsblocks)
 {
-	uint32_t nblocks = SFS_BITBLOCKS(fsblocks);
+	uint32_t nblocks = SFS_BITBLOCKS(fsblocks, blocksize);
 	uint32_t i, j;
-	char data[SFS_BLOCKSIZE];
+	char data[SFS_MAXBLOCKSIZE];
 
-	printf("Freemap: %u blocks (%u %u %u)\n", nblocks, SFS_BITMAPSIZE(fsblocks), fsblocks, SFS_BLOCKBITS);
+	printf("Freemap: %u blocks (%u %u %u)\n", nblocks,
+	       SFS_BITMAPSIZE(fsblocks, blocksize), fsblocks,
+	       SFS_BLOCKBITS(blocksize));
 
 	for (i=0; i<nblocks; i++) {
 		diskread(data, SFS_MAP_LOCATION+i);
-		for (j=0; j<SFS_BLOCKSIZE; j++) {
+		for (j=0; j<blocksize; j++) {
 			printf("%02x", (unsigned char)data[j]);
 			if (j%32==31) {
 				printf("\n");
@@ -170,7 +300,7 @@ main(int argc, char **argv)
 	opendisk(argv[1]);
 	nblocks = dumpsb();
 	dumpbits(nblocks);
-	dumpdir(SFS_ROOT_LOCATION);
+	dumpdir(SFS_ROOT_INO(inoperblock));
 
 	closedisk();
 
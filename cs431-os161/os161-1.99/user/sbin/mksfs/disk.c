@@ -47,8 +47,13 @@
 #define EINTR 0
 #endif
 
+/* Zeros are written this many bytes at a time */
+#define ZEROCHUNK  65536
+
 static int fd=-1;
-static uint32_t nblocks;
+static uint32_t nblocks;	/* in sectors of BLOCKSIZE */
+static off_t disksize;		/* in bytes, including any header */
+static uint32_t blocksize = BLOCKSIZE;
 
 void
 opendisk(const char *path)
@@ -64,6 +69,7 @@ opendisk(const char *path)
 		err(1, "%s: fstat", path);
 	}
 
+	disksize = statbuf.st_size;
 	nblocks = statbuf.st_size / BLOCKSIZE;
 
 #ifdef HOST
@@ -97,33 +103,61 @@ diskblocksize(void)
 	return BLOCKSIZE;
 }
 
+/*
+ * Set the block size used by diskblocks, diskread and diskwrite from
+ * here on. It must be a multiple of the sector size.
+ */
+void
+disksetblocksize(uint32_t size)
+{
+	assert(size >= BLOCKSIZE && size % BLOCKSIZE == 0);
+	blocksize = size;
+}
+
 uint32_t
 diskblocks(void)
 {
 	assert(fd>=0);
-	return nblocks;
+	return nblocks / (blocksize / BLOCKSIZE);
 }
 
+/*
+ * Seek to the start of block BLOCK.
+ */
+static
 void
-diskwrite(const void *data, uint32_t block)
+diskseek(uint32_t block)
 {
-	const char *cdata = data;
-	uint32_t tot=0;
-	int len;
-
-	assert(fd>=0);
+	off_t pos;
 
+	pos = (off_t)block * blocksize;
 #ifdef HOST
 	// skip over disk file header
-	block++;
+	pos += BLOCKSIZE;
 #endif
 
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
+	if (lseek(fd, pos, SEEK_SET)<0) {
 		err(1, "lseek");
 	}
+}
+
+/*
+ * Write SIZE bytes at the start of a block.
+ */
+static
+void
+diskwritelen(const void *data, uint32_t block, size_t size)
+{
+	const char *cdata = data;
+	size_t tot=0;
+	ssize_t len;
 
-	while (tot < BLOCKSIZE) {
-		len = write(fd, cdata + tot, BLOCKSIZE - tot);
+	assert(fd>=0);
+
+	diskseek(block);
+
+	while (tot < size) {
+		len = write(fd, cdata + tot, size - tot);
 		if (len < 0) {
 			if (errno==EINTR || errno==EAGAIN) {
 				continue;
@@ -137,26 +171,23 @@ diskwrite(const void *data, uint32_t block)
 	}
 }
 
+/*
+ * Read SIZE bytes from the start of a block.
+ */
+static
 void
-diskread(void *data, uint32_t block)
+diskreadlen(void *data, uint32_t block, size_t size)
 {
 	char *cdata = data;
-	uint32_t tot=0;
-	int len;
+	size_t tot=0;
+	ssize_t len;
 
 	assert(fd>=0);
 
-#ifdef HOST
-	// skip over disk file header
-	block++;
-#endif
-
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
-		err(1, "lseek");
-	}
+	diskseek(block);
 
-	while (tot < BLOCKSIZE) {
-		len = read(fd, cdata + tot, BLOCKSIZE - tot);
+	while (tot < size) {
+		len = read(fd, cdata + tot, size - tot);
 		if (len < 0) {
 			if (errno==EINTR || errno==EAGAIN) {
 				continue;
@@ -170,6 +201,87 @@ diskread(void *data, uint32_t block)
 	}
 }
 
+void
+diskwrite(const void *data, uint32_t block)
+{
+	diskwritelen(data, block, blocksize);
+}
+
+void
+diskread(void *data, uint32_t block)
+{
+	diskreadlen(data, block, blocksize);
+}
+
+/*
+ * Read or write just the first sector of a block, for structures that
+ * are a sector long whatever the block size.
+ */
+
+void
+diskwritehead(const void *data, uint32_t block)
+{
+	diskwritelen(data, block, BLOCKSIZE);
+}
+
+void
+diskreadhead(void *data, uint32_t block)
+{
+	diskreadlen(data, block, BLOCKSIZE);
+}
+
+/*
+ * Read or write COUNT consecutive blocks with a single transfer.
+ */
+
+void
+diskwriterun(const void *data, uint32_t block, uint32_t count)
+{
+	diskwritelen(data, block, (size_t)count * blocksize);
+}
+
+void
+diskreadrun(void *data, uint32_t block, uint32_t count)
+{
+	diskreadlen(data, block, (size_t)count * blocksize);
+}
+
+/*
+ * Zero COUNT blocks starting at BLOCK. On a host disk image, zeroing
+ * everything to the end of the disk is done by cutting the file off
+ * and extending it again, which leaves a hole that reads as zeros
+ * and costs nothing to make. Otherwise zeros are written in large
+ * chunks.
+ */
+void
+diskzero(uint32_t block, uint32_t count)
+{
+	static char zeros[ZEROCHUNK];
+	size_t left, len;
+
+	assert(fd>=0);
+
+#ifdef HOST
+	if (block + count == diskblocks()) {
+		off_t pos = (off_t)block * blocksize + BLOCKSIZE;
+
+		if (ftruncate(fd, pos) == 0 &&
+		    ftruncate(fd, disksize) == 0) {
+			return;
+		}
+		/* if the host won't do it, fall back to writing */
+	}
+#endif
+
+	left = (size_t)count * blocksize;
+	while (left > 0) {
+		len = left < ZEROCHUNK ? left : ZEROCHUNK;
+		diskwritelen(zeros, block, len);
+		block += len / blocksize;
+		left -= len;
+	}
+}
+
 void
 closedisk(void)
 {
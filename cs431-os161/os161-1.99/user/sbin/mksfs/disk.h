@@ -30,9 +30,15 @@
 void opendisk(const char *path);
 
 uint32_t diskblocksize(void);
+void disksetblocksize(uint32_t size);
 uint32_t diskblocks(void);
 
 void diskwrite(const void *data, uint32_t block);
 void diskread(void *data, uint32_t block);
+void diskwritehead(const void *data, uint32_t block);
+void diskreadhead(void *data, uint32_t block);
+void diskwriterun(const void *data, uint32_t block, uint32_t count);
+void diskreadrun(void *data, uint32_t block, uint32_t count);
+void diskzero(uint32_t block, uint32_t count);
 
 void closedisk(void);
@@ -29,6 +29,7 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <limits.h>
@@ -55,20 +56,56 @@
 
 #include "disk.h"
 
-#define MAXBITBLOCKS 32
+/* Volumes with fewer blocks than this don't get a journal */
+#define MINJOURNALVOL 1024
+
+/* Block size of the volume being made */
+static uint32_t blocksize;
+
+/*
+ * All the metadata of a fresh volume (superblock, root inode block,
+ * bitmap, journal and root directory index) sits at the start of the
+ * disk. It's put together here in memory and written out in one go.
+ */
+static char *metadata;
+static uint32_t metablocks;
+
+static
+void
+usage(void)
+{
+	errx(1, "Usage: mksfs [-b blocksize] [-z] device/diskfile "
+	     "volume-name");
+}
+
+/*
+ * Put LEN bytes of DATA in block BLOCK of the metadata. The rest of
+ * the block stays zero.
+ */
+static
+void
+writeblock(const void *data, size_t len, uint32_t block)
+{
+	assert(len <= blocksize);
+	assert(block < metablocks);
+	memcpy(metadata + block*blocksize, data, len);
+}
 
 static
 void
 check(void)
 {
 	assert(sizeof(struct sfs_super)==SFS_BLOCKSIZE);
-	assert(sizeof(struct sfs_inode)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_inode)==SFS_INODESIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
+	assert(sizeof(struct sfs_dirindex)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_jheader)==SFS_BLOCKSIZE);
 }
 
 static
 void
-writesuper(const char *volname, uint32_t nblocks)
+writesuper(const char *volname, uint32_t nblocks,
+	   uint32_t jstart, uint32_t jblocks)
 {
 	struct sfs_super sp;
 
@@ -81,26 +118,57 @@ writesuper(const char *volname, uint32_t nblocks)
 	sp.sp_magic = SWAPL(SFS_MAGIC);
 	sp.sp_nblocks = SWAPL(nblocks);
 	strcpy(sp.sp_volname, volname);
+	sp.sp_jstart = SWAPL(jstart);
+	sp.sp_jblocks = SWAPL(jblocks);
+	sp.sp_blocksize = SWAPL(blocksize);
+	sp.sp_inodesize = SWAPL(SFS_INODESIZE);
+
+	writeblock(&sp, sizeof(sp), SFS_SB_LOCATION);
+}
+
+/*
+ * The journal starts out empty. Only its header matters; the image
+ * blocks are ignored until a transaction is committed.
+ */
+static
+void
+writejournal(uint32_t jstart)
+{
+	struct sfs_jheader jh;
+
+	bzero((void *)&jh, sizeof(jh));
+	jh.jh_magic = SWAPL(SFS_JMAGIC);
+	jh.jh_seq = SWAPL(0);
+	jh.jh_count = SWAPL(0);
 
-	diskwrite(&sp, SFS_SB_LOCATION);
+	writeblock(&jh, sizeof(jh), jstart);
 }
 
+/*
+ * The root directory starts out empty, with an empty index in block
+ * INDEXBLOCK. Its inode is the first in its block; the rest are free.
+ */
 static
 void
-writerootdir(void)
+writerootdir(uint32_t indexblock)
 {
 	struct sfs_inode sfi;
+	struct sfs_dirindex di;
 
 	bzero((void *)&sfi, sizeof(sfi));
 
 	sfi.sfi_size = SWAPL(0);
 	sfi.sfi_type = SWAPS(SFS_TYPE_DIR);
 	sfi.sfi_linkcount = SWAPS(1);
+	sfi.sfi_dirindex = SWAPL(indexblock);
+
+	writeblock(&sfi, sizeof(sfi), SFS_ROOT_LOCATION);
 
-	diskwrite(&sfi, SFS_ROOT_LOCATION);
+	bzero((void *)&di, sizeof(di));
+	writeblock(&di, sizeof(di), indexblock);
 }
 
-static char bitbuf[MAXBITBLOCKS*SFS_BLOCKSIZE];
+static char *bitbuf;
 
 static
 void
@@ -115,46 +183,66 @@ doallocbit(uint32_t bit)
 
 static
 void
-writebitmap(uint32_t fsblocks)
+writebitmap(uint32_t fsblocks, uint32_t jstart, uint32_t jblocks,
+	    uint32_t indexblock)
 {
 
-	uint32_t nbits = SFS_BITMAPSIZE(fsblocks);
-	uint32_t nblocks = SFS_BITBLOCKS(fsblocks);
-	char *ptr;
+	uint32_t nbits = SFS_BITMAPSIZE(fsblocks, blocksize);
+	uint32_t nblocks = SFS_BITBLOCKS(fsblocks, blocksize);
 	uint32_t i;
 
-	if (nblocks > MAXBITBLOCKS) {
-		errx(1, "Filesystem too large "
-		     "- increase MAXBITBLOCKS and recompile");
-	}
+	assert(SFS_MAP_LOCATION + nblocks <= metablocks);
+	bitbuf = metadata + SFS_MAP_LOCATION*blocksize;
 
 	doallocbit(SFS_SB_LOCATION);
 	doallocbit(SFS_ROOT_LOCATION);
 	for (i=0; i<nblocks; i++) {
 		doallocbit(SFS_MAP_LOCATION+i);
 	}
+	for (i=0; i<jblocks; i++) {
+		doallocbit(jstart+i);
+	}
+	doallocbit(indexblock);
 	for (i=fsblocks; i<nbits; i++) {
 		doallocbit(i);
 	}
-
-	for (i=0; i<nblocks; i++) {
-		ptr = bitbuf + i*SFS_BLOCKSIZE;
-		diskwrite(ptr, SFS_MAP_LOCATION+i);
-	}
 }
 
 int
 main(int argc, char **argv)
 {
-	uint32_t size, blocksize;
+	uint32_t size, sectorsize, jstart, jblocks, indexblock;
 	char *volname, *s;
+	int zero = 0;
 
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
+	blocksize = SFS_BLOCKSIZE;
+	while (argc > 1 && argv[1][0] == '-') {
+		if (argc > 2 && !strcmp(argv[1], "-b")) {
+			blocksize = atoi(argv[2]);
+			argc -= 2;
+			argv += 2;
+		}
+		else if (!strcmp(argv[1], "-z")) {
+			/* zero the rest of the volume too */
+			zero = 1;
+			argc--;
+			argv++;
+		}
+		else {
+			usage();
+		}
+	}
 	if (argc!=3) {
-		errx(1, "Usage: mksfs device/diskfile volume-name");
+		usage();
+	}
+	if (blocksize < SFS_BLOCKSIZE || blocksize > SFS_MAXBLOCKSIZE ||
+	    (blocksize & (blocksize - 1)) != 0) {
+		errx(1, "Block size must be a power of 2 from %u to %u",
+		     SFS_BLOCKSIZE, SFS_MAXBLOCKSIZE);
 	}
 
 	check();
@@ -177,17 +265,66 @@ main(int argc, char **argv)
 	}
 
 	opendisk(argv[1]);
-	blocksize = diskblocksize();
+	sectorsize = diskblocksize();
 
-	if (blocksize!=SFS_BLOCKSIZE) {
-		errx(1, "Device has wrong blocksize %u (should be %u)\n",
-		     blocksize, SFS_BLOCKSIZE);
+	if (sectorsize!=SFS_BLOCKSIZE) {
+		errx(1, "Device has wrong sector size %u (should be %u)\n",
+		     sectorsize, SFS_BLOCKSIZE);
 	}
+	disksetblocksize(blocksize);
 	size = diskblocks();
 
-	writesuper(volname, size);
-	writerootdir();
-	writebitmap(size);
+	/*
+	 * The journal, if there's room for one, goes right after the
+	 * bitmap, and the root directory's index after that. A bitmap
+	 * too big for the kernel to hold in one transaction, or blocks
+	 * too big for it to keep enough of, mean no journal.
+	 */
+	jstart = SFS_MAP_LOCATION + SFS_BITBLOCKS(size, blocksize);
+	jblocks = size >= MINJOURNALVOL ? SFS_JBLOCKS : 0;
+	if (jblocks > 0 && blocksize > SFS_JMAXBLOCKSIZE) {
+		warnx("Blocks too big for a journal (%lu bytes, most %u); "
+		      "making the volume without one",
+		      (unsigned long) blocksize, SFS_JMAXBLOCKSIZE);
+		jblocks = 0;
+	}
+	if (jblocks > 0 &&
+	    SFS_BITBLOCKS(size, blocksize) > SFS_JMAXMAPBLOCKS) {
+		warnx("Free block bitmap too big for a journal (%lu blocks, "
+		      "most %u); making the volume without one",
+		      (unsigned long) SFS_BITBLOCKS(size, blocksize),
+		      SFS_JMAXMAPBLOCKS);
+		jblocks = 0;
+	}
+	indexblock = jstart + jblocks;
+	if (indexblock >= size) {
+		errx(1, "Device too small");
+	}
+
+	metablocks = indexblock + 1;
+	metadata = malloc((size_t)metablocks * blocksize);
+	if (metadata == NULL) {
+		errx(1, "Out of memory");
+	}
+	bzero(metadata, (size_t)metablocks * blocksize);
+
+	writesuper(volname, size, jblocks ? jstart : 0, jblocks);
+	if (jblocks > 0) {
+		writejournal(jstart);
+	}
+	writerootdir(indexblock);
+	writebitmap(size, jstart, jblocks, indexblock);
+
+	diskwriterun(metadata, 0, metablocks);
+	free(metadata);
+
+	/*
+	 * Nothing reads the data blocks until they've been written, so
+	 * they're left alone unless asked for.
+	 */
+	if (zero && metablocks < size) {
+		diskzero(metablocks, size - metablocks);
+	}
 
 	closedisk();
 
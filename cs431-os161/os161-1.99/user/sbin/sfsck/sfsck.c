@@ -39,6 +39,10 @@
 #include "support.h"
 #include "kern/sfs.h"
 
+/* The inode has one each of double and triple indirect blocks. */
+#define HAS_DIDIRECT
+#define HAS_TIDIRECT
+
 #ifdef HOST
 #include <netinet/in.h> // for arpa/inet.h
 #include <arpa/inet.h>  // for ntohl
@@ -66,6 +70,12 @@
 
 static int badness=0;
 
+/* Block size of the volume, and block numbers per indirect block */
+static uint32_t blocksize, dbperidb;
+
+/* Inodes per inode block */
+static uint32_t inoperblock;
+
 static
 void
 setbadness(int code)
@@ -83,6 +93,25 @@ swapsb(struct sfs_super *sp)
 {
 	sp->sp_magic = SWAPL(sp->sp_magic);
 	sp->sp_nblocks = SWAPL(sp->sp_nblocks);
+	sp->sp_jstart = SWAPL(sp->sp_jstart);
+	sp->sp_jblocks = SWAPL(sp->sp_jblocks);
+	sp->sp_blocksize = SWAPL(sp->sp_blocksize);
+	sp->sp_inodesize = SWAPL(sp->sp_inodesize);
+}
+
+static
+void
+swapjheader(struct sfs_jheader *jh)
+{
+	int i;
+
+	jh->jh_magic = SWAPL(jh->jh_magic);
+	jh->jh_seq = SWAPL(jh->jh_seq);
+	jh->jh_count = SWAPL(jh->jh_count);
+	jh->jh_sum = SWAPL(jh->jh_sum);
+	for (i=0; i<SFS_JMAXBLOCKS; i++) {
+		jh->jh_home[i] = SWAPL(jh->jh_home[i]);
+	}
 }
 
 static
@@ -126,6 +155,9 @@ swapinode(struct sfs_inode *sfi)
 	sfi->sfi_tindirect = SWAPL(sfi->sfi_tindirect);
 #endif
 #endif
+
+	sfi->sfi_dirindex = SWAPL(sfi->sfi_dirindex);
+	sfi->sfi_flags = SWAPL(sfi->sfi_flags);
 }
 
 static
@@ -139,12 +171,26 @@ static
 void
 swapindir(uint32_t *entries)
 {
-	int i;
-	for (i=0; i<SFS_DBPERIDB; i++) {
+	uint32_t i;
+	for (i=0; i<dbperidb; i++) {
 		entries[i] = SWAPL(entries[i]);
 	}
 }
 
+static
+void
+swapchain(struct sfs_dirchain *dc)
+{
+	int i;
+
+	dc->dc_next = SWAPL(dc->dc_next);
+	dc->dc_count = SWAPL(dc->dc_count);
+	for (i=0; i<SFS_DIRHASH_PERBLOCK; i++) {
+		dc->dc_ents[i].dh_hash = SWAPL(dc->dc_ents[i].dh_hash);
+		dc->dc_ents[i].dh_slot = SWAPL(dc->dc_ents[i].dh_slot);
+	}
+}
+
 static
 void
 swapbits(uint8_t *bits)
@@ -172,15 +218,18 @@ domalloc(size_t len)
 typedef enum {
 	B_SUPERBLOCK,	/* Block that is the superblock */
 	B_BITBLOCK,	/* Block used by free-block bitmap */
-	B_INODE,	/* Block that is an inode */
+	B_INODE,	/* Block of inodes */
 	B_IBLOCK,	/* Indirect (or doubly-indirect etc.) block */
 	B_DIRDATA,	/* Data block of a directory */
+	B_DIRINDEX,	/* Index block of a directory */
+	B_JOURNAL,	/* Block of the metadata journal */
 	B_DATA,		/* Data block */
 	B_TOFREE,	/* Block that was used but we are releasing */
 	B_PASTEND,	/* Block off the end of the fs */
 } blockusage_t;
 
 static uint32_t nblocks, bitblocks;
+static uint32_t jstart, jblocks;
 static uint32_t uniquecounter = 1;
 
 static unsigned long count_blocks=0, count_dirs=0, count_files=0;
@@ -194,7 +243,7 @@ static
 void
 bitmap_init(uint32_t bitblocks)
 {
-	size_t i, mapsize = bitblocks * SFS_BLOCKSIZE;
+	size_t i, mapsize = bitblocks * blocksize;
 	bitmapdata = domalloc(mapsize * sizeof(uint8_t));
 	tofreedata = domalloc(mapsize * sizeof(uint8_t));
 	for (i=0; i<mapsize; i++) {
@@ -210,7 +259,7 @@ blockusagestr(blockusage_t how, uint32_t howdesc)
 	switch (how) {
 	    case B_SUPERBLOCK: return "superblock";
 	    case B_BITBLOCK: return "bitmap block";
-	    case B_INODE: return "inode";
+	    case B_INODE: return "inode block";
 	    case B_IBLOCK: 
 		snprintf(rv, sizeof(rv), "indirect block of inode %lu", 
 			 (unsigned long) howdesc);
@@ -219,6 +268,11 @@ blockusagestr(blockusage_t how, uint32_t howdesc)
 		snprintf(rv, sizeof(rv), "directory data from inode %lu", 
 			 (unsigned long) howdesc);
 		break;
+	    case B_DIRINDEX:
+		snprintf(rv, sizeof(rv), "directory index of inode %lu", 
+			 (unsigned long) howdesc);
+		break;
+	    case B_JOURNAL: return "journal";
 	    case B_DATA:
 		snprintf(rv, sizeof(rv), "file data from inode %lu", 
 			 (unsigned long) howdesc);
@@ -292,7 +346,8 @@ reportbits(uint32_t bitblock, uint32_t byte, uint8_t val, const char *what)
 
 	for (x=1, y=0; x; x<<=1, y++) {
 		if (val & x) {
-			blocknum = bitblock*SFS_BLOCKBITS + byte*CHAR_BIT + y;
+			blocknum = bitblock*SFS_BLOCKBITS(blocksize) +
+				byte*CHAR_BIT + y;
 			warnx("Block %lu erroneously shown %s in bitmap",
 			      (unsigned long) blocknum, what);
 		}
@@ -303,18 +358,22 @@ static
 void
 check_bitmap(void)
 {
-	uint8_t bits[SFS_BLOCKSIZE], *found, *tofree, tmp;
+	uint8_t *allbits, *bits, *found, *tofree, tmp;
 	uint32_t alloccount=0, freecount=0, i, j;
 	int bchanged;
 
+	/* the bitmap is contiguous; read it all in one go */
+	allbits = domalloc(bitblocks * blocksize);
+	diskreadrun(allbits, SFS_MAP_LOCATION, bitblocks);
+
 	for (i=0; i<bitblocks; i++) {
-		diskread(bits, SFS_MAP_LOCATION+i);
+		bits = allbits + i*blocksize;
 		swapbits(bits);
-		found = bitmapdata + i*SFS_BLOCKSIZE;
-		tofree = tofreedata + i*SFS_BLOCKSIZE;
+		found = bitmapdata + i*blocksize;
+		tofree = tofreedata + i*blocksize;
 		bchanged = 0;
 
-		for (j=0; j<SFS_BLOCKSIZE; j++) {
+		for (j=0; j<blocksize; j++) {
 			/* we shouldn't have blocks marked both ways */
 			assert((found[j] & tofree[j])==0);
 
@@ -358,6 +417,7 @@ check_bitmap(void)
 			diskwrite(bits, SFS_MAP_LOCATION+i);
 		}
 	}
+	free(allbits);
 
 	if (alloccount > 0) {
 		warnx("%lu blocks erroneously shown free in bitmap (fixed)",
@@ -373,38 +433,249 @@ check_bitmap(void)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Inodes found in use, one bit per inode number. An inode block is
+ * marked in the block bitmap when the first inode in it is found.
+ */
+static uint8_t *inodeseendata;
+
+static
+void
+inodemap_init(void)
+{
+	size_t i, mapsize = ((uint64_t)nblocks * inoperblock + CHAR_BIT - 1)
+		/ CHAR_BIT;
+
+	inodeseendata = domalloc(mapsize * sizeof(uint8_t));
+	for (i=0; i<mapsize; i++) {
+		inodeseendata[i] = 0;
+	}
+}
+
+static
+int
+inode_seen(uint32_t ino)
+{
+	return (inodeseendata[ino/8] & (((uint8_t)1)<<(ino%8))) != 0;
+}
+
+static
+void
+inode_mark(uint32_t ino)
+{
+	uint32_t block = SFS_INOBLOCK(ino, inoperblock);
+	uint32_t first = SFS_MKINO(block, 0, inoperblock);
+	uint32_t i;
+	int blockseen = 0;
+
+	if (inode_seen(ino)) {
+		/* complain the same way as for any block used twice */
+		bitmap_mark(block, B_INODE, ino);
+		return;
+	}
+
+	for (i=0; i<inoperblock; i++) {
+		if (inode_seen(first+i)) {
+			blockseen = 1;
+			break;
+		}
+	}
+	if (!blockseen) {
+		bitmap_mark(block, B_INODE, ino);
+	}
+	inodeseendata[ino/8] |= ((uint8_t)1)<<(ino%8);
+}
+
+/*
+ * Inode blocks recently read, so that a directory full of packed
+ * inodes doesn't go to disk once per entry. Direct-mapped by block
+ * number; block 0 (the superblock) is never an inode block and marks
+ * an empty slot. Writes go through to disk straight away.
+ */
+#define INOCACHE_SIZE	32
+
+static char *inocachedata;
+static uint32_t inocacheblock[INOCACHE_SIZE];
+
+static
+void
+inocache_init(void)
+{
+	unsigned i;
+
+	inocachedata = domalloc(INOCACHE_SIZE * blocksize);
+	for (i=0; i<INOCACHE_SIZE; i++) {
+		inocacheblock[i] = 0;
+	}
+}
+
+static
+char *
+inocache_get(uint32_t block)
+{
+	unsigned slot = block % INOCACHE_SIZE;
+	char *data = inocachedata + slot*blocksize;
+
+	assert(block != 0);
+	if (inocacheblock[slot] != block) {
+		diskread(data, block);
+		inocacheblock[slot] = block;
+	}
+	return data;
+}
+
+/*
+ * Read and write a single inode. Packed inodes share their block, so
+ * writing one means writing out the rest of the block too.
+ */
+static
+void
+inoderead(struct sfs_inode *sfi, uint32_t ino)
+{
+	char *data;
+
+	data = inocache_get(SFS_INOBLOCK(ino, inoperblock));
+	memcpy(sfi, data + SFS_INOINDEX(ino, inoperblock)*SFS_INODESIZE,
+	       sizeof(*sfi));
+}
+
+static
+void
+inodewrite(const struct sfs_inode *sfi, uint32_t ino)
+{
+	char *data;
+
+	data = inocache_get(SFS_INOBLOCK(ino, inoperblock));
+	memcpy(data + SFS_INOINDEX(ino, inoperblock)*SFS_INODESIZE, sfi,
+	       sizeof(*sfi));
+	diskwrite(data, SFS_INOBLOCK(ino, inoperblock));
+}
+
+/*
+ * Inodes not reachable from the root are dropped along with their
+ * blocks. Where they share a block with inodes that are reachable,
+ * they have to be cleared, or the kernel would think them in use.
+ */
+static
+void
+check_orphans(void)
+{
+	struct sfs_inode *inodes;
+	uint32_t block, first, i;
+	int used, ichanged;
+
+	if (inoperblock == 1) {
+		return;
+	}
+
+	for (block=0; block<nblocks; block++) {
+		first = SFS_MKINO(block, 0, inoperblock);
+		used = 0;
+		for (i=0; i<inoperblock; i++) {
+			if (inode_seen(first+i)) {
+				used = 1;
+				break;
+			}
+		}
+		if (!used) {
+			continue;
+		}
+
+		inodes = (struct sfs_inode *)inocache_get(block);
+		ichanged = 0;
+		for (i=0; i<inoperblock; i++) {
+			if (inode_seen(first+i) ||
+			    inodes[i].sfi_type == SWAPS(SFS_TYPE_INVAL)) {
+				continue;
+			}
+			warnx("Inode %lu not in any directory (freed)",
+			      (unsigned long) (first+i));
+			setbadness(EXIT_RECOV);
+			bzero(&inodes[i], sizeof(inodes[i]));
+			ichanged = 1;
+		}
+		if (ichanged) {
+			diskwrite(inodes, block);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * What's known about each inode reached so far, in a hash table keyed
+ * by inode number that doubles in size as it fills up.
+ */
 struct inodememory {
 	uint32_t ino;
 	uint32_t linkcount;	/* files only; 0 for dirs */
+	struct inodememory *next;	/* hash chain */
 };
 
-static struct inodememory *inodes = NULL;
-static int ninodes=0, maxinodes=0;
+#define INODEHASH_MIN	256
+
+static struct inodememory **inodehash = NULL;
+static uint32_t inodehashsize=0, ninodes=0;
 
 static
-void
-addmemory(uint32_t ino, uint32_t linkcount)
+struct inodememory *
+findmemory(uint32_t ino)
 {
-	assert(ninodes <= maxinodes);
-	if (ninodes == maxinodes) {
-#ifdef NO_REALLOC
-		int newmax = (maxinodes+1)*2;
-		void *p = domalloc(newmax * sizeof(struct inodememory));
-		if (inodes) {
-			memcpy(p, inodes, ninodes);
-			free(inodes);
+	struct inodememory *im;
+
+	if (inodehashsize == 0) {
+		return NULL;
+	}
+	for (im = inodehash[ino % inodehashsize]; im != NULL; im = im->next) {
+		if (im->ino == ino) {
+			return im;
 		}
-		inodes = p;
-#else
-		maxinodes = (maxinodes+1)*2;
-		inodes = realloc(inodes, maxinodes * sizeof(uint32_t));
-		if (inodes==NULL) {
-			errx(EXIT_FATAL, "Out of memory");
+	}
+	return NULL;
+}
+
+static
+void
+inodehash_resize(uint32_t newsize)
+{
+	struct inodememory **newhash, *im, *next;
+	uint32_t i;
+
+	newhash = domalloc(newsize * sizeof(struct inodememory *));
+	for (i=0; i<newsize; i++) {
+		newhash[i] = NULL;
+	}
+	for (i=0; i<inodehashsize; i++) {
+		for (im = inodehash[i]; im != NULL; im = next) {
+			next = im->next;
+			im->next = newhash[im->ino % newsize];
+			newhash[im->ino % newsize] = im;
 		}
-#endif
 	}
-	inodes[ninodes].ino = ino;
-	inodes[ninodes].linkcount = linkcount;
+	free(inodehash);
+	inodehash = newhash;
+	inodehashsize = newsize;
+}
+
+static
+void
+addmemory(uint32_t ino, uint32_t linkcount)
+{
+	struct inodememory *im;
+
+	if (inodehashsize == 0) {
+		inodehash_resize(INODEHASH_MIN);
+	}
+	else if (ninodes >= 2*inodehashsize) {
+		inodehash_resize(2*inodehashsize);
+	}
+
+	im = domalloc(sizeof(struct inodememory));
+	im->ino = ino;
+	im->linkcount = linkcount;
+	im->next = inodehash[ino % inodehashsize];
+	inodehash[ino % inodehashsize] = im;
+	ninodes++;
 }
 
 /* returns nonzero if directory already remembered */
@@ -412,16 +683,15 @@ static
 int
 remember_dir(uint32_t ino, const char *pathsofar)
 {
-	int i;
+	struct inodememory *im;
 
 	/* don't use this for now */
 	(void)pathsofar;
 
-	for (i=0; i<ninodes; i++) {
-		if (inodes[i].ino==ino) {
-			assert(inodes[i].linkcount==0);
-			return 1;
-		}
+	im = findmemory(ino);
+	if (im != NULL) {
+		assert(im->linkcount==0);
+		return 1;
 	}
 
 	addmemory(ino, 0);
@@ -433,42 +703,56 @@ static
 void
 observe_filelink(uint32_t ino)
 {
-	int i;
-	for (i=0; i<ninodes; i++) {
-		if (inodes[i].ino==ino) {
-			assert(inodes[i].linkcount>0);
-			inodes[i].linkcount++;
-			return;
-		}
+	struct inodememory *im;
+
+	im = findmemory(ino);
+	if (im != NULL) {
+		assert(im->linkcount>0);
+		im->linkcount++;
+		return;
 	}
-	bitmap_mark(ino, B_INODE, ino);
+	inode_mark(ino);
 	addmemory(ino, 1);
 }
 
+/*
+ * Go through the files found in inode order rather than in the order
+ * they turned up in, so packed inodes are dealt with a block at a time.
+ */
 static
 void
 adjust_filelinks(void)
 {
 	struct sfs_inode sfi;
-	int i;
+	struct inodememory *im;
+	uint32_t ino;
 
-	for (i=0; i<ninodes; i++) {
-		if (inodes[i].linkcount==0) {
+	for (ino=0; ino < nblocks * inoperblock; ino++) {
+		if (inodeseendata[ino/8] == 0) {
+			/* skip to the next byte */
+			ino |= 7;
+			continue;
+		}
+		if (!inode_seen(ino)) {
+			continue;
+		}
+		im = findmemory(ino);
+		if (im == NULL || im->linkcount==0) {
 			/* directory */
 			continue;
 		}
-		diskread(&sfi, inodes[i].ino);
+		inoderead(&sfi, ino);
 		swapinode(&sfi);
 		assert(sfi.sfi_type == SFS_TYPE_FILE);
-		if (sfi.sfi_linkcount != inodes[i].linkcount) {
+		if (sfi.sfi_linkcount != im->linkcount) {
 			warnx("File %lu link count %lu should be %lu (fixed)",
-			      (unsigned long) inodes[i].ino,
+			      (unsigned long) ino,
 			      (unsigned long) sfi.sfi_linkcount,
-			      (unsigned long) inodes[i].linkcount);
-			sfi.sfi_linkcount = inodes[i].linkcount;
+			      (unsigned long) im->linkcount);
+			sfi.sfi_linkcount = im->linkcount;
 			setbadness(EXIT_RECOV);
 			swapinode(&sfi);
-			diskwrite(&sfi, inodes[i].ino);
+			inodewrite(&sfi, ino);
 		}
 		count_files++;
 	}
@@ -516,7 +800,7 @@ check_sb(void)
 	uint32_t i;
 	int schanged=0;
 
-	diskread(&sp, SFS_SB_LOCATION);
+	diskreadhead(&sp, SFS_SB_LOCATION);
 	swapsb(&sp);
 	if (sp.sp_magic != SFS_MAGIC) {
 		errx(EXIT_UNRECOV, "Not an sfs filesystem");
@@ -524,13 +808,33 @@ check_sb(void)
 
 	assert(nblocks==0);
 	assert(bitblocks==0);
+	blocksize = SFS_SB_BLOCKSIZE(&sp);
+	if (blocksize < SFS_BLOCKSIZE || blocksize > SFS_MAXBLOCKSIZE ||
+	    (blocksize & (blocksize - 1)) != 0) {
+		errx(EXIT_UNRECOV, "Invalid block size %lu",
+		     (unsigned long) blocksize);
+	}
+	disksetblocksize(blocksize);
+	dbperidb = SFS_DBPERIDB(blocksize);
+
 	nblocks = sp.sp_nblocks;
-	bitblocks = SFS_BITBLOCKS(nblocks);
+	bitblocks = SFS_BITBLOCKS(nblocks, blocksize);
 	assert(nblocks>0);
 	assert(bitblocks>0);
 
+	if (sp.sp_inodesize != 0 && sp.sp_inodesize != SFS_INODESIZE) {
+		errx(EXIT_UNRECOV, "Invalid inode size %lu",
+		     (unsigned long) sp.sp_inodesize);
+	}
+	inoperblock = SFS_SB_INOPERBLOCK(&sp);
+	if ((uint64_t)nblocks * inoperblock > 0xffffffff) {
+		errx(EXIT_UNRECOV, "Too many blocks for inode numbers");
+	}
+
 	bitmap_init(bitblocks);
-	for (i=nblocks; i<bitblocks*SFS_BLOCKBITS; i++) {
+	inodemap_init();
+	inocache_init();
+	for (i=nblocks; i<bitblocks*SFS_BLOCKBITS(blocksize); i++) {
 		bitmap_mark(i, B_PASTEND, 0);
 	}
 
@@ -545,9 +849,24 @@ check_sb(void)
 		schanged = 1;
 	}
 
+	if (sp.sp_jblocks != 0 &&
+	    (sp.sp_jblocks != SFS_JBLOCKS ||
+	     sp.sp_jstart < SFS_MAP_LOCATION + bitblocks ||
+	     sp.sp_jstart + sp.sp_jblocks > nblocks)) {
+		warnx("Bad journal location %lu size %lu (removed)",
+		      (unsigned long) sp.sp_jstart,
+		      (unsigned long) sp.sp_jblocks);
+		setbadness(EXIT_RECOV);
+		sp.sp_jstart = 0;
+		sp.sp_jblocks = 0;
+		schanged = 1;
+	}
+	jstart = sp.sp_jstart;
+	jblocks = sp.sp_jblocks;
+
 	if (schanged) {
 		swapsb(&sp);
-		diskwrite(&sp, SFS_SB_LOCATION);
+		diskwritehead(&sp, SFS_SB_LOCATION);
 	}
 
 	bitmap_mark(SFS_SB_LOCATION, B_SUPERBLOCK, 0);
@@ -560,26 +879,30 @@ check_sb(void)
 
 static
 void
-check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
+check_indirect_block(uint32_t ino, uint32_t *ientry, uint64_t *blockp,
 		     uint32_t nblocks, uint32_t *badcountp, 
 		     int isdir, int indirection)
 {
-	uint32_t entries[SFS_DBPERIDB];
+	uint32_t entries[SFS_MAXBLOCKSIZE/sizeof(uint32_t)];
 	uint32_t i, ct;
+	uint64_t span;
 
-	if (*ientry !=0) {
-		diskread(entries, *ientry);
-		swapindir(entries);
-		bitmap_mark(*ientry, B_IBLOCK, ino);
-	}
-	else {
-		for (i=0; i<SFS_DBPERIDB; i++) {
-			entries[i] = 0;
+	if (*ientry == 0) {
+		/* Nothing to check; just skip the blocks it would map */
+		span = 1;
+		for (i=0; i<(uint32_t)indirection; i++) {
+			span *= dbperidb;
 		}
+		*blockp += span;
+		return;
 	}
 
+	diskread(entries, *ientry);
+	swapindir(entries);
+	bitmap_mark(*ientry, B_IBLOCK, ino);
+
 	if (indirection > 1) {
-		for (i=0; i<SFS_DBPERIDB; i++) {
+		for (i=0; i<dbperidb; i++) {
 			check_indirect_block(ino, &entries[i], 
 					     blockp, nblocks, 
 					     badcountp,
@@ -590,7 +913,7 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 	else {
 		assert(indirection==1);
 
-		for (i=0; i<SFS_DBPERIDB; i++) {
+		for (i=0; i<dbperidb; i++) {
 			if (*blockp < nblocks) {
 				if (entries[i] != 0) {
 					bitmap_mark(entries[i],
@@ -612,7 +935,7 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 	}
 
 	ct=0;
-	for (i=ct=0; i<SFS_DBPERIDB; i++) {
+	for (i=ct=0; i<dbperidb; i++) {
 		if (entries[i]!=0) ct++;
 	}
 	if (ct==0) {
@@ -636,12 +959,33 @@ static
 int
 check_inode_blocks(uint32_t ino, struct sfs_inode *sfi, int isdir)
 {
-	uint32_t size, block, nblocks, badcount;
+	uint32_t nblocks, badcount;
+	uint64_t block;
+	int ichanged = 0;
+
+	if (sfi->sfi_flags & SFS_IF_INLINE) {
+		if (!isdir) {
+			/* No blocks; the contents are in the inode */
+			if (sfi->sfi_size > SFS_INLINESIZE) {
+				warnx("Inode %lu: inline size %lu too large "
+				      "(truncated)", (unsigned long) ino,
+				      (unsigned long) sfi->sfi_size);
+				setbadness(EXIT_RECOV);
+				sfi->sfi_size = SFS_INLINESIZE;
+				return 1;
+			}
+			return 0;
+		}
+		warnx("Directory inode %lu marked inline (fixed)",
+		      (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		sfi->sfi_flags &= ~SFS_IF_INLINE;
+		ichanged = 1;
+	}
 
 	badcount = 0;
 
-	size = SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE);
-	nblocks = size/SFS_BLOCKSIZE;
+	nblocks = SFS_ROUNDUP((uint64_t)sfi->sfi_size, blocksize) / blocksize;
 
 	for (block=0; block<SFS_NDIRECT; block++) {
 		if (block < nblocks) {
@@ -700,7 +1044,7 @@ check_inode_blocks(uint32_t ino, struct sfs_inode *sfi, int isdir)
 		return 1;
 	}
 
-	return 0;
+	return ichanged;
 }
 
 ////////////////////////////////////////////////////////////
@@ -709,7 +1053,7 @@ static
 uint32_t
 ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 {
-	uint32_t entries[SFS_DBPERIDB];
+	uint32_t entries[SFS_MAXBLOCKSIZE/sizeof(uint32_t)];
 
 	if (iblock == 0) {
 		return 0;
@@ -721,10 +1065,10 @@ ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 	if (entrysize > 1) {
 		uint32_t index = offset / entrysize;
 		offset %= entrysize;
-		return ibmap(entries[index], offset, entrysize/SFS_DBPERIDB);
+		return ibmap(entries[index], offset, entrysize/dbperidb);
 	}
 	else {
-		assert(offset < SFS_DBPERIDB);
+		assert(offset < dbperidb);
 		return entries[offset];
 	}
 }
@@ -766,15 +1110,15 @@ ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 #endif
 #endif
 
-#define BMAP_DMAX   BMAP_ND
-#define BMAP_IMAX   (BMAP_DMAX+SFS_DBPERIDB*BMAP_NI)
-#define BMAP_IIMAX  (BMAP_IMAX+SFS_DBPERIDB*BMAP_NII)
-#define BMAP_IIIMAX (BMAP_IIMAX+SFS_DBPERIDB*BMAP_NIII)
+#define BMAP_DSIZE	((uint64_t)1)
+#define BMAP_ISIZE	(BMAP_DSIZE*dbperidb)
+#define BMAP_IISIZE	(BMAP_ISIZE*dbperidb)
+#define BMAP_IIISIZE	(BMAP_IISIZE*dbperidb)
 
-#define BMAP_DSIZE	1
-#define BMAP_ISIZE	(BMAP_DSIZE*SFS_DBPERIDB)
-#define BMAP_IISIZE	(BMAP_ISIZE*SFS_DBPERIDB)
-#define BMAP_IIISIZE	(BMAP_IISIZE*SFS_DBPERIDB)
+#define BMAP_DMAX   BMAP_ND
+#define BMAP_IMAX   (BMAP_DMAX+BMAP_ISIZE*BMAP_NI)
+#define BMAP_IIMAX  (BMAP_IMAX+BMAP_IISIZE*BMAP_NII)
+#define BMAP_IIIMAX (BMAP_IIMAX+BMAP_IIISIZE*BMAP_NIII)
 
 static
 uint32_t
@@ -803,25 +1147,48 @@ dobmap(const struct sfs_inode *sfi, uint32_t fileblock)
 	return 0;
 }
 
+/*
+ * Directory blocks are usually allocated one after another, so they
+ * are read and written in runs of consecutive blocks where possible.
+ * Returns the length of the run of directory blocks starting at
+ * directory block I (which maps to BLOCK), up to NBLOCKS.
+ */
+static
+unsigned
+dirrun(const struct sfs_inode *sfi, unsigned i, uint32_t block,
+       unsigned nblocks)
+{
+	unsigned n;
+
+	for (n=1; i+n < nblocks; n++) {
+		if (dobmap(sfi, i+n) != block+n) {
+			break;
+		}
+	}
+	return n;
+}
+
 static
 void
 dirread(struct sfs_inode *sfi, struct sfs_dir *d, unsigned nd)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_dir);
+	const unsigned atonce = blocksize/sizeof(struct sfs_dir);
 	unsigned nblocks = SFS_ROUNDUP(nd, atonce) / atonce;
-	unsigned i, j;
+	unsigned i, j, n;
 
-	for (i=0; i<nblocks; i++) {
+	for (i=0; i<nblocks; i+=n) {
 		uint32_t block = dobmap(sfi, i);
 		if (block!=0) {
-			diskread(d + i*atonce, block);
-			for (j=0; j<atonce; j++) {
+			n = dirrun(sfi, i, block, nblocks);
+			diskreadrun(d + i*atonce, block, n);
+			for (j=0; j<n*atonce; j++) {
 				swapdir(&d[i*atonce+j]);
 			}
 		}
 		else {
+			n = 1;
 			warnx("Warning: sparse directory found");
-			bzero(d + i*atonce, SFS_BLOCKSIZE);
+			bzero(d + i*atonce, blocksize);
 		}
 	}
 }
@@ -830,19 +1197,21 @@ static
 void
 dirwrite(const struct sfs_inode *sfi, struct sfs_dir *d, int nd)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_dir);
+	const unsigned atonce = blocksize/sizeof(struct sfs_dir);
 	unsigned nblocks = SFS_ROUNDUP(nd, atonce) / atonce;
-	unsigned i, j, bad;
+	unsigned i, j, n, bad;
 
-	for (i=0; i<nblocks; i++) {
+	for (i=0; i<nblocks; i+=n) {
 		uint32_t block = dobmap(sfi, i);
 		if (block!=0) {
-			for (j=0; j<atonce; j++) {
+			n = dirrun(sfi, i, block, nblocks);
+			for (j=0; j<n*atonce; j++) {
 				swapdir(&d[i*atonce+j]);
 			}
-			diskwrite(d + i*atonce, block);
+			diskwriterun(d + i*atonce, block, n);
 		}
 		else {
+			n = 1;
 			for (j=bad=0; j<atonce; j++) {
 				if (d[i*atonce+j].sfd_ino != SFS_NOINO ||
 				    d[i*atonce+j].sfd_name[0] != 0) {
@@ -872,23 +1241,66 @@ dirsortfunc(const void *aa, const void *bb)
 	return strcmp(ad->sfd_name, bd->sfd_name);
 }
 
+/*
+ * The entries of a directory get checked in inode order, so that
+ * inodes packed into the same block come up one after the other.
+ */
+static
+int
+dirinosortfunc(const void *aa, const void *bb)
+{
+	const int *a = (const int *)aa;
+	const int *b = (const int *)bb;
+	uint32_t ai = global_sortdirs[*a].sfd_ino;
+	uint32_t bi = global_sortdirs[*b].sfd_ino;
+
+	if (ai < bi) {
+		return -1;
+	}
+	if (ai > bi) {
+		return 1;
+	}
+	return 0;
+}
+
 #ifdef NO_QSORT
 static
 void
+siftdown(int *data, int root, int num,
+	 int (*f)(const void *, const void *))
+{
+	int child, tmp;
+
+	while ((child = 2*root+1) < num) {
+		if (child+1 < num && f(&data[child], &data[child+1]) < 0) {
+			child++;
+		}
+		if (f(&data[root], &data[child]) >= 0) {
+			return;
+		}
+		tmp = data[root];
+		data[root] = data[child];
+		data[child] = tmp;
+		root = child;
+	}
+}
+
+/* heapsort, so big directories don't take quadratic time */
+static
+void
 qsort(int *data, int num, size_t size, int (*f)(const void *, const void *))
 {
-	int i, j;
+	int i, tmp;
 	(void)size;
 
-	/* because I'm lazy, bubble sort */
-	for (i=0; i<num-1; i++) {
-		for (j=i+1; j<num; j++) {
-			if (f(&data[i], &data[j]) < 0) {
-				int tmp = data[i];
-				data[i] = data[j];
-				data[j] = tmp;
-			}
-		}
+	for (i=num/2-1; i>=0; i--) {
+		siftdown(data, i, num, f);
+	}
+	for (i=num-1; i>0; i--) {
+		tmp = data[0];
+		data[0] = data[i];
+		data[i] = tmp;
+		siftdown(data, 0, i, f);
 	}
 }
 #endif
@@ -901,6 +1313,14 @@ sortdir(int *vector, struct sfs_dir *d, int nd)
 	qsort(vector, nd, sizeof(int), dirsortfunc);
 }
 
+static
+void
+sortdir_byino(int *vector, struct sfs_dir *d, int nd)
+{
+	global_sortdirs = d;
+	qsort(vector, nd, sizeof(int), dirinosortfunc);
+}
+
 /* tries to add a directory entry; returns 0 on success */
 static
 int
@@ -966,6 +1386,183 @@ check_dir_entry(const char *pathsofar, uint32_t index, struct sfs_dir *sfd)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Directory indexes (see kern/sfs.h). The index is only a cache of
+ * what's in the directory, so rather than repairing a bad one we
+ * drop it; the kernel builds a new one when it next needs it.
+ */
+
+/* must agree with sfs_dirindex_hash in the kernel */
+static
+uint32_t
+dirindex_hash(const char *name)
+{
+	uint32_t hash = 2166136261U;
+
+	while (*name != 0) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+typedef enum {
+	DI_CHECK,	/* Check the index against the entries */
+	DI_KEEP,	/* Mark the blocks in use */
+	DI_DROP,	/* Release the blocks */
+} dirindex_op_t;
+
+/*
+ * Walk one chain of an index, starting at BLOCK. For DI_CHECK, each
+ * entry on it has to be for a live entry in D whose name hashes to
+ * chain BUCKET, or if BUCKET is negative, for a free slot; SEEN
+ * records the slots found so far. *BUDGET bounds the number of
+ * blocks visited, so a loop in the chain can't hang us. Returns
+ * nonzero if the chain is bad.
+ */
+static
+int
+dirindex_chain(uint32_t ino, uint32_t block, int bucket,
+	       struct sfs_dir *d, uint32_t nd, uint8_t *seen,
+	       uint32_t *budget, dirindex_op_t op)
+{
+	struct sfs_dirchain dc;
+	uint32_t i, slot;
+	int first = 1;
+
+	for (; block != 0; block = dc.dc_next, first = 0) {
+		if (block >= nblocks || *budget == 0) {
+			return 1;
+		}
+		(*budget)--;
+
+		diskreadhead(&dc, block);
+		swapchain(&dc);
+
+		if (op == DI_KEEP) {
+			bitmap_mark(block, B_DIRINDEX, ino);
+			continue;
+		}
+		if (op == DI_DROP) {
+			bitmap_mark(block, B_TOFREE, 0);
+			continue;
+		}
+
+		if (dc.dc_count > SFS_DIRHASH_PERBLOCK || dc.dc_count == 0 ||
+		    (!first && dc.dc_count != SFS_DIRHASH_PERBLOCK)) {
+			return 1;
+		}
+		for (i=0; i<dc.dc_count; i++) {
+			slot = dc.dc_ents[i].dh_slot;
+			if (slot >= nd || seen[slot]) {
+				return 1;
+			}
+			seen[slot] = 1;
+			if (bucket < 0) {
+				if (d[slot].sfd_ino != SFS_NOINO) {
+					return 1;
+				}
+			}
+			else if (d[slot].sfd_ino == SFS_NOINO ||
+				 dc.dc_ents[i].dh_hash !=
+				 dirindex_hash(d[slot].sfd_name) ||
+				 dc.dc_ents[i].dh_hash % SFS_DIRHASH_NBUCKETS
+				 != (uint32_t)bucket) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Do OP to the whole index of directory inode INO, whose ND entries
+ * are in D. Returns nonzero if it's bad.
+ */
+static
+int
+dirindex_walk(uint32_t ino, uint32_t indexblock,
+	      struct sfs_dir *d, uint32_t nd, dirindex_op_t op)
+{
+	struct sfs_dirindex di;
+	uint8_t *seen;
+	uint32_t budget, i;
+	int bad = 0;
+
+	if (indexblock >= nblocks) {
+		return 1;
+	}
+
+	diskreadhead(&di, indexblock);
+	for (i=0; i<SFS_DIRHASH_NBUCKETS; i++) {
+		di.di_bucket[i] = SWAPL(di.di_bucket[i]);
+	}
+	di.di_free = SWAPL(di.di_free);
+
+	if (op == DI_KEEP) {
+		bitmap_mark(indexblock, B_DIRINDEX, ino);
+	}
+	else if (op == DI_DROP) {
+		bitmap_mark(indexblock, B_TOFREE, 0);
+	}
+
+	seen = domalloc(nd + 1);
+	bzero(seen, nd + 1);
+
+	/* a good index has at most this many chain blocks */
+	budget = SFS_DIRHASH_NBUCKETS + 1 + nd;
+
+	for (i=0; i<SFS_DIRHASH_NBUCKETS && !bad; i++) {
+		bad = dirindex_chain(ino, di.di_bucket[i], i, d, nd, seen,
+				     &budget, op);
+	}
+	if (!bad) {
+		bad = dirindex_chain(ino, di.di_free, -1, d, nd, seen,
+				     &budget, op);
+	}
+
+	/* every slot has to be on some chain */
+	for (i=0; i<nd && !bad && op == DI_CHECK; i++) {
+		if (!seen[i]) {
+			bad = 1;
+		}
+	}
+
+	free(seen);
+	return bad;
+}
+
+/* returns nonzero if inode modified */
+static
+int
+check_dirindex(uint32_t ino, struct sfs_inode *sfi, const char *pathsofar,
+	       struct sfs_dir *d, uint32_t nd, int dchanged)
+{
+	if (sfi->sfi_dirindex == 0) {
+		return 0;
+	}
+
+	if (!dchanged &&
+	    !dirindex_walk(ino, sfi->sfi_dirindex, d, nd, DI_CHECK)) {
+		dirindex_walk(ino, sfi->sfi_dirindex, d, nd, DI_KEEP);
+		return 0;
+	}
+
+	setbadness(EXIT_RECOV);
+	if (dchanged) {
+		warnx("Directory /%s: Index out of date (dropped)",
+		      pathsofar);
+	}
+	else {
+		warnx("Directory /%s: Index corrupt (dropped)", pathsofar);
+	}
+	dirindex_walk(ino, sfi->sfi_dirindex, d, nd, DI_DROP);
+	sfi->sfi_dirindex = 0;
+	return 1;
+}
+
+////////////////////////////////////////////////////////////
+
 static
 int
 check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
@@ -973,10 +1570,10 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 	struct sfs_inode sfi;
 	struct sfs_dir *direntries;
 	int *sortvector;
-	uint32_t dirsize, ndirentries, maxdirentries, subdircount, i;
+	uint32_t dirsize, ndirentries, maxdirentries, subdircount, i, j;
 	int ichanged=0, dchanged=0, dotseen=0, dotdotseen=0;
 
-	diskread(&sfi, ino);
+	inoderead(&sfi, ino);
 	swapinode(&sfi);
 
 	if (remember_dir(ino, pathsofar)) {
@@ -984,7 +1581,7 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 		return 1;
 	}
 
-	bitmap_mark(ino, B_INODE, ino);
+	inode_mark(ino);
 	count_dirs++;
 
 	if (sfi.sfi_size % sizeof(struct sfs_dir) != 0) {
@@ -1002,7 +1599,7 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 
 	ndirentries = sfi.sfi_size/sizeof(struct sfs_dir);
 	maxdirentries = SFS_ROUNDUP(ndirentries, 
-				    SFS_BLOCKSIZE/sizeof(struct sfs_dir));
+				    blocksize/sizeof(struct sfs_dir));
 	dirsize = maxdirentries * sizeof(struct sfs_dir);
 	direntries = domalloc(dirsize);
 	sortvector = domalloc(ndirentries * sizeof(int));
@@ -1127,8 +1724,14 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 		}
 	}
 
-	subdircount=0;
 	for (i=0; i<ndirentries; i++) {
+		sortvector[i] = i;
+	}
+	sortdir_byino(sortvector, direntries, ndirentries);
+
+	subdircount=0;
+	for (j=0; j<ndirentries; j++) {
+		i = sortvector[j];
 		if (!strcmp(direntries[i].sfd_name, ".")) {
 			/* nothing */
 		}
@@ -1142,7 +1745,7 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 			char path[strlen(pathsofar)+SFS_NAMELEN+1];
 			struct sfs_inode subsfi;
 
-			diskread(&subsfi, direntries[i].sfd_ino);
+			inoderead(&subsfi, direntries[i].sfd_ino);
 			swapinode(&subsfi);
 			snprintf(path, sizeof(path), "%s/%s", 
 				 pathsofar, direntries[i].sfd_name);
@@ -1152,8 +1755,8 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 				if (check_inode_blocks(direntries[i].sfd_ino,
 						       &subsfi, 0)) {
 					swapinode(&subsfi);
-					diskwrite(&subsfi, 
-						  direntries[i].sfd_ino);
+					inodewrite(&subsfi,
+						   direntries[i].sfd_ino);
 				}
 				observe_filelink(direntries[i].sfd_ino);
 				break;
@@ -1198,9 +1801,14 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 		dirwrite(&sfi, direntries, ndirentries);
 	}
 
+	if (check_dirindex(ino, &sfi, pathsofar, direntries, ndirentries,
+			   dchanged)) {
+		ichanged = 1;
+	}
+
 	if (ichanged) {
 		swapinode(&sfi);
-		diskwrite(&sfi, ino);
+		inodewrite(&sfi, ino);
 	}
 
 	free(direntries);
@@ -1210,12 +1818,87 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 }
 
 
+/*
+ * Finish off a transaction left committed in the journal, the same
+ * way mounting the volume would, so the rest of the check sees the
+ * metadata as it's meant to be. A transaction that doesn't add up is
+ * thrown away; its changes never happened.
+ */
+static
+void
+check_journal(void)
+{
+	struct sfs_jheader jh;
+	uint32_t buf[SFS_MAXBLOCKSIZE/sizeof(uint32_t)];
+	uint32_t i, k, sum, home;
+	int valid, jchanged=0;
+
+	if (jblocks == 0) {
+		return;
+	}
+
+	diskreadhead(&jh, jstart);
+	swapjheader(&jh);
+
+	if (jh.jh_magic != SFS_JMAGIC) {
+		warnx("Journal header has bad magic number (fixed)");
+		setbadness(EXIT_RECOV);
+		bzero(&jh, sizeof(jh));
+		jh.jh_magic = SFS_JMAGIC;
+		jchanged = 1;
+	}
+	else if (jh.jh_count != 0) {
+		valid = jh.jh_count <= SFS_JMAXBLOCKS;
+		for (i=0; valid && i<jh.jh_count; i++) {
+			home = jh.jh_home[i];
+			if (home == SFS_SB_LOCATION || home >= nblocks ||
+			    (home >= jstart && home < jstart + jblocks)) {
+				valid = 0;
+			}
+		}
+		sum = 0;
+		for (i=0; valid && i<jh.jh_count; i++) {
+			diskread(buf, jstart + 1 + i);
+			for (k=0; k<blocksize/sizeof(uint32_t); k++) {
+				sum = ((sum << 1) | (sum >> 31)) +
+					SWAPL(buf[k]);
+			}
+		}
+		if (valid && sum == jh.jh_sum) {
+			warnx("Replaying journal transaction %lu (fixed)",
+			      (unsigned long) jh.jh_seq);
+			for (i=0; i<jh.jh_count; i++) {
+				diskread(buf, jstart + 1 + i);
+				diskwrite(buf, jh.jh_home[i]);
+			}
+		}
+		else {
+			warnx("Journal transaction %lu incomplete "
+			      "(discarded)", (unsigned long) jh.jh_seq);
+		}
+		setbadness(EXIT_RECOV);
+		jh.jh_count = 0;
+		jchanged = 1;
+	}
+
+	if (jchanged) {
+		swapjheader(&jh);
+		diskwritehead(&jh, jstart);
+	}
+
+	for (i=0; i<jblocks; i++) {
+		bitmap_mark(jstart+i, B_JOURNAL, 0);
+	}
+}
+
 static
 void
 check_root_dir(void)
 {
 	struct sfs_inode sfi;
-	diskread(&sfi, SFS_ROOT_LOCATION);
+	uint32_t rootino = SFS_ROOT_INO(inoperblock);
+
+	inoderead(&sfi, rootino);
 	swapinode(&sfi);
 
 	switch (sfi.sfi_type) {
@@ -1231,11 +1914,11 @@ check_root_dir(void)
 		setbadness(EXIT_RECOV);
 		sfi.sfi_type = SFS_TYPE_DIR;
 		swapinode(&sfi);
-		diskwrite(&sfi, SFS_ROOT_LOCATION);
+		inodewrite(&sfi, rootino);
 		break;
 	}
 
-	check_dir(SFS_ROOT_LOCATION, SFS_ROOT_LOCATION, "");
+	check_dir(rootino, rootino, "");
 }
 
 ////////////////////////////////////////////////////////////
@@ -1252,13 +1935,18 @@ main(int argc, char **argv)
 	}
 
 	assert(sizeof(struct sfs_super)==SFS_BLOCKSIZE);
-	assert(sizeof(struct sfs_inode)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_inode)==SFS_INODESIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
+	assert(sizeof(struct sfs_dirindex)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_dirchain)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_jheader)==SFS_BLOCKSIZE);
 
 	opendisk(argv[1]);
 
 	check_sb();
+	check_journal();
 	check_root_dir();
+	check_orphans();
 	check_bitmap();
 	adjust_filelinks();
 